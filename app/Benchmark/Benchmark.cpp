@@ -0,0 +1,1992 @@
+#ifdef _MSC_VER
+#endif
+
+#include "SPSC.h"
+#include "MPSC.h"
+#include "SPMC.h"
+#include "Timer.h"
+#include "easywsclient.h"
+#include "wsocket.h"
+#include "ShardedServer.h"
+#include "Hub.h"
+#include "TimerWheel.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#if USE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#endif
+
+// Simple throughput benchmarks for the transports.
+// Run with no arguments to run all of them, or pass the name of a single benchmark.
+
+#define MP_RING_SIZE (1024*1024)		// Size of the shared buffer used by the multiple producer benchmark
+#define MP_PRODUCER_COUNT 4				// Number of writer threads
+#define MP_MESSAGE_COUNT 200000			// Messages sent by each writer thread
+#define MP_MESSAGE_SIZE 32				// Size of each message
+
+#define SPMC_RING_SIZE (1024*1024)		// Size of the shared buffer used by the broadcast ring benchmark
+#define SPMC_READERS 4					// Reader threads which keep up with the writer
+#define SPMC_MESSAGE_COUNT 200000		// Messages written
+#define SPMC_MESSAGE_SIZE 64			// Size of each message
+#define SPMC_WRITE_BURST 64				// The writer yields after this many messages, so readers get a turn on a busy machine
+#define SPMC_LAPPED_DELAY 50			// Milliseconds the extra, deliberately slow, reader sleeps before reading
+
+#define PING_PONG_COUNT 20000			// Round trips made by the websocket ping-pong benchmarks
+#define PING_PONG_SIZE 64				// Size of each ping-pong message
+#define PING_PONG_PORT 3099				// TCP port used by the loopback benchmark
+#define PING_PONG_UNIX_PATH "/tmp/wsclient_benchmark.sock"
+
+#define SHARED_PORT 3085				// Shared memory port used by the shared memory benchmarks
+#define SHARED_CLOSE_TIMEOUT 2			// Seconds the server gets to notice a lost client
+
+#define TLS_PORT 3095					// TCP port used by the TLS ping-pong benchmark
+#define TLS_CERTIFICATE_FILE "/tmp/wsclient_benchmark.crt"
+#define TLS_KEY_FILE "/tmp/wsclient_benchmark.key"
+
+#define BURST_PORT 3097					// TCP port used by the receive burst benchmark
+#define BURST_MESSAGE_COUNT 64			// Messages in each burst
+#define BURST_MESSAGE_SIZE (1024*16)	// Size of each burst message; a burst is 1mb
+#define BURST_COUNT 50					// Bursts sent
+
+#define TICK_PORT 3096					// TCP port used by the send policy benchmark
+#define TICK_MESSAGE_COUNT 1000			// Tiny messages sent by the client each tick
+#define TICK_MESSAGE_SIZE 32			// Size of each of those messages
+#define TICK_COUNT 200					// Ticks measured for each send policy
+
+#define FANOUT_PORT 3094					// TCP port used by the broadcast benchmarks
+#define FANOUT_SUBSCRIBERS 64			// Connections each message is broadcast to
+#define FANOUT_MESSAGE_COUNT 2000		// Messages broadcast
+#define FANOUT_MESSAGE_SIZE 1024		// Size of each of those messages
+
+#define HUB_PORT 3093					// TCP port used by the hub benchmark
+#define HUB_SUBSCRIBERS 256				// Connections in the hub
+#define HUB_TOPICS 8					// Each connection also joins one of these topics
+#define HUB_MESSAGE_COUNT 500			// Messages published to each topic
+
+#define SHARD_PORT 3092					// TCP port used by the sharded broadcast benchmark
+#define SHARD_WORKERS 4					// Workers in the sharded server
+#define SHARD_CLIENTS 256				// Connections spread across them
+#define SHARD_MESSAGE_COUNT 500			// Messages echoed to every connection
+#define SHARD_STORM_CLIENTS 8			// Connections which all send a burst at once for the broadcast storm
+#define SHARD_STORM_BURST 2000			// Messages each of them sends; the callbacks broadcast every one
+
+#define CONFLATE_PORT 3091				// TCP port used by the conflation benchmarks
+#define CONFLATE_KEYS 100				// Distinct keys updated round robin
+#define CONFLATE_UPDATES 200000			// Updates sent by the server
+#define CONFLATE_MESSAGE_SIZE 256		// Size of each update
+#define CONFLATE_READ_INTERVAL 10000	// The slow client is polled once per this many updates
+
+#define RATE_PORT 3090					// TCP port used by the rate limit benchmark
+#define RATE_MESSAGES 2000				// Messages queued on each of the two limited connections
+#define RATE_CONNECTION_LIMIT 1500		// Messages per second each connection may send
+#define RATE_GROUP_LIMIT 2000			// Messages per second the pair may send together
+
+#define BUDGET_PORT 3089				// TCP port used by the poll budget benchmarks
+#define BUDGET_FIREHOSE_SIZE (1024*16)	// Size of each message flooding the busy connection
+#define BUDGET_FIREHOSE_QUEUE (1024*1024)	// The busy connection's sender keeps this much queued
+#define BUDGET_PING_COUNT 2000			// Round trips made on the quiet connection
+#define BUDGET_READ_BYTES (1024*64)		// Poll budget given to the busy connection
+#define BUDGET_DISPATCH_FRAMES 4
+
+#define KEEPALIVE_PORT 3087				// TCP port used by the keepalive benchmarks
+#define KEEPALIVE_INTERVAL 1			// Milliseconds between the client's pings
+#define KEEPALIVE_SECONDS 1				// How long each run lasts
+#define KEEPALIVE_MESSAGE_SIZE (1024*16)	// Size of the messages queued behind the pongs when busy
+#define KEEPALIVE_QUEUE (1024*256)		// The busy server keeps this much queued for the client
+
+#define DRAIN_PORT 3088					// TCP port used by the drain benchmark
+#define DRAIN_CLIENTS 64				// Half of them keep reading; the other half never read again
+#define DRAIN_MESSAGE_COUNT 4			// Messages queued for every client before the drain
+#define DRAIN_MESSAGE_SIZE (1024*256)
+#define DRAIN_TIMEOUT 250				// Milliseconds the drain may take
+
+#define WHEEL_TIMERS 100000			// Timers running at once, as for that many connections
+#define WHEEL_ROUNDS 20					// Times each timer is cancelled and started again
+
+#define METRICS_PORT 3086				// TCP port used by the metrics benchmark; it runs the receive burst workload
+#define METRICS_INTERVAL 1				// Milliseconds between the watching thread's snapshots
+
+#define STORM_PORT 3098					// TCP port used by the accept storm benchmarks
+#define STORM_CLIENT_THREADS 8			// Number of threads connecting at once
+#define STORM_CONNECTIONS 64			// Connections opened by each client thread
+
+// Allocates cache line aligned memory to stand in for a shared memory mapping
+static void *allocRing(uint32_t size)
+{
+	void *ret = nullptr;
+#ifdef _MSC_VER
+	ret = _aligned_malloc(size, 64);
+#else
+	if (posix_memalign(&ret, 64, size) != 0)
+	{
+		ret = nullptr;
+	}
+#endif
+	if (ret)
+	{
+		memset(ret, 0, size);
+	}
+	return ret;
+}
+
+static void freeRing(void *mem)
+{
+#ifdef _MSC_VER
+	_aligned_free(mem);
+#else
+	free(mem);
+#endif
+}
+
+static void printResult(const char *name, uint64_t messageCount, double seconds, const char *unit="message")
+{
+	printf("%-32s : %10.0f %ss/sec %8.1f ns/%s\r\n", name, double(messageCount) / seconds, unit, seconds * 1e9 / double(messageCount), unit);
+}
+
+// Several writer threads sending to one reader; today that means a mutex around the single producer ring
+static void benchmarkMutexSPSC(void)
+{
+	void *mem = allocRing(MP_RING_SIZE);
+	spsc::SPSC writer;
+	spsc::SPSC reader;
+	writer.init(mem, MP_RING_SIZE, true, true);
+	reader.init(mem, MP_RING_SIZE, false, false);
+	std::mutex writeLock;
+	std::vector< std::thread * > producers;
+	timer::Timer t;
+	for (uint32_t i = 0; i < MP_PRODUCER_COUNT; i++)
+	{
+		producers.push_back(new std::thread([&writer, &writeLock]()
+		{
+			uint8_t message[MP_MESSAGE_SIZE];
+			memset(message, 1, sizeof(message));
+			for (uint32_t j = 0; j < MP_MESSAGE_COUNT; j++)
+			{
+				while (true)
+				{
+					bool sent;
+					{
+						std::lock_guard<std::mutex> lock(writeLock);
+						sent = writer.writeMessage(message, sizeof(message));
+					}
+					if (sent)
+					{
+						break;
+					}
+					std::this_thread::yield();
+				}
+			}
+		}));
+	}
+	uint64_t total = uint64_t(MP_PRODUCER_COUNT) * MP_MESSAGE_COUNT;
+	uint64_t received = 0;
+	while (received < total)
+	{
+		uint32_t len;
+		uint32_t type;
+		if (reader.peek(len, type))
+		{
+			reader.release();
+			received++;
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+	double seconds = t.peekElapsedSeconds();
+	for (auto &i : producers)
+	{
+		i->join();
+		delete i;
+	}
+	printResult("mutex around SPSC", total, seconds);
+	freeRing(mem);
+}
+
+// Several writer threads sending to one reader through the lock-free multiple producer ring
+static void benchmarkMPSC(void)
+{
+	void *mem = allocRing(MP_RING_SIZE);
+	mpsc::MPSC writer;
+	mpsc::MPSC reader;
+	writer.init(mem, MP_RING_SIZE, true, true);
+	reader.init(mem, MP_RING_SIZE, false, false);
+	std::vector< std::thread * > producers;
+	timer::Timer t;
+	for (uint32_t i = 0; i < MP_PRODUCER_COUNT; i++)
+	{
+		producers.push_back(new std::thread([&writer]()
+		{
+			uint8_t message[MP_MESSAGE_SIZE];
+			memset(message, 1, sizeof(message));
+			for (uint32_t j = 0; j < MP_MESSAGE_COUNT; j++)
+			{
+				while (!writer.writeMessage(message, sizeof(message)))
+				{
+					std::this_thread::yield();
+				}
+			}
+		}));
+	}
+	uint64_t total = uint64_t(MP_PRODUCER_COUNT) * MP_MESSAGE_COUNT;
+	uint64_t received = 0;
+	while (received < total)
+	{
+		uint32_t len;
+		uint32_t type;
+		if (reader.peek(len, type))
+		{
+			reader.release();
+			received++;
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+	double seconds = t.peekElapsedSeconds();
+	for (auto &i : producers)
+	{
+		i->join();
+		delete i;
+	}
+	printResult("MPSC", total, seconds);
+	freeRing(mem);
+}
+
+// What one reader of the broadcast ring saw
+struct SpmcReaderResult
+{
+	uint64_t	mMessages{ 0 };
+	uint32_t	mLaps{ 0 };
+	uint64_t	mTorn{ 0 };			// Messages whose payload was not all written by one write; must stay zero
+	uint64_t	mOutOfOrder{ 0 };	// Messages which didn't come after the previous one; must stay zero
+};
+
+// Reads the ring until the writer is done; 'delayMilliseconds' makes the reader fall a lap behind first
+static void readSpmc(void *mem, std::atomic< bool > &writerDone, uint32_t delayMilliseconds, SpmcReaderResult &result)
+{
+	spmc::SPMC reader;
+	if (!reader.init(mem, SPMC_RING_SIZE, false, false))
+	{
+		return;
+	}
+	if (delayMilliseconds)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(delayMilliseconds));
+	}
+	uint8_t message[SPMC_MESSAGE_SIZE];
+	uint64_t last = 0;
+	bool first = true;
+	while (true)
+	{
+		uint32_t len;
+		uint32_t type;
+		bool done = writerDone.load();
+		spmc::ReadStatus status = reader.read(message, sizeof(message), len, type);
+		if (status == spmc::ReadStatus::MESSAGE)
+		{
+			uint64_t sequence;
+			memcpy(&sequence, message, sizeof(sequence));
+			for (uint32_t i = sizeof(sequence); i < len; i++)
+			{
+				if (message[i] != uint8_t(sequence))
+				{
+					result.mTorn++;
+					break;
+				}
+			}
+			if (!first && sequence <= last)
+			{
+				result.mOutOfOrder++;
+			}
+			first = false;
+			last = sequence;
+			result.mMessages++;
+		}
+		else if (status == spmc::ReadStatus::EMPTY)
+		{
+			if (done)
+			{
+				break; // the writer had finished before we found the ring empty
+			}
+			std::this_thread::yield();
+		}
+	}
+	result.mLaps = reader.getLapCount();
+}
+
+// Claims a reader slot in a child process which then exits without detaching, as a crashed reader would,
+// and returns true if a reader in this process can still attach once every slot has been used that way
+static bool checkSpmcReclaim(void)
+{
+#ifdef _WIN32
+	return true;
+#else
+	void *mem = mmap(nullptr, SPMC_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+	{
+		return false;
+	}
+	spmc::SPMC writer;
+	writer.init(mem, SPMC_RING_SIZE, true, true);
+	pid_t child = fork();
+	if (child == 0)
+	{
+		for (uint32_t i = 0; i < spmc::cMaxReaders; i++)
+		{
+			(new spmc::SPMC())->init(mem, SPMC_RING_SIZE, false, false); // leaked on purpose; we exit without detaching
+		}
+		_exit(0);
+	}
+	int status;
+	waitpid(child, &status, 0);
+	bool ret = writer.getReaderCount() == spmc::cMaxReaders;
+	spmc::SPMC reader;
+	ret = ret && reader.init(mem, SPMC_RING_SIZE, false, false);
+	reader.detach();
+	munmap(mem, SPMC_RING_SIZE);
+	return ret;
+#endif
+}
+
+// One writer broadcasting to several reader threads through the single producer multiple consumer ring,
+// plus one reader which starts late so the writer laps it and it has to resynchronize
+static void benchmarkSPMC(void)
+{
+	void *mem = allocRing(SPMC_RING_SIZE);
+	spmc::SPMC writer;
+	writer.init(mem, SPMC_RING_SIZE, true, true);
+	std::atomic< bool > writerDone{ false };
+	SpmcReaderResult results[SPMC_READERS + 1];
+	std::vector< std::thread * > readers;
+	for (uint32_t i = 0; i <= SPMC_READERS; i++)
+	{
+		uint32_t delay = i == SPMC_READERS ? SPMC_LAPPED_DELAY : 0;
+		readers.push_back(new std::thread(readSpmc, mem, std::ref(writerDone), delay, std::ref(results[i])));
+	}
+	while (writer.getReaderCount() < SPMC_READERS + 1)
+	{
+		std::this_thread::yield();
+	}
+	timer::Timer t;
+	uint8_t message[SPMC_MESSAGE_SIZE];
+	for (uint64_t i = 1; i <= SPMC_MESSAGE_COUNT; i++)
+	{
+		memset(message, uint8_t(i), sizeof(message));
+		memcpy(message, &i, sizeof(i));
+		writer.write(message, sizeof(message));
+		if ((i % SPMC_WRITE_BURST) == 0)
+		{
+			std::this_thread::yield();
+		}
+	}
+	writerDone = true;
+	for (auto &i : readers)
+	{
+		i->join();
+		delete i;
+	}
+	double seconds = t.peekElapsedSeconds();
+	uint64_t delivered = 0;
+	for (auto &r : results)
+	{
+		delivered += r.mMessages;
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "SPMC, %d readers", SPMC_READERS + 1);
+	printResult(name, delivered, seconds, "read");
+	for (uint32_t i = 0; i <= SPMC_READERS; i++)
+	{
+		SpmcReaderResult &r = results[i];
+		printf("    reader %d%s: %d messages, %d laps, %d torn, %d out of order\r\n", i, i == SPMC_READERS ? " (late)" : "",
+			uint32_t(r.mMessages), r.mLaps, uint32_t(r.mTorn), uint32_t(r.mOutOfOrder));
+	}
+	printf("    slots of dead readers reclaimed: %s\r\n", checkSpmcReclaim() ? "yes" : "NO");
+	freeRing(mem);
+}
+
+// Counts the messages received on one side of a websocket connection
+class PingPongCallback : public easywsclient::WebSocketCallback
+{
+public:
+	virtual void receiveMessage(const void *data, uint32_t dataLen, bool isAscii) override final
+	{
+		mReceiveCount++;
+	}
+
+	uint32_t	mReceiveCount{ 0 };
+};
+
+class CountingTimerCallback : public timerwheel::TimerWheelCallback
+{
+public:
+	virtual void onTimer(uint32_t id) override final
+	{
+		mFireCount++;
+	}
+
+	uint32_t	mFireCount{ 0 };
+};
+
+// Every connection restarting its timer, as an idle or ping timeout does when traffic arrives.
+// The wheel cancels and schedules in constant time; the ordered map it replaces pays log(n) for both.
+static void benchmarkTimerWheel(void)
+{
+	timerwheel::TimerWheel *wheel = timerwheel::TimerWheel::create();
+	CountingTimerCallback callback;
+	std::vector< uint64_t > timers(WHEEL_TIMERS);
+	timer::Timer t;
+	for (uint32_t round = 0; round < WHEEL_ROUNDS; round++)
+	{
+		for (uint32_t i = 0; i < WHEEL_TIMERS; i++)
+		{
+			if (timers[i])
+			{
+				wheel->cancel(timers[i]);
+			}
+			timers[i] = wheel->schedule(1000 + (i * 7919) % 60000, &callback, i);
+		}
+	}
+	double seconds = t.peekElapsedSeconds();
+	printResult("timer wheel restart", uint64_t(WHEEL_TIMERS) * WHEEL_ROUNDS, seconds, "restart");
+	wheel->release();
+}
+
+static void benchmarkTimerMap(void)
+{
+	typedef std::multimap< uint64_t, uint32_t > TimerMap;
+	TimerMap map;
+	std::vector< TimerMap::iterator > timers(WHEEL_TIMERS, map.end());
+	timer::Timer t;
+	for (uint32_t round = 0; round < WHEEL_ROUNDS; round++)
+	{
+		uint64_t now = uint64_t(t.peekElapsedSeconds() * 1000);
+		for (uint32_t i = 0; i < WHEEL_TIMERS; i++)
+		{
+			if (timers[i] != map.end())
+			{
+				map.erase(timers[i]);
+			}
+			timers[i] = map.insert(std::make_pair(now + 1000 + (i * 7919) % 60000, i));
+		}
+	}
+	double seconds = t.peekElapsedSeconds();
+	printResult("ordered map restart", uint64_t(WHEEL_TIMERS) * WHEEL_ROUNDS, seconds, "restart");
+}
+
+// Bounces a small binary message between a client and server on this host, one round trip at a time.
+// Both ends are polled from this thread, so this measures the per message cost of the transport.
+static void benchmarkPingPong(const char *name, const char *serverHost, int32_t port, const char *url, const wsocket::SocketOptions *options=nullptr)
+{
+	wsocket::Wsocket *listener = wsocket::Wsocket::create(serverHost, port, options);
+	if (!listener)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	easywsclient::WebSocket *client = easywsclient::WebSocket::create(url, "", true, options);
+	wsocket::Wsocket *accepted = nullptr;
+	timer::Timer connectTimer;
+	while (client && !accepted && connectTimer.peekElapsedSeconds() < 5)
+	{
+		client->poll(nullptr); // the client connects in the background
+		accepted = listener->pollServer();
+	}
+	easywsclient::WebSocket *server = accepted ? easywsclient::WebSocket::create(accepted) : nullptr;
+	if (!client || !server)
+	{
+		printf("%-32s : unable to connect\r\n", name);
+	}
+	else
+	{
+		PingPongCallback clientCallback;
+		PingPongCallback serverCallback;
+		while (server->getReadyState() == easywsclient::WebSocket::CONNECTING ||
+			client->getReadyState() == easywsclient::WebSocket::CONNECTING)
+		{
+			client->poll(&clientCallback);
+			server->poll(&serverCallback);
+		}
+		uint8_t message[PING_PONG_SIZE];
+		memset(message, 1, sizeof(message));
+		timer::Timer t;
+		for (uint32_t i = 0; i < PING_PONG_COUNT && client->getReadyState() == easywsclient::WebSocket::OPEN; i++)
+		{
+			client->sendBinary(message, sizeof(message));
+			while (serverCallback.mReceiveCount == i)
+			{
+				client->poll(&clientCallback);
+				server->poll(&serverCallback);
+			}
+			server->sendBinary(message, sizeof(message));
+			while (clientCallback.mReceiveCount == i)
+			{
+				server->poll(&serverCallback);
+				client->poll(&clientCallback);
+			}
+		}
+		double seconds = t.peekElapsedSeconds();
+		printResult(name, clientCallback.mReceiveCount, seconds);
+		easywsclient::WebSocketStats stats;
+		client->getStats(stats);
+		if (stats.mTls)
+		{
+			printf("    kernel TLS: send %s, receive %s\r\n", stats.mKernelTlsSend ? "yes" : "no", stats.mKernelTlsReceive ? "yes" : "no");
+		}
+		wsocket::TransportInfo info;
+		if (client->getTransportInfo(info))
+		{
+			printf("    rtt %dus (variance %dus, min %dus), cwnd %d, %d retransmits\r\n",
+				info.mRtt, info.mRttVariance, info.mMinRtt, info.mCongestionWindow, info.mTotalRetransmits);
+		}
+	}
+	delete client;
+	delete server;
+	listener->release();
+}
+
+static void benchmarkTcpPingPong(void)
+{
+	benchmarkPingPong("websocket ping-pong TCP loopback", SOCKET_SERVER, PING_PONG_PORT, "ws://localhost:3099");
+}
+
+static void benchmarkUnixPingPong(void)
+{
+	benchmarkPingPong("websocket ping-pong unix socket", UNIX_SERVER_PREFIX PING_PONG_UNIX_PATH, 0, "ws+unix://" PING_PONG_UNIX_PATH);
+}
+
+static void benchmarkSharedPingPong(void)
+{
+	benchmarkPingPong("websocket ping-pong shared memory", SHARED_SERVER, SHARED_PORT, "ws://" SHARED_CLIENT ":3085");
+}
+
+// Polls a new shared memory client until the listener has accepted it and both ends are open.
+// Returns the server's end of the connection, or null if it didn't get there.
+static easywsclient::WebSocket *acceptShared(wsocket::Wsocket *listener, easywsclient::WebSocket *client)
+{
+	easywsclient::WebSocket *server = nullptr;
+	timer::Timer t;
+	while (client && t.peekElapsedSeconds() < 5)
+	{
+		client->poll(nullptr);
+		if (server)
+		{
+			server->poll(nullptr);
+			if (server->getReadyState() != easywsclient::WebSocket::CONNECTING &&
+				client->getReadyState() != easywsclient::WebSocket::CONNECTING)
+			{
+				break;
+			}
+		}
+		else
+		{
+			wsocket::Wsocket *accepted = listener->pollServer();
+			server = accepted ? easywsclient::WebSocket::create(accepted) : nullptr;
+		}
+	}
+	if (server && server->getReadyState() != easywsclient::WebSocket::OPEN)
+	{
+		delete server;
+		server = nullptr;
+	}
+	return server;
+}
+
+// Polls the server's end of a connection whose client is gone; returns the seconds it took to see
+// it as closed, or a negative number if it never did
+static double waitForSharedClose(easywsclient::WebSocket *server)
+{
+	timer::Timer t;
+	while (server->getReadyState() != easywsclient::WebSocket::CLOSED)
+	{
+		if (t.peekElapsedSeconds() >= SHARED_CLOSE_TIMEOUT)
+		{
+			return -1;
+		}
+		server->poll(nullptr);
+	}
+	return t.peekElapsedSeconds();
+}
+
+// A shared memory server losing its client, once to a crash and once to a clean close, and a new
+// client attaching after each. Also checks a second server can't take over a port which is in use.
+static void benchmarkSharedReattach(void)
+{
+	const char *name = "shared memory reattach";
+	const char *url = "ws://" SHARED_CLIENT ":3085";
+	wsocket::Wsocket *listener = wsocket::Wsocket::create(SHARED_SERVER, SHARED_PORT);
+	if (!listener)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	wsocket::Wsocket *second = wsocket::Wsocket::create(SHARED_SERVER, SHARED_PORT);
+	bool refused = second == nullptr;
+	if (second)
+	{
+		second->release();
+	}
+	double killedSeconds = -1;
+	easywsclient::WebSocket *server = nullptr;
+#ifndef _WIN32
+	// A client in another process which is killed while connected
+	pid_t child = fork();
+	if (child == 0)
+	{
+		easywsclient::WebSocket *ws = easywsclient::WebSocket::create(url);
+		while (ws && ws->getReadyState() != easywsclient::WebSocket::CLOSED)
+		{
+			ws->poll(nullptr);
+		}
+		_exit(0);
+	}
+	timer::Timer acceptTimer;
+	while (!server && acceptTimer.peekElapsedSeconds() < 5)
+	{
+		wsocket::Wsocket *accepted = listener->pollServer();
+		server = accepted ? easywsclient::WebSocket::create(accepted) : nullptr;
+	}
+	while (server && server->getReadyState() == easywsclient::WebSocket::CONNECTING && acceptTimer.peekElapsedSeconds() < 5)
+	{
+		server->poll(nullptr);
+	}
+	kill(child, SIGKILL);
+	int status;
+	waitpid(child, &status, 0);
+	if (server && server->getReadyState() == easywsclient::WebSocket::OPEN)
+	{
+		killedSeconds = waitForSharedClose(server);
+	}
+	delete server;
+#endif
+	// A client in this process which closes
+	double droppedSeconds = -1;
+	easywsclient::WebSocket *client = easywsclient::WebSocket::create(url);
+	server = acceptShared(listener, client);
+	if (server)
+	{
+		delete client;
+		client = nullptr;
+		droppedSeconds = waitForSharedClose(server);
+		delete server;
+	}
+	delete client;
+	// And one more, which has to be able to talk to the server
+	bool reattached = false;
+	client = easywsclient::WebSocket::create(url);
+	server = acceptShared(listener, client);
+	if (server)
+	{
+		PingPongCallback callback;
+		client->sendText("hello");
+		timer::Timer t;
+		while (callback.mReceiveCount == 0 && t.peekElapsedSeconds() < 5)
+		{
+			client->poll(nullptr);
+			server->poll(&callback);
+		}
+		reattached = callback.mReceiveCount == 1;
+		delete server;
+	}
+	delete client;
+	listener->release();
+	printf("%-32s : killed client closed in %.0fms, closed client in %.0fms, reattach %s, second server %s\r\n",
+		name, killedSeconds * 1000, droppedSeconds * 1000, reattached ? "ok" : "FAILED", refused ? "refused" : "NOT REFUSED");
+}
+
+#if USE_OPENSSL
+// Writes a self signed certificate for 'localhost' and its key, for the TLS benchmark's server to present
+static bool writeTestCertificate(const char *certificateFile, const char *keyFile)
+{
+	bool ok = false;
+	EVP_PKEY *key = nullptr;
+	EVP_PKEY_CTX *keyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+	if (keyContext && EVP_PKEY_keygen_init(keyContext) == 1 &&
+		EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyContext, NID_X9_62_prime256v1) == 1 &&
+		EVP_PKEY_keygen(keyContext, &key) == 1)
+	{
+		X509 *certificate = X509_new();
+		X509_set_version(certificate, 2);
+		ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+		X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+		X509_gmtime_adj(X509_getm_notAfter(certificate), 60 * 60);
+		X509_set_pubkey(certificate, key);
+		X509_NAME *name = X509_get_subject_name(certificate);
+		X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+		X509_set_issuer_name(certificate, name);
+		X509_EXTENSION *altName = X509V3_EXT_conf_nid(nullptr, nullptr, NID_subject_alt_name, (char *)"DNS:localhost");
+		if (altName)
+		{
+			X509_add_ext(certificate, altName, -1);
+			X509_EXTENSION_free(altName);
+		}
+		if (X509_sign(certificate, key, EVP_sha256()) > 0)
+		{
+			FILE *fph = fopen(certificateFile, "wb");
+			FILE *kfph = fopen(keyFile, "wb");
+			ok = fph && kfph && PEM_write_X509(fph, certificate) == 1 &&
+				PEM_write_PrivateKey(kfph, key, nullptr, nullptr, 0, nullptr, nullptr) == 1;
+			if (fph)
+			{
+				fclose(fph);
+			}
+			if (kfph)
+			{
+				fclose(kfph);
+			}
+		}
+		X509_free(certificate);
+		EVP_PKEY_free(key);
+	}
+	EVP_PKEY_CTX_free(keyContext);
+	return ok;
+}
+
+// The same ping-pong over TLS; the client verifies the server against its self signed certificate
+static void benchmarkTlsPingPong(void)
+{
+	const char *name = "websocket ping-pong TLS loopback";
+	if (!writeTestCertificate(TLS_CERTIFICATE_FILE, TLS_KEY_FILE))
+	{
+		printf("%-32s : unable to create a test certificate\r\n", name);
+		return;
+	}
+	wsocket::SocketOptions options;
+	options.mTlsCertificateFile = TLS_CERTIFICATE_FILE;
+	options.mTlsPrivateKeyFile = TLS_KEY_FILE;
+	options.mTlsCaFile = TLS_CERTIFICATE_FILE;
+	benchmarkPingPong(name, TLS_SERVER, TLS_PORT, "wss://localhost:3095", &options);
+}
+#endif
+
+// Connects a client to this listener and completes the handshake on both ends
+static bool connectLoopback(wsocket::Wsocket *listener, const char *url, easywsclient::WebSocket *&client, easywsclient::WebSocket *&server)
+{
+	client = easywsclient::WebSocket::create(url);
+	wsocket::Wsocket *accepted = nullptr;
+	timer::Timer connectTimer;
+	while (client && !accepted && connectTimer.peekElapsedSeconds() < 5)
+	{
+		client->poll(nullptr);
+		accepted = listener->pollServer();
+	}
+	server = accepted ? easywsclient::WebSocket::create(accepted, false) : nullptr;
+	if (!client || !server)
+	{
+		return false;
+	}
+	while (server->getReadyState() == easywsclient::WebSocket::CONNECTING ||
+		client->getReadyState() == easywsclient::WebSocket::CONNECTING)
+	{
+		client->poll(nullptr);
+		server->poll(nullptr);
+	}
+	return client->getReadyState() == easywsclient::WebSocket::OPEN && server->getReadyState() == easywsclient::WebSocket::OPEN;
+}
+
+// The server writes a 1mb burst at a time and the client reads it.
+// Reports how many receive calls the client made, against the one per 4kb a fixed read size would need.
+static void benchmarkReceiveBurst(void)
+{
+	const char *name = "receive burst TCP loopback";
+	wsocket::Wsocket *listener = wsocket::Wsocket::create(SOCKET_SERVER, BURST_PORT);
+	if (!listener)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	easywsclient::WebSocket *client = nullptr;
+	easywsclient::WebSocket *server = nullptr;
+	if (!connectLoopback(listener, "ws://localhost:3097", client, server))
+	{
+		printf("%-32s : unable to connect\r\n", name);
+	}
+	else
+	{
+		PingPongCallback clientCallback;
+		PingPongCallback serverCallback;
+		easywsclient::WebSocketStats before;
+		client->getStats(before);
+		std::vector< uint8_t > message(BURST_MESSAGE_SIZE, 1);
+		timer::Timer t;
+		for (uint32_t i = 0; i < BURST_COUNT && client->getReadyState() == easywsclient::WebSocket::OPEN; i++)
+		{
+			for (uint32_t j = 0; j < BURST_MESSAGE_COUNT; j++)
+			{
+				server->sendBinary(&message[0], BURST_MESSAGE_SIZE);
+			}
+			uint32_t expected = (i + 1) * BURST_MESSAGE_COUNT;
+			while (clientCallback.mReceiveCount < expected && client->getReadyState() == easywsclient::WebSocket::OPEN)
+			{
+				server->poll(&serverCallback);
+				client->poll(&clientCallback);
+			}
+		}
+		double seconds = t.peekElapsedSeconds();
+		easywsclient::WebSocketStats after;
+		client->getStats(after);
+		uint64_t calls = after.mReceiveCalls - before.mReceiveCalls;
+		uint64_t bytes = after.mReceiveBytes - before.mReceiveBytes;
+		printResult(name, clientCallback.mReceiveCount, seconds);
+		printf("    %d receive calls (%d found nothing), %d bytes per call; fixed 4kb reads need %d; read size now %d\r\n",
+			uint32_t(calls), uint32_t(after.mReceiveWouldBlock - before.mReceiveWouldBlock), uint32_t(calls ? bytes / calls : 0),
+			uint32_t(bytes / 4096), after.mReadSize);
+	}
+	delete client;
+	delete server;
+	listener->release();
+}
+
+// A client sending a thousand tiny messages per tick, as a game or market data feed might.
+// Compares the send policies by throughput and by how many send calls each tick costs.
+static void benchmarkSendPolicy(const char *name, easywsclient::SendPolicy policy, bool corked)
+{
+	wsocket::Wsocket *listener = wsocket::Wsocket::create(SOCKET_SERVER, TICK_PORT);
+	if (!listener)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	easywsclient::WebSocket *client = nullptr;
+	easywsclient::WebSocket *server = nullptr;
+	if (!connectLoopback(listener, "ws://localhost:3096", client, server))
+	{
+		printf("%-32s : unable to connect\r\n", name);
+	}
+	else
+	{
+		PingPongCallback clientCallback;
+		PingPongCallback serverCallback;
+		client->setSendPolicy(policy, 1024 * 16, 100);
+		easywsclient::WebSocketStats before;
+		client->getStats(before);
+		uint8_t message[TICK_MESSAGE_SIZE];
+		memset(message, 1, sizeof(message));
+		timer::Timer t;
+		for (uint32_t i = 0; i < TICK_COUNT && client->getReadyState() == easywsclient::WebSocket::OPEN; i++)
+		{
+			if (corked)
+			{
+				client->cork();
+			}
+			for (uint32_t j = 0; j < TICK_MESSAGE_COUNT; j++)
+			{
+				client->sendBinary(message, sizeof(message));
+			}
+			if (corked)
+			{
+				client->uncork();
+			}
+			uint32_t expected = (i + 1) * TICK_MESSAGE_COUNT;
+			while (serverCallback.mReceiveCount < expected && client->getReadyState() == easywsclient::WebSocket::OPEN)
+			{
+				client->poll(&clientCallback);
+				server->poll(&serverCallback);
+			}
+		}
+		double seconds = t.peekElapsedSeconds();
+		easywsclient::WebSocketStats after;
+		client->getStats(after);
+		printResult(name, serverCallback.mReceiveCount, seconds);
+		printf("    %0.1f send calls per tick\r\n", double(after.mSendCalls - before.mSendCalls) / TICK_COUNT);
+	}
+	delete client;
+	delete server;
+	listener->release();
+}
+
+static void benchmarkSendOnPoll(void)
+{
+	benchmarkSendPolicy("send policy: on poll", easywsclient::SendPolicy::ON_POLL, false);
+}
+
+static void benchmarkSendImmediate(void)
+{
+	benchmarkSendPolicy("send policy: immediate", easywsclient::SendPolicy::IMMEDIATE, false);
+}
+
+static void benchmarkSendCoalesce(void)
+{
+	benchmarkSendPolicy("send policy: coalesce 16kb/100us", easywsclient::SendPolicy::COALESCE, false);
+}
+
+static void benchmarkSendCorked(void)
+{
+	benchmarkSendPolicy("send policy: immediate, corked", easywsclient::SendPolicy::IMMEDIATE, true);
+}
+
+// Counts connections on a sharded server; callbacks arrive concurrently from every worker
+class StormCallback : public shardedserver::ShardedServerCallback
+{
+public:
+	virtual void onConnect(uint32_t worker, easywsclient::WebSocket *connection) override final
+	{
+		mConnectCount++;
+	}
+
+	virtual void onMessage(uint32_t worker, easywsclient::WebSocket *connection, const void *data, uint32_t dataLen, bool isAscii) override final
+	{
+	}
+
+	virtual void onDisconnect(uint32_t worker, easywsclient::WebSocket *connection) override final
+	{
+	}
+
+	std::atomic<uint32_t>	mConnectCount{ 0 };
+};
+
+// Many clients connecting at once, as happens when they all reconnect after a failover.
+// Measures the time until every client has completed its websocket handshake.
+// With an admission cap, refused clients fail their handshake instead of completing it.
+static void benchmarkAcceptStorm(const char *name, uint32_t workerCount, uint32_t maxPendingHandshakes=0)
+{
+	StormCallback callback;
+	wsocket::SocketOptions options;
+	options.mMaxPendingHandshakes = maxPendingHandshakes;
+	shardedserver::ShardedServer *server = shardedserver::ShardedServer::create(STORM_PORT, workerCount, &callback, &options);
+	if (!server)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	std::atomic<uint32_t> openCount{ 0 };
+	std::atomic<uint32_t> failCount{ 0 };
+	std::vector< std::thread * > clients;
+	timer::Timer t;
+	for (uint32_t i = 0; i < STORM_CLIENT_THREADS; i++)
+	{
+		clients.push_back(new std::thread([&openCount, &failCount]()
+		{
+			std::vector< easywsclient::WebSocket * > connections;
+			for (uint32_t j = 0; j < STORM_CONNECTIONS; j++)
+			{
+				easywsclient::WebSocket *ws = easywsclient::WebSocket::create("ws://localhost:3098");
+				if (ws)
+				{
+					connections.push_back(ws);
+				}
+			}
+			for (auto &ws : connections)
+			{
+				while (ws->getReadyState() == easywsclient::WebSocket::CONNECTING)
+				{
+					ws->poll(nullptr);
+					std::this_thread::yield();
+				}
+				if (ws->getReadyState() == easywsclient::WebSocket::OPEN)
+				{
+					openCount++;
+				}
+				else
+				{
+					failCount++;
+				}
+			}
+			for (auto &ws : connections)
+			{
+				delete ws;
+			}
+		}));
+	}
+	uint32_t total = STORM_CLIENT_THREADS * STORM_CONNECTIONS;
+	while (openCount + failCount < total && t.peekElapsedSeconds() < 30)
+	{
+		std::this_thread::yield();
+	}
+	double seconds = t.peekElapsedSeconds();
+	for (auto &i : clients)
+	{
+		i->join();
+		delete i;
+	}
+	printResult(name, openCount + failCount, seconds, "connection");
+	for (uint32_t i = 0; i < server->getWorkerCount(); i++)
+	{
+		printf("    worker %d accepted %d connections, refused %d, stole %d\r\n", i, uint32_t(server->getAcceptCount(i)),
+			uint32_t(server->getShedCount(i)), uint32_t(server->getStealCount(i)));
+	}
+	server->release();
+}
+
+static void benchmarkAcceptStormSingle(void)
+{
+	benchmarkAcceptStorm("accept storm, one worker", 1);
+}
+
+static void benchmarkAcceptStormSharded(void)
+{
+	benchmarkAcceptStorm("accept storm, worker per core", 0);
+}
+
+static void benchmarkAcceptStormCapped(void)
+{
+	benchmarkAcceptStorm("accept storm, 4 pending handshakes", 1, 4);
+}
+
+// The server broadcasts each message to every subscriber, either copying it into each connection with
+// sendBinary or encoding it once as a PreparedFrame which every connection queues by reference.
+// Reports the time spent queueing, and the total time until every subscriber has every message.
+static void benchmarkFanout(const char *name, bool prepared)
+{
+	wsocket::Wsocket *listener = wsocket::Wsocket::create(SOCKET_SERVER, FANOUT_PORT);
+	if (!listener)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	std::vector< easywsclient::WebSocket * > clients;
+	std::vector< easywsclient::WebSocket * > servers;
+	std::vector< PingPongCallback > callbacks(FANOUT_SUBSCRIBERS);
+	for (uint32_t i = 0; i < FANOUT_SUBSCRIBERS; i++)
+	{
+		easywsclient::WebSocket *client = nullptr;
+		easywsclient::WebSocket *server = nullptr;
+		bool ok = connectLoopback(listener, "ws://localhost:3094", client, server);
+		if (client)
+		{
+			clients.push_back(client);
+		}
+		if (server)
+		{
+			servers.push_back(server);
+		}
+		if (!ok)
+		{
+			break;
+		}
+	}
+	if (servers.size() != FANOUT_SUBSCRIBERS || clients.size() != FANOUT_SUBSCRIBERS)
+	{
+		printf("%-32s : unable to connect\r\n", name);
+	}
+	else
+	{
+		PingPongCallback serverCallback;
+		std::vector< uint8_t > message(FANOUT_MESSAGE_SIZE, 1);
+		double queueSeconds = 0;
+		timer::Timer t;
+		for (uint32_t i = 0; i < FANOUT_MESSAGE_COUNT; i++)
+		{
+			timer::Timer q;
+			if (prepared)
+			{
+				easywsclient::PreparedFrame *frame = easywsclient::PreparedFrame::create(&message[0], FANOUT_MESSAGE_SIZE, false);
+				for (auto &s : servers)
+				{
+					s->sendFrame(frame);
+				}
+				frame->release();
+			}
+			else
+			{
+				for (auto &s : servers)
+				{
+					s->sendBinary(&message[0], FANOUT_MESSAGE_SIZE);
+				}
+			}
+			queueSeconds += q.peekElapsedSeconds();
+			bool waiting = true;
+			while (waiting)
+			{
+				waiting = false;
+				for (uint32_t j = 0; j < FANOUT_SUBSCRIBERS; j++)
+				{
+					servers[j]->poll(&serverCallback);
+					clients[j]->poll(&callbacks[j]);
+					if (callbacks[j].mReceiveCount <= i && clients[j]->getReadyState() == easywsclient::WebSocket::OPEN)
+					{
+						waiting = true;
+					}
+				}
+			}
+		}
+		double seconds = t.peekElapsedSeconds();
+		uint32_t received = 0;
+		for (auto &c : callbacks)
+		{
+			received += c.mReceiveCount;
+		}
+		printResult(name, received, seconds);
+		printf("    %0.1f ns per subscriber to queue each message\r\n", queueSeconds * 1e9 / (double(FANOUT_MESSAGE_COUNT) * FANOUT_SUBSCRIBERS));
+	}
+	for (auto &c : clients)
+	{
+		delete c;
+	}
+	for (auto &s : servers)
+	{
+		delete s;
+	}
+	listener->release();
+}
+
+static void benchmarkFanoutCopy(void)
+{
+	benchmarkFanout("broadcast, copied per connection", false);
+}
+
+static void benchmarkFanoutPrepared(void)
+{
+	benchmarkFanout("broadcast, prepared frame", true);
+}
+
+// Connections join a common topic and one of several smaller ones; the server publishes to every topic
+// in turn through a Hub and every subscriber is polled until it has its messages.
+// Also reports what it costs to remove all the connections, each with two subscriptions.
+static void benchmarkHub(void)
+{
+	const char *name = "hub publish";
+	wsocket::Wsocket *listener = wsocket::Wsocket::create(SOCKET_SERVER, HUB_PORT);
+	if (!listener)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	hub::Hub *h = hub::Hub::create(false);
+	std::vector< easywsclient::WebSocket * > clients;
+	std::vector< easywsclient::WebSocket * > servers;
+	std::vector< PingPongCallback > callbacks(HUB_SUBSCRIBERS);
+	for (uint32_t i = 0; i < HUB_SUBSCRIBERS; i++)
+	{
+		easywsclient::WebSocket *client = nullptr;
+		easywsclient::WebSocket *server = nullptr;
+		bool ok = connectLoopback(listener, "ws://localhost:3093", client, server);
+		if (client)
+		{
+			clients.push_back(client);
+		}
+		if (server)
+		{
+			servers.push_back(server);
+			char topic[32];
+			snprintf(topic, sizeof(topic), "topic%d", i % HUB_TOPICS);
+			h->addConnection(server);
+			h->subscribe(server, "all");
+			h->subscribe(server, topic);
+		}
+		if (!ok)
+		{
+			break;
+		}
+	}
+	if (servers.size() != HUB_SUBSCRIBERS || clients.size() != HUB_SUBSCRIBERS)
+	{
+		printf("%-32s : unable to connect\r\n", name);
+	}
+	else
+	{
+		PingPongCallback serverCallback;
+		uint8_t message[256];
+		memset(message, 1, sizeof(message));
+		uint32_t expected = 0;
+		timer::Timer t;
+		for (uint32_t i = 0; i < HUB_MESSAGE_COUNT; i++)
+		{
+			h->publish("all", message, sizeof(message), false);
+			for (uint32_t j = 0; j < HUB_TOPICS; j++)
+			{
+				char topic[32];
+				snprintf(topic, sizeof(topic), "topic%d", j);
+				h->publish(topic, message, sizeof(message), false);
+			}
+			expected += 2;
+			bool waiting = true;
+			while (waiting)
+			{
+				waiting = false;
+				for (uint32_t j = 0; j < HUB_SUBSCRIBERS; j++)
+				{
+					servers[j]->poll(&serverCallback);
+					clients[j]->poll(&callbacks[j]);
+					if (callbacks[j].mReceiveCount < expected && clients[j]->getReadyState() == easywsclient::WebSocket::OPEN)
+					{
+						waiting = true;
+					}
+				}
+			}
+		}
+		double seconds = t.peekElapsedSeconds();
+		uint32_t received = 0;
+		for (auto &c : callbacks)
+		{
+			received += c.mReceiveCount;
+		}
+		printResult(name, received, seconds);
+		timer::Timer r;
+		for (auto &s : servers)
+		{
+			h->removeConnection(s);
+		}
+		printf("    %0.1f ns to remove each connection; %d topics left\r\n", r.peekElapsedSeconds() * 1e9 / HUB_SUBSCRIBERS, h->getTopicCount());
+	}
+	h->release();
+	for (auto &c : clients)
+	{
+		delete c;
+	}
+	for (auto &s : servers)
+	{
+		delete s;
+	}
+	listener->release();
+}
+
+// The server streams updates for a set of keys faster than the client reads them.
+// Sent as plain binary messages every update is buffered; conflated, only the latest per key waits.
+static void benchmarkConflate(const char *name, bool conflate)
+{
+	wsocket::SocketOptions options;
+	options.mSendBufferSize = 1024 * 64; // keep the kernel from absorbing the backlog
+	wsocket::Wsocket *listener = wsocket::Wsocket::create(SOCKET_SERVER, CONFLATE_PORT, &options);
+	if (!listener)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	easywsclient::WebSocket *client = nullptr;
+	easywsclient::WebSocket *server = nullptr;
+	if (!connectLoopback(listener, "ws://localhost:3091", client, server))
+	{
+		printf("%-32s : unable to connect\r\n", name);
+	}
+	else
+	{
+		PingPongCallback clientCallback;
+		PingPongCallback serverCallback;
+		uint8_t message[CONFLATE_MESSAGE_SIZE];
+		memset(message, 1, sizeof(message));
+		uint32_t peak = 0;
+		timer::Timer t;
+		for (uint32_t i = 0; i < CONFLATE_UPDATES; i++)
+		{
+			if (conflate)
+			{
+				server->sendConflated(i % CONFLATE_KEYS, message, sizeof(message), false);
+			}
+			else
+			{
+				server->sendBinary(message, sizeof(message));
+			}
+			server->poll(&serverCallback);
+			uint32_t size = server->getTransmitBufferSize();
+			peak = size > peak ? size : peak;
+			if ((i % CONFLATE_READ_INTERVAL) == 0)
+			{
+				client->poll(&clientCallback);
+			}
+		}
+		// Let the client catch up
+		while ((server->getTransmitBufferSize() || clientCallback.mReceiveCount == 0) && t.peekElapsedSeconds() < 30)
+		{
+			server->poll(&serverCallback);
+			client->poll(&clientCallback);
+		}
+		for (uint32_t i = 0; i < 100; i++)
+		{
+			server->poll(&serverCallback);
+			client->poll(&clientCallback);
+		}
+		double seconds = t.peekElapsedSeconds();
+		printResult(name, CONFLATE_UPDATES, seconds, "update");
+		easywsclient::WebSocketStats stats;
+		server->getStats(stats);
+		printf("    client received %d of %d updates; %d conflated; peak transmit buffer %d bytes\r\n",
+			clientCallback.mReceiveCount, CONFLATE_UPDATES, uint32_t(stats.mConflatedMessages), peak);
+	}
+	delete client;
+	delete server;
+	listener->release();
+}
+
+static void benchmarkConflateOff(void)
+{
+	benchmarkConflate("slow reader, every update", false);
+}
+
+static void benchmarkConflateOn(void)
+{
+	benchmarkConflate("slow reader, conflated", true);
+}
+
+// Two server connections each queue a burst of messages. Each is limited on its own and both share a
+// group limit, so together they should be held to the group's rate.
+static void benchmarkRateLimit(void)
+{
+	const char *name = "rate limited pair";
+	wsocket::Wsocket *listener = wsocket::Wsocket::create(SOCKET_SERVER, RATE_PORT);
+	if (!listener)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	easywsclient::WebSocket *clients[2] = { nullptr, nullptr };
+	easywsclient::WebSocket *servers[2] = { nullptr, nullptr };
+	bool ok = connectLoopback(listener, "ws://localhost:3090", clients[0], servers[0]) &&
+		connectLoopback(listener, "ws://localhost:3090", clients[1], servers[1]);
+	if (!ok)
+	{
+		printf("%-32s : unable to connect\r\n", name);
+	}
+	else
+	{
+		easywsclient::RateLimit limit;
+		limit.mSendMessagesPerSecond = RATE_CONNECTION_LIMIT;
+		limit.mBurstMilliseconds = 100;
+		easywsclient::RateLimit groupLimit;
+		groupLimit.mSendMessagesPerSecond = RATE_GROUP_LIMIT;
+		groupLimit.mBurstMilliseconds = 100;
+		easywsclient::RateLimitGroup *group = easywsclient::RateLimitGroup::create(groupLimit);
+		PingPongCallback clientCallbacks[2];
+		PingPongCallback serverCallback;
+		uint8_t message[64];
+		memset(message, 1, sizeof(message));
+		for (uint32_t i = 0; i < 2; i++)
+		{
+			servers[i]->setRateLimit(limit);
+			servers[i]->setRateLimitGroup(group);
+			for (uint32_t j = 0; j < RATE_MESSAGES; j++)
+			{
+				servers[i]->sendBinary(message, sizeof(message));
+			}
+		}
+		group->release(); // the connections keep it alive
+		timer::Timer t;
+		while ((clientCallbacks[0].mReceiveCount < RATE_MESSAGES || clientCallbacks[1].mReceiveCount < RATE_MESSAGES) && t.peekElapsedSeconds() < 30)
+		{
+			for (uint32_t i = 0; i < 2; i++)
+			{
+				servers[i]->poll(&serverCallback);
+				clients[i]->poll(&clientCallbacks[i]);
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		double seconds = t.peekElapsedSeconds();
+		printResult(name, clientCallbacks[0].mReceiveCount + clientCallbacks[1].mReceiveCount, seconds);
+		easywsclient::WebSocketStats stats;
+		servers[0]->getStats(stats);
+		printf("    group limit %d messages/sec; first connection was held back %d times\r\n", RATE_GROUP_LIMIT, uint32_t(stats.mSendThrottled));
+	}
+	for (uint32_t i = 0; i < 2; i++)
+	{
+		delete clients[i];
+		delete servers[i];
+	}
+	listener->release();
+}
+
+// One thread polls a connection being flooded and a quiet one doing ping-pong, as a reactor would.
+// Without a budget each poll of the busy connection drains everything that has arrived, so the quiet
+// connection waits behind it; with one, the busy connection gives up its turn and the quiet one is served sooner.
+static void benchmarkPollBudget(const char *name, bool budget)
+{
+	wsocket::Wsocket *listener = wsocket::Wsocket::create(SOCKET_SERVER, BUDGET_PORT);
+	if (!listener)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	easywsclient::WebSocket *busyClient = nullptr;
+	easywsclient::WebSocket *busyServer = nullptr;
+	easywsclient::WebSocket *quietClient = nullptr;
+	easywsclient::WebSocket *quietServer = nullptr;
+	bool ok = connectLoopback(listener, "ws://localhost:3089", busyClient, busyServer) &&
+		connectLoopback(listener, "ws://localhost:3089", quietClient, quietServer);
+	if (!ok)
+	{
+		printf("%-32s : unable to connect\r\n", name);
+	}
+	else
+	{
+		if (budget)
+		{
+			easywsclient::PollBudget pollBudget;
+			pollBudget.mReadBytes = BUDGET_READ_BYTES;
+			pollBudget.mDispatchFrames = BUDGET_DISPATCH_FRAMES;
+			busyClient->setPollBudget(pollBudget);
+		}
+		PingPongCallback busyCallback;
+		PingPongCallback quietClientCallback;
+		PingPongCallback quietServerCallback;
+		PingPongCallback serverCallback;
+		std::vector< uint8_t > firehose(BUDGET_FIREHOSE_SIZE, 1);
+		uint8_t message[PING_PONG_SIZE];
+		memset(message, 1, sizeof(message));
+		std::vector< double > latencies;
+		latencies.reserve(BUDGET_PING_COUNT);
+		uint32_t echoed = 0;
+		timer::Timer t;
+		for (uint32_t i = 0; i < BUDGET_PING_COUNT && quietClient->getReadyState() == easywsclient::WebSocket::OPEN; i++)
+		{
+			timer::Timer roundTrip;
+			quietClient->sendBinary(message, sizeof(message));
+			while (quietClientCallback.mReceiveCount == i && roundTrip.peekElapsedSeconds() < 5)
+			{
+				while (busyServer->getTransmitBufferSize() < BUDGET_FIREHOSE_QUEUE)
+				{
+					busyServer->sendBinary(&firehose[0], BUDGET_FIREHOSE_SIZE);
+				}
+				busyServer->poll(&serverCallback);
+				busyClient->poll(&busyCallback);
+				quietServer->poll(&quietServerCallback);
+				if (quietServerCallback.mReceiveCount > echoed)
+				{
+					echoed++;
+					quietServer->sendBinary(message, sizeof(message));
+					quietServer->poll(&quietServerCallback);
+				}
+				quietClient->poll(&quietClientCallback);
+			}
+			latencies.push_back(roundTrip.peekElapsedSeconds());
+		}
+		double seconds = t.peekElapsedSeconds();
+		printResult(name, latencies.size(), seconds, "round trip");
+		std::sort(latencies.begin(), latencies.end());
+		easywsclient::WebSocketStats stats;
+		busyClient->getStats(stats);
+		if (!latencies.empty())
+		{
+			printf("    quiet round trip p50 %dus, p99 %dus; busy connection got %dmb, stopped at its budget %d times\r\n",
+				uint32_t(latencies[latencies.size() / 2] * 1e6), uint32_t(latencies[latencies.size() * 99 / 100] * 1e6),
+				uint32_t(stats.mReceiveBytes / (1024 * 1024)), uint32_t(stats.mPollBudgetExhausted));
+		}
+	}
+	delete busyClient;
+	delete busyServer;
+	delete quietClient;
+	delete quietServer;
+	listener->release();
+}
+
+// The client pings every millisecond while both ends are polled from this thread, and reports the round
+// trip times seen by the application next to the kernel's. When the server is busy sending, each pong
+// waits behind the data already queued, which TCP's own round trip time doesn't see.
+static void benchmarkKeepalive(const char *name, bool busy)
+{
+	wsocket::Wsocket *listener = wsocket::Wsocket::create(SOCKET_SERVER, KEEPALIVE_PORT);
+	if (!listener)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	easywsclient::WebSocket *client = nullptr;
+	easywsclient::WebSocket *server = nullptr;
+	if (!connectLoopback(listener, "ws://localhost:3087", client, server))
+	{
+		printf("%-32s : unable to connect\r\n", name);
+	}
+	else
+	{
+		easywsclient::Timeouts timeouts;
+		timeouts.mPingIntervalMilliseconds = KEEPALIVE_INTERVAL;
+		timeouts.mPongMilliseconds = 1000;
+		client->setTimeouts(timeouts);
+		PingPongCallback clientCallback;
+		PingPongCallback serverCallback;
+		std::vector< uint8_t > message(KEEPALIVE_MESSAGE_SIZE, 1);
+		timer::Timer t;
+		while (t.peekElapsedSeconds() < KEEPALIVE_SECONDS && client->getReadyState() == easywsclient::WebSocket::OPEN)
+		{
+			while (busy && server->getTransmitBufferSize() < KEEPALIVE_QUEUE)
+			{
+				server->sendBinary(&message[0], KEEPALIVE_MESSAGE_SIZE);
+			}
+			server->poll(&serverCallback);
+			client->poll(&clientCallback);
+		}
+		easywsclient::LatencyStats stats;
+		client->getLatencyStats(stats);
+		printf("%-32s : %d pings, rtt min %dus mean %dus p50 %dus p99 %dus p99.9 %dus max %dus\r\n",
+			name, uint32_t(stats.mSamples), stats.mMin, stats.mMean, stats.mP50, stats.mP99, stats.mP999, stats.mMax);
+		wsocket::TransportInfo info;
+		if (client->getTransportInfo(info))
+		{
+			printf("    kernel tcp rtt %dus\r\n", info.mRtt);
+		}
+	}
+	delete client;
+	delete server;
+	listener->release();
+}
+
+static void benchmarkKeepaliveQuiet(void)
+{
+	benchmarkKeepalive("keepalive, quiet", false);
+}
+
+static void benchmarkKeepaliveBusy(void)
+{
+	benchmarkKeepalive("keepalive, busy server", true);
+}
+
+static void benchmarkPollBudgetOff(void)
+{
+	benchmarkPollBudget("busy neighbour, no poll budget", false);
+}
+
+static void benchmarkPollBudgetOn(void)
+{
+	benchmarkPollBudget("busy neighbour, poll budget", true);
+}
+
+// The receive burst workload while another thread keeps copying the client's stats, as a monitoring
+// thread would. Compare its rate with 'receiveburst' for the cost of the counters.
+static void benchmarkMetrics(void)
+{
+	const char *name = "receive burst, stats watched";
+	wsocket::Wsocket *listener = wsocket::Wsocket::create(SOCKET_SERVER, METRICS_PORT);
+	if (!listener)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	easywsclient::WebSocket *client = nullptr;
+	easywsclient::WebSocket *server = nullptr;
+	if (!connectLoopback(listener, "ws://localhost:3086", client, server))
+	{
+		printf("%-32s : unable to connect\r\n", name);
+	}
+	else
+	{
+		client->setDispatchTiming(1);
+		PingPongCallback clientCallback;
+		PingPongCallback serverCallback;
+		std::atomic< bool > done{ false };
+		uint64_t snapshots = 0;
+		uint64_t lastBytes = 0;
+		bool monotonic = true;
+		std::thread watcher([&]()
+		{
+			easywsclient::WebSocketStats stats;
+			while (!done.load())
+			{
+				client->getStats(stats);
+				monotonic = monotonic && stats.mReceiveBytes >= lastBytes;
+				lastBytes = stats.mReceiveBytes;
+				snapshots++;
+				std::this_thread::sleep_for(std::chrono::milliseconds(METRICS_INTERVAL));
+			}
+		});
+		std::vector< uint8_t > message(BURST_MESSAGE_SIZE, 1);
+		timer::Timer t;
+		for (uint32_t i = 0; i < BURST_COUNT && client->getReadyState() == easywsclient::WebSocket::OPEN; i++)
+		{
+			for (uint32_t j = 0; j < BURST_MESSAGE_COUNT; j++)
+			{
+				server->sendBinary(&message[0], BURST_MESSAGE_SIZE);
+			}
+			uint32_t expected = (i + 1) * BURST_MESSAGE_COUNT;
+			while (clientCallback.mReceiveCount < expected && client->getReadyState() == easywsclient::WebSocket::OPEN)
+			{
+				server->poll(&serverCallback);
+				client->poll(&clientCallback);
+			}
+		}
+		double seconds = t.peekElapsedSeconds();
+		done = true;
+		watcher.join();
+		printResult(name, clientCallback.mReceiveCount, seconds);
+		easywsclient::WebSocketStats in;
+		easywsclient::WebSocketStats out;
+		client->getStats(in);
+		server->getStats(out);
+		printf("    %d snapshots taken while polling%s\r\n", uint32_t(snapshots), monotonic ? "" : ", byte count went backwards!");
+		printf("    client: %d binary frames in, %d receive calls (%d would block), receive buffer peak %dkb, %d grows, %d compactions\r\n",
+			uint32_t(in.mFramesIn[easywsclient::STAT_BINARY]), uint32_t(in.mReceiveCalls), uint32_t(in.mReceiveWouldBlock),
+			in.mReceiveBufferPeak / 1024, uint32_t(in.mBufferGrows), uint32_t(in.mBufferCompactions));
+		printf("    server: %d binary frames out, %d send calls, %d partial, %d would block, transmit buffer peak %dkb\r\n",
+			uint32_t(out.mFramesOut[easywsclient::STAT_BINARY]), uint32_t(out.mSendCalls), uint32_t(out.mSendPartial),
+			uint32_t(out.mSendWouldBlock), out.mTransmitBufferPeak / 1024);
+		printf("    dispatch p50 %dns p99 %dns max %dns\r\n", in.mDispatch.mP50, in.mDispatch.mP99, in.mDispatch.mMax);
+	}
+	delete client;
+	delete server;
+	listener->release();
+}
+
+// Broadcasts every message a sharded server receives to all of its connections
+class EchoAllCallback : public shardedserver::ShardedServerCallback
+{
+public:
+	virtual void onConnect(uint32_t worker, easywsclient::WebSocket *connection) override final
+	{
+		mConnectCount++;
+	}
+
+	virtual void onMessage(uint32_t worker, easywsclient::WebSocket *connection, const void *data, uint32_t dataLen, bool isAscii) override final
+	{
+		mServer->broadcast(data, dataLen, isAscii);
+	}
+
+	virtual void onDisconnect(uint32_t worker, easywsclient::WebSocket *connection) override final
+	{
+	}
+
+	shardedserver::ShardedServer	*mServer{ nullptr };
+	std::atomic<uint32_t>			mConnectCount{ 0 };
+};
+
+// One client sends a message, the worker which owns it broadcasts it through every worker's post
+// queue, and every client is polled until it has arrived.
+static void benchmarkShardedBroadcast(void)
+{
+	const char *name = "sharded broadcast";
+	EchoAllCallback callback;
+	shardedserver::ShardedServer *server = shardedserver::ShardedServer::create(SHARD_PORT, SHARD_WORKERS, &callback);
+	if (!server)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	callback.mServer = server;
+	std::vector< easywsclient::WebSocket * > clients;
+	for (uint32_t i = 0; i < SHARD_CLIENTS; i++)
+	{
+		easywsclient::WebSocket *ws = easywsclient::WebSocket::create("ws://localhost:3092");
+		if (ws)
+		{
+			clients.push_back(ws);
+		}
+	}
+	timer::Timer connectTimer;
+	bool connecting = true;
+	while (connecting && connectTimer.peekElapsedSeconds() < 10)
+	{
+		connecting = false;
+		for (auto &c : clients)
+		{
+			c->poll(nullptr);
+			if (c->getReadyState() == easywsclient::WebSocket::CONNECTING)
+			{
+				connecting = true;
+			}
+		}
+	}
+	// The server side of the last handshakes may still be finishing
+	while (callback.mConnectCount < clients.size() && connectTimer.peekElapsedSeconds() < 10)
+	{
+		std::this_thread::yield();
+	}
+	if (clients.size() != SHARD_CLIENTS || connecting)
+	{
+		printf("%-32s : unable to connect\r\n", name);
+	}
+	else
+	{
+		std::vector< PingPongCallback > callbacks(SHARD_CLIENTS);
+		uint8_t message[64];
+		memset(message, 1, sizeof(message));
+		timer::Timer t;
+		for (uint32_t i = 0; i < SHARD_MESSAGE_COUNT; i++)
+		{
+			clients[i % SHARD_CLIENTS]->sendBinary(message, sizeof(message));
+			bool waiting = true;
+			while (waiting && t.peekElapsedSeconds() < 30)
+			{
+				waiting = false;
+				for (uint32_t j = 0; j < SHARD_CLIENTS; j++)
+				{
+					clients[j]->poll(&callbacks[j]);
+					if (callbacks[j].mReceiveCount <= i && clients[j]->getReadyState() == easywsclient::WebSocket::OPEN)
+					{
+						waiting = true;
+					}
+				}
+			}
+		}
+		double seconds = t.peekElapsedSeconds();
+		uint32_t received = 0;
+		for (auto &c : callbacks)
+		{
+			received += c.mReceiveCount;
+		}
+		printResult(name, received, seconds);
+		for (uint32_t i = 0; i < server->getWorkerCount(); i++)
+		{
+			printf("    worker %d: %d connections, stole %d\r\n", i, server->getConnectionCount(i), uint32_t(server->getStealCount(i)));
+		}
+	}
+	for (auto &c : clients)
+	{
+		delete c;
+	}
+	server->release();
+}
+
+// Every client sends a burst at once and the callbacks broadcast each message, so the workers post to
+// each other's queues, and their own, far faster than they are read. Nothing may be lost on the way.
+static void benchmarkShardedStorm(void)
+{
+	const char *name = "sharded broadcast storm";
+	EchoAllCallback callback;
+	shardedserver::ShardedServer *server = shardedserver::ShardedServer::create(SHARD_PORT, SHARD_WORKERS, &callback);
+	if (!server)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	callback.mServer = server;
+	std::vector< easywsclient::WebSocket * > clients;
+	for (uint32_t i = 0; i < SHARD_STORM_CLIENTS; i++)
+	{
+		easywsclient::WebSocket *ws = easywsclient::WebSocket::create("ws://localhost:3092");
+		if (ws)
+		{
+			clients.push_back(ws);
+		}
+	}
+	timer::Timer connectTimer;
+	bool connecting = true;
+	while (connecting && connectTimer.peekElapsedSeconds() < 10)
+	{
+		connecting = false;
+		for (auto &c : clients)
+		{
+			c->poll(nullptr);
+			if (c->getReadyState() == easywsclient::WebSocket::CONNECTING)
+			{
+				connecting = true;
+			}
+		}
+	}
+	while (callback.mConnectCount < clients.size() && connectTimer.peekElapsedSeconds() < 10)
+	{
+		std::this_thread::yield();
+	}
+	if (clients.size() != SHARD_STORM_CLIENTS || connecting)
+	{
+		printf("%-32s : unable to connect\r\n", name);
+	}
+	else
+	{
+		std::vector< PingPongCallback > callbacks(SHARD_STORM_CLIENTS);
+		uint8_t message[32];
+		memset(message, 1, sizeof(message));
+		timer::Timer t;
+		for (uint32_t i = 0; i < SHARD_STORM_BURST; i++)
+		{
+			for (auto &c : clients)
+			{
+				c->sendBinary(message, sizeof(message));
+			}
+		}
+		const uint32_t expected = SHARD_STORM_CLIENTS * SHARD_STORM_BURST;
+		bool waiting = true;
+		while (waiting && t.peekElapsedSeconds() < 30)
+		{
+			waiting = false;
+			for (uint32_t j = 0; j < SHARD_STORM_CLIENTS; j++)
+			{
+				clients[j]->poll(&callbacks[j]);
+				if (callbacks[j].mReceiveCount < expected)
+				{
+					waiting = true;
+				}
+			}
+		}
+		double seconds = t.peekElapsedSeconds();
+		uint32_t received = 0;
+		for (auto &c : callbacks)
+		{
+			received += c.mReceiveCount;
+		}
+		printResult(name, received, seconds);
+		printf("    %d of %d broadcast frames delivered%s\r\n", received, expected * SHARD_STORM_CLIENTS,
+			received == expected * SHARD_STORM_CLIENTS ? "" : ", FRAMES LOST");
+	}
+	for (auto &c : clients)
+	{
+		delete c;
+	}
+	server->release();
+}
+
+// Shuts down a sharded server whose clients have a backlog queued, half of which have stopped reading.
+// Deleting each stalled connection used to wait a second for its close frame; draining closes them all
+// at once and gives up on the stalled half together, when the deadline passes.
+static void benchmarkDrain(void)
+{
+	const char *name = "drain";
+	EchoAllCallback callback;
+	wsocket::SocketOptions serverOptions;
+	serverOptions.mSendBufferSize = 1024 * 64; // keep the kernel from absorbing the backlog
+	shardedserver::ShardedServer *server = shardedserver::ShardedServer::create(DRAIN_PORT, SHARD_WORKERS, &callback, &serverOptions);
+	if (!server)
+	{
+		printf("%-32s : unable to create server\r\n", name);
+		return;
+	}
+	callback.mServer = server;
+	wsocket::SocketOptions clientOptions;
+	clientOptions.mReceiveBufferSize = 1024 * 64;
+	std::vector< easywsclient::WebSocket * > clients;
+	for (uint32_t i = 0; i < DRAIN_CLIENTS; i++)
+	{
+		easywsclient::WebSocket *ws = easywsclient::WebSocket::create("ws://localhost:3088", "", true, &clientOptions);
+		if (ws)
+		{
+			clients.push_back(ws);
+		}
+	}
+	timer::Timer connectTimer;
+	bool connecting = true;
+	while (connecting && connectTimer.peekElapsedSeconds() < 10)
+	{
+		connecting = false;
+		for (auto &c : clients)
+		{
+			c->poll(nullptr);
+			if (c->getReadyState() == easywsclient::WebSocket::CONNECTING)
+			{
+				connecting = true;
+			}
+		}
+	}
+	while (callback.mConnectCount < clients.size() && connectTimer.peekElapsedSeconds() < 10)
+	{
+		std::this_thread::yield();
+	}
+	if (clients.size() != DRAIN_CLIENTS || connecting)
+	{
+		printf("%-32s : unable to connect\r\n", name);
+		for (auto &c : clients)
+		{
+			delete c;
+		}
+		server->release();
+		return;
+	}
+	// Only the even clients are read from here on
+	std::atomic<bool> stop{ false };
+	std::thread reader([&clients, &stop]()
+	{
+		std::vector< PingPongCallback > callbacks(DRAIN_CLIENTS);
+		while (!stop)
+		{
+			for (uint32_t i = 0; i < DRAIN_CLIENTS; i += 2)
+			{
+				clients[i]->poll(&callbacks[i]);
+			}
+		}
+	});
+	std::vector< uint8_t > message(DRAIN_MESSAGE_SIZE, 1);
+	for (uint32_t i = 0; i < DRAIN_MESSAGE_COUNT; i++)
+	{
+		server->broadcast(&message[0], DRAIN_MESSAGE_SIZE, false);
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	timer::Timer t;
+	uint32_t dropped = server->drain(DRAIN_TIMEOUT);
+	double drainSeconds = t.getElapsedSeconds();
+	// The listeners are closed, so a new client is refused rather than left waiting in a backlog
+	easywsclient::WebSocket *late = easywsclient::WebSocket::create("ws://localhost:3088");
+	timer::Timer lateTimer;
+	while (late && late->getReadyState() == easywsclient::WebSocket::CONNECTING && lateTimer.peekElapsedSeconds() < 2)
+	{
+		late->poll(nullptr);
+	}
+	bool refused = !late || late->getReadyState() == easywsclient::WebSocket::CLOSED;
+	delete late;
+	t.reset();
+	server->release();
+	double releaseSeconds = t.peekElapsedSeconds();
+	stop = true;
+	reader.join();
+	printf("%-32s : %d connections closed in %.0fms, %d dropped at the deadline; release took %.1fms, new connect %s\r\n",
+		name, DRAIN_CLIENTS, drainSeconds * 1000, dropped, releaseSeconds * 1000, refused ? "refused" : "NOT REFUSED");
+	for (auto &c : clients)
+	{
+		delete c;
+	}
+}
+
+struct Benchmark
+{
+	const char	*mName;
+	void		(*mFunction)(void);
+};
+
+static Benchmark gBenchmarks[] =
+{
+	{ "mutexspsc", benchmarkMutexSPSC },
+	{ "mpsc", benchmarkMPSC },
+	{ "spmc", benchmarkSPMC },
+	{ "timerwheel", benchmarkTimerWheel },
+	{ "timermap", benchmarkTimerMap },
+	{ "tcppingpong", benchmarkTcpPingPong },
+	{ "unixpingpong", benchmarkUnixPingPong },
+	{ "sharedpingpong", benchmarkSharedPingPong },
+	{ "sharedreattach", benchmarkSharedReattach },
+#if USE_OPENSSL
+	{ "tlspingpong", benchmarkTlsPingPong },
+#endif
+	{ "receiveburst", benchmarkReceiveBurst },
+	{ "sendonpoll", benchmarkSendOnPoll },
+	{ "sendimmediate", benchmarkSendImmediate },
+	{ "sendcoalesce", benchmarkSendCoalesce },
+	{ "sendcorked", benchmarkSendCorked },
+	{ "fanoutcopy", benchmarkFanoutCopy },
+	{ "fanout", benchmarkFanoutPrepared },
+	{ "hub", benchmarkHub },
+	{ "shardedbroadcast", benchmarkShardedBroadcast },
+	{ "shardedstorm", benchmarkShardedStorm },
+	{ "drain", benchmarkDrain },
+	{ "ratelimit", benchmarkRateLimit },
+	{ "conflateoff", benchmarkConflateOff },
+	{ "conflate", benchmarkConflateOn },
+	{ "keepalive", benchmarkKeepaliveQuiet },
+	{ "keepalivebusy", benchmarkKeepaliveBusy },
+	{ "pollbudgetoff", benchmarkPollBudgetOff },
+	{ "pollbudget", benchmarkPollBudgetOn },
+	{ "metrics", benchmarkMetrics },
+	{ "acceptstorm1", benchmarkAcceptStormSingle },
+	{ "acceptstorm", benchmarkAcceptStormSharded },
+	{ "acceptstormcap", benchmarkAcceptStormCapped },
+};
+
+int main(int argc,const char **argv)
+{
+	const char *name = argc == 2 ? argv[1] : nullptr;
+	bool found = false;
+	wsocket::Wsocket::startupSockets();
+	for (auto &b : gBenchmarks)
+	{
+		if (name == nullptr || strcmp(name, b.mName) == 0)
+		{
+			b.mFunction();
+			found = true;
+		}
+	}
+	wsocket::Wsocket::shutdownSockets();
+	if (!found)
+	{
+		printf("Unknown benchmark: %s\r\n", name);
+		printf("Available benchmarks:");
+		for (auto &b : gBenchmarks)
+		{
+			printf(" %s", b.mName);
+		}
+		printf("\r\n");
+		return 1;
+	}
+	return 0;
+}
@@ -4,6 +4,7 @@
 
 #include "easywsclient.h"
 #include "wsocket.h"
+#include "Hub.h"
 #include "InputLine.h"
 #include <assert.h>
 #include <stdio.h>
@@ -14,6 +15,8 @@
 
 using easywsclient::WebSocket;
 
+#define ACCEPT_BATCH_SIZE 64	// Most new connections accepted per loop
+
 class ClientConnection : public easywsclient::WebSocketCallback
 {
 public:
@@ -95,11 +98,14 @@ public:
 	SimpleServer(void)
 	{
 		mServerSocket = wsocket::Wsocket::create(SOCKET_SERVER, 3009);
-//		mServerSocket = wsocket::Wsocket::create(SHARED_SERVER, 3009);
+		mHub = hub::Hub::create(true);
+		// Local clients can also connect through shared memory on the same port number
+		mSharedServerSocket = wsocket::Wsocket::create(SHARED_SERVER, 3009);
 		mInputLine = inputline::InputLine::create();
 		printf("Simple Websockets chat server started.\r\n");
 		printf("Type 'bye', 'quit', or 'exit' to stop the server.\r\n");
 		printf("Type anything else to send as a broadcast message to all current client connections.\r\n");
+		printf("Clients may send '/join topic', '/leave topic' and '/publish topic message'; anything else is broadcast.\r\n");
 	}
 
 	~SimpleServer(void)
@@ -112,6 +118,11 @@ public:
 		{
 			delete i;
 		}
+		mHub->release();
+		if (mSharedServerSocket)
+		{
+			mSharedServerSocket->release();
+		}
 		if (mServerSocket)
 		{
 			mServerSocket->release();
@@ -124,17 +135,8 @@ public:
 
 		while (!exit)
 		{
-			if (mServerSocket)
-			{
-				wsocket::Wsocket *clientSocket = mServerSocket->pollServer();
-				if (clientSocket)
-				{
-					uint32_t index = uint32_t(mClients.size()) + 1;
-					ClientConnection *cc = new ClientConnection(clientSocket, index);
-					printf("New client connection (%d) established.\r\n", index);
-					mClients.push_back(cc);
-				}
-			}
+			acceptClients(mServerSocket);
+			acceptClients(mSharedServerSocket);
 			if (mInputLine)
 			{
 				const char *str = mInputLine->getInputLine();
@@ -148,31 +150,26 @@ public:
 					}
 					else
 					{
-						for (auto &i : mClients)
-						{
-							i->sendText(str);
-						}
+						mHub->broadcast(str, uint32_t(strlen(str)), true);
 					}
 				}
 			}
 
-			// See if any clients have dropped connection
-			bool killed = true;
-			while (killed)
+			// See if any clients have dropped connection; order doesn't matter, so fill the hole with the last client
+			size_t index = 0;
+			while (index < mClients.size())
 			{
-				killed = false;
-				for (ClientConnectionVector::iterator i = mClients.begin(); i != mClients.end(); ++i)
+				ClientConnection *cc = mClients[index];
+				if (cc->isConnected())
 				{
-					if (!(*i)->isConnected() )
-					{
-						killed = true;
-						ClientConnection *cc = (*i);
-						printf("Lost connection to client: %d\r\n", cc->getId());
-						delete cc;
-						mClients.erase(i);
-						break;
-					}
+					index++;
+					continue;
 				}
+				printf("Lost connection to client: %d\r\n", cc->getId());
+				mHub->removeConnection(cc->mClient);
+				delete cc;
+				mClients[index] = mClients.back();
+				mClients.pop_back();
 			}
 
 			// For each active client connection..
@@ -185,16 +182,67 @@ public:
 				if (newMessage)
 				{
 					printf("Client[%d] : %s\r\n", i->getId(), newMessage);
-					for (auto &j : mClients)
-					{
-						j->sendText(newMessage);
-					}
+					handleMessage(i, newMessage);
 				}
 			}
 		}
 	}
 
+	// Accept everything waiting, up to a batch, so a burst of connections doesn't take one loop per client
+	void acceptClients(wsocket::Wsocket *serverSocket)
+	{
+		if (!serverSocket)
+		{
+			return;
+		}
+		wsocket::Wsocket *clientSockets[ACCEPT_BATCH_SIZE];
+		uint32_t count = serverSocket->pollServerBatch(clientSockets, ACCEPT_BATCH_SIZE);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint32_t index = uint32_t(mClients.size()) + 1;
+			ClientConnection *cc = new ClientConnection(clientSockets[i], index);
+			if (!cc->mClient)
+			{
+				delete cc;
+				continue;
+			}
+			printf("New client connection (%d) established.\r\n", index);
+			mClients.push_back(cc);
+			mHub->addConnection(cc->mClient);
+		}
+	}
+
+	// Topic commands from a client; anything else goes to everyone
+	void handleMessage(ClientConnection *cc, const char *message)
+	{
+		if (strncmp(message, "/join ", 6) == 0)
+		{
+			mHub->subscribe(cc->mClient, message + 6);
+		}
+		else if (strncmp(message, "/leave ", 7) == 0)
+		{
+			mHub->unsubscribe(cc->mClient, message + 7);
+		}
+		else if (strncmp(message, "/publish ", 9) == 0)
+		{
+			std::string topic(message + 9);
+			size_t space = topic.find(' ');
+			if (space != std::string::npos)
+			{
+				const char *text = message + 9 + space + 1;
+				topic.resize(space);
+				mHub->publish(topic.c_str(), text, uint32_t(strlen(text)), true);
+			}
+		}
+		else
+		{
+			mHub->broadcast(message, uint32_t(strlen(message)), true);
+		}
+	}
+
 	wsocket::Wsocket		*mServerSocket{ nullptr };
+	wsocket::Wsocket		*mSharedServerSocket{ nullptr };	// Shared memory listener; only one client at a time
+	hub::Hub				*mHub{ nullptr };
 	inputline::InputLine	*mInputLine{ nullptr };
 	ClientConnectionVector	mClients;
 };
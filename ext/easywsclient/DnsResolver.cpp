@@ -0,0 +1,250 @@
+#include "DnsResolver.h"
+#include "wplatform.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+#else
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#ifdef _MSC_VER
+#pragma warning(disable:4100)
+#endif
+
+#define MAX_CACHE_ENTRIES 256	// Expired entries are pruned once the cache grows past this
+#define MAX_RESOLVER_THREADS 4	// Lookups running at once; a slow name only holds up one of them
+
+namespace dnsresolver
+{
+
+typedef std::chrono::steady_clock Clock;
+
+// The result of one lookup. Every lookup of the same host shares it while it is pending or cached.
+struct CacheEntry
+{
+	std::string					mHostName;
+	std::string					mPort;
+	uint32_t					mCacheSeconds{ 0 };
+	std::atomic<Status>			mStatus{ Status::PENDING };
+	std::vector< Address >		mAddresses;			// Filled in before mStatus becomes RESOLVED
+	char						mError[256]{};		// Filled in before mStatus becomes FAILED
+	Clock::time_point			mExpires;			// When a resolved entry may no longer be reused
+};
+
+typedef std::shared_ptr< CacheEntry > CacheEntryPtr;
+typedef std::unordered_map< std::string, CacheEntryPtr > CacheEntryMap;
+
+// Calls getaddrinfo and copies the results into the entry; returns false on failure
+static bool resolveEntry(CacheEntry &entry, int flags)
+{
+	addrinfo hints;
+	addrinfo *result = nullptr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = flags;
+	int ret = getaddrinfo(entry.mHostName.c_str(), entry.mPort.c_str(), &hints, &result);
+	if (ret != 0)
+	{
+#ifdef _MSC_VER
+		wplatform::stringFormat(entry.mError, sizeof(entry.mError), "getaddrinfo: %s", gai_strerrorA(ret));
+#else
+		wplatform::stringFormat(entry.mError, sizeof(entry.mError), "getaddrinfo: %s", gai_strerror(ret));
+#endif
+		return false;
+	}
+	for (addrinfo *p = result; p != nullptr; p = p->ai_next)
+	{
+		if (p->ai_addrlen <= sizeof(Address::mAddress))
+		{
+			Address a;
+			memcpy(a.mAddress, p->ai_addr, p->ai_addrlen);
+			a.mAddressLength = uint32_t(p->ai_addrlen);
+			a.mFamily = p->ai_family;
+			a.mSocketType = p->ai_socktype;
+			a.mProtocol = p->ai_protocol;
+			entry.mAddresses.push_back(a);
+		}
+	}
+	freeaddrinfo(result);
+	return !entry.mAddresses.empty();
+}
+
+// Owns the resolver threads and the cache. Threads are started as lookups queue up, up to
+// MAX_RESOLVER_THREADS, and then wait for more work for the life of the process.
+// It is never destroyed: a thread may be stuck in getaddrinfo for as long as the system's DNS
+// timeout, and exit must not wait on it, so the threads are detached and the resolver outlives them.
+class Resolver
+{
+public:
+	CacheEntryPtr resolve(const char *hostName, const char *port, uint32_t cacheSeconds)
+	{
+		std::string key = std::string(hostName) + ":" + port;
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (cacheSeconds)
+		{
+			CacheEntryMap::iterator found = mCache.find(key);
+			if (found != mCache.end())
+			{
+				CacheEntryPtr &e = found->second;
+				Status status = e->mStatus.load(std::memory_order_acquire);
+				if (status == Status::PENDING || (status == Status::RESOLVED && Clock::now() < e->mExpires))
+				{
+					return e;
+				}
+			}
+			if (mCache.size() >= MAX_CACHE_ENTRIES)
+			{
+				pruneCache();
+			}
+		}
+		CacheEntryPtr e = std::make_shared<CacheEntry>();
+		e->mHostName = hostName;
+		e->mPort = port;
+		e->mCacheSeconds = cacheSeconds;
+		if (cacheSeconds)
+		{
+			mCache[key] = e;
+		}
+		mQueue.push_back(e);
+		if (mQueue.size() > mIdleThreads && mThreadCount < MAX_RESOLVER_THREADS)
+		{
+			mThreadCount++;
+			std::thread([this]()
+			{
+				run();
+			}).detach();
+		}
+		mWakeup.notify_one();
+		return e;
+	}
+
+private:
+	void run(void)
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		while (true)
+		{
+			mIdleThreads++;
+			mWakeup.wait(lock, [this]() { return !mQueue.empty(); });
+			mIdleThreads--;
+			CacheEntryPtr e = mQueue.front();
+			mQueue.pop_front();
+			lock.unlock();
+			bool ok = resolveEntry(*e, 0);
+			lock.lock();
+			e->mExpires = Clock::now() + std::chrono::seconds(e->mCacheSeconds);
+			e->mStatus.store(ok ? Status::RESOLVED : Status::FAILED, std::memory_order_release);
+		}
+	}
+
+	// Drops every entry which can no longer be reused
+	void pruneCache(void)
+	{
+		Clock::time_point now = Clock::now();
+		CacheEntryMap::iterator i = mCache.begin();
+		while (i != mCache.end())
+		{
+			Status status = i->second->mStatus.load(std::memory_order_acquire);
+			if (status == Status::FAILED || (status == Status::RESOLVED && now >= i->second->mExpires))
+			{
+				i = mCache.erase(i);
+			}
+			else
+			{
+				++i;
+			}
+		}
+	}
+
+	std::mutex					mMutex;
+	std::condition_variable		mWakeup;
+	std::deque< CacheEntryPtr >	mQueue;		// Lookups waiting for a resolver thread
+	CacheEntryMap				mCache;		// Pending and resolved lookups by "host:port"
+	size_t						mThreadCount{ 0 };	// Resolver threads started
+	size_t						mIdleThreads{ 0 };	// Threads waiting for a lookup
+};
+
+static Resolver &getResolver(void)
+{
+	static Resolver *gResolver = new Resolver;	// leaked on purpose; see Resolver
+	return *gResolver;
+}
+
+class LookupImpl : public Lookup
+{
+public:
+	LookupImpl(const char *hostName, int32_t port, uint32_t cacheSeconds)
+	{
+		char sport[16];
+		wplatform::stringFormat(sport, sizeof(sport), "%d", port);
+		// Numeric addresses are converted right here; there's nothing to wait for
+		CacheEntryPtr e = std::make_shared<CacheEntry>();
+		e->mHostName = hostName;
+		e->mPort = sport;
+		if (resolveEntry(*e, AI_NUMERICHOST))
+		{
+			e->mStatus.store(Status::RESOLVED, std::memory_order_relaxed);
+			mEntry = e;
+		}
+		else
+		{
+			mEntry = getResolver().resolve(hostName, sport, cacheSeconds);
+		}
+	}
+
+	virtual Status getStatus(void) override final
+	{
+		return mEntry->mStatus.load(std::memory_order_acquire);
+	}
+
+	virtual uint32_t getAddressCount(void) const override final
+	{
+		return mEntry->mStatus.load(std::memory_order_acquire) == Status::RESOLVED ? uint32_t(mEntry->mAddresses.size()) : 0;
+	}
+
+	virtual const Address *getAddress(uint32_t index) const override final
+	{
+		return index < getAddressCount() ? &mEntry->mAddresses[index] : nullptr;
+	}
+
+	virtual const char *getError(void) const override final
+	{
+		return mEntry->mStatus.load(std::memory_order_acquire) == Status::FAILED ? mEntry->mError : "";
+	}
+
+	virtual void release(void) override final
+	{
+		delete this;
+	}
+
+	CacheEntryPtr	mEntry;
+};
+
+Lookup *Lookup::create(const char *hostName, int32_t port, uint32_t cacheSeconds)
+{
+	auto ret = new LookupImpl(hostName, port, cacheSeconds);
+	return static_cast<Lookup *>(ret);
+}
+
+}
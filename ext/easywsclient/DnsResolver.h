@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+// Resolves host names without blocking the caller.
+// Lookups run on a small pool of resolver threads shared by the whole process, and the results are cached
+// so opening many connections to the same host costs a single lookup.
+// getaddrinfo does not report the DNS record's TTL, so entries are kept for a configured time instead.
+namespace dnsresolver
+{
+
+// One resolved address, stored as raw bytes so this header doesn't depend on the platform socket headers
+struct Address
+{
+	uint8_t		mAddress[128];		// A sockaddr_in or sockaddr_in6
+	uint32_t	mAddressLength{ 0 };	// Size of the sockaddr in bytes
+	int32_t		mFamily{ 0 };			// AF_INET or AF_INET6
+	int32_t		mSocketType{ 0 };
+	int32_t		mProtocol{ 0 };
+};
+
+enum class Status : uint32_t
+{
+	PENDING,		// The lookup has not finished yet
+	RESOLVED,		// Addresses are available
+	FAILED,			// The host name could not be resolved
+};
+
+class Lookup
+{
+public:
+	// Starts resolving this host and port; answered immediately for numeric addresses and cached names.
+	// 'cacheSeconds' is how long a successful result may be reused by later lookups; zero disables the cache.
+	static Lookup *create(const char *hostName, int32_t port, uint32_t cacheSeconds);
+
+	// Returns the current status; never blocks
+	virtual Status getStatus(void) = 0;
+
+	// The resolved addresses, in the order getaddrinfo returned them; only valid once RESOLVED
+	virtual uint32_t getAddressCount(void) const = 0;
+	virtual const Address *getAddress(uint32_t index) const = 0;
+
+	// The reason the lookup failed, if it did
+	virtual const char *getError(void) const = 0;
+
+	virtual void release(void) = 0;
+protected:
+	virtual ~Lookup(void)
+	{
+	}
+};
+
+}
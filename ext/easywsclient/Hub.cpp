@@ -0,0 +1,271 @@
+#include "Hub.h"
+#include "easywsclient.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#ifdef _MSC_VER
+#pragma warning(disable:4100)
+#endif
+
+namespace hub
+{
+
+struct Member;
+struct Topic;
+
+// One topic a connection is subscribed to, and its slot in that topic's subscriber array
+struct Subscription
+{
+	Topic		*mTopic{ nullptr };
+	uint32_t	mIndex{ 0 };
+};
+
+// One subscriber of a topic, and the matching entry in that connection's subscription list
+struct TopicSlot
+{
+	Member		*mMember{ nullptr };
+	uint32_t	mSubscription{ 0 };
+};
+
+typedef std::vector< Subscription > SubscriptionVector;
+typedef std::vector< TopicSlot > TopicSlotVector;
+
+struct Member
+{
+	easywsclient::WebSocket	*mConnection{ nullptr };
+	uint32_t				mIndex{ 0 };		// Position in the hub's member array
+	SubscriptionVector		mSubscriptions;
+};
+
+struct Topic
+{
+	std::string			mName;
+	TopicSlotVector		mSubscribers;		// Dense; a leaving subscriber is replaced by the last one
+};
+
+typedef std::vector< Member * > MemberVector;
+typedef std::unordered_map< easywsclient::WebSocket *, Member * > MemberMap;
+typedef std::unordered_map< std::string, Topic * > TopicMap;
+
+class HubImpl : public Hub
+{
+public:
+	HubImpl(bool useMask) : mUseMask(useMask)
+	{
+	}
+
+	virtual ~HubImpl(void)
+	{
+		for (auto &i : mTopics)
+		{
+			delete i.second;
+		}
+		for (auto &i : mMembers)
+		{
+			delete i;
+		}
+	}
+
+	virtual void addConnection(easywsclient::WebSocket *connection) override final
+	{
+		if (mMemberMap.find(connection) != mMemberMap.end())
+		{
+			return;
+		}
+		Member *m = new Member;
+		m->mConnection = connection;
+		m->mIndex = uint32_t(mMembers.size());
+		mMembers.push_back(m);
+		mMemberMap[connection] = m;
+	}
+
+	virtual void removeConnection(easywsclient::WebSocket *connection) override final
+	{
+		MemberMap::iterator found = mMemberMap.find(connection);
+		if (found == mMemberMap.end())
+		{
+			return;
+		}
+		Member *m = found->second;
+		while (!m->mSubscriptions.empty())
+		{
+			removeSubscription(m, uint32_t(m->mSubscriptions.size()) - 1);
+		}
+		Member *last = mMembers.back();
+		mMembers[m->mIndex] = last;
+		last->mIndex = m->mIndex;
+		mMembers.pop_back();
+		mMemberMap.erase(found);
+		delete m;
+	}
+
+	virtual bool subscribe(easywsclient::WebSocket *connection, const char *topic) override final
+	{
+		Member *m = findMember(connection);
+		if (!m)
+		{
+			return false;
+		}
+		for (auto &i : m->mSubscriptions)
+		{
+			if (i.mTopic->mName == topic)
+			{
+				return false;
+			}
+		}
+		Topic *t;
+		std::string name(topic);
+		TopicMap::iterator found = mTopics.find(name);
+		if (found == mTopics.end())
+		{
+			t = new Topic;
+			t->mName = name;
+			mTopics[name] = t;
+		}
+		else
+		{
+			t = found->second;
+		}
+		Subscription s;
+		s.mTopic = t;
+		s.mIndex = uint32_t(t->mSubscribers.size());
+		TopicSlot slot;
+		slot.mMember = m;
+		slot.mSubscription = uint32_t(m->mSubscriptions.size());
+		t->mSubscribers.push_back(slot);
+		m->mSubscriptions.push_back(s);
+		return true;
+	}
+
+	virtual bool unsubscribe(easywsclient::WebSocket *connection, const char *topic) override final
+	{
+		Member *m = findMember(connection);
+		if (m)
+		{
+			for (uint32_t i = 0; i < uint32_t(m->mSubscriptions.size()); i++)
+			{
+				if (m->mSubscriptions[i].mTopic->mName == topic)
+				{
+					removeSubscription(m, i);
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	virtual uint32_t publish(const char *topic, const void *data, uint32_t dataLen, bool isAscii) override final
+	{
+		Topic *t = findTopic(topic);
+		if (!t)
+		{
+			return 0;
+		}
+		easywsclient::PreparedFrame *frame = easywsclient::PreparedFrame::create(data, dataLen, isAscii, mUseMask);
+		uint32_t ret = sendToTopic(t, frame);
+		frame->release();
+		return ret;
+	}
+
+	virtual uint32_t publishFrame(const char *topic, easywsclient::PreparedFrame *frame) override final
+	{
+		Topic *t = findTopic(topic);
+		return t ? sendToTopic(t, frame) : 0;
+	}
+
+	virtual uint32_t broadcast(const void *data, uint32_t dataLen, bool isAscii) override final
+	{
+		if (mMembers.empty())
+		{
+			return 0;
+		}
+		easywsclient::PreparedFrame *frame = easywsclient::PreparedFrame::create(data, dataLen, isAscii, mUseMask);
+		for (auto &i : mMembers)
+		{
+			i->mConnection->sendFrame(frame);
+		}
+		frame->release();
+		return uint32_t(mMembers.size());
+	}
+
+	virtual uint32_t getConnectionCount(void) const override final
+	{
+		return uint32_t(mMembers.size());
+	}
+
+	virtual uint32_t getSubscriberCount(const char *topic) const override final
+	{
+		TopicMap::const_iterator found = mTopics.find(std::string(topic));
+		return found == mTopics.end() ? 0 : uint32_t(found->second->mSubscribers.size());
+	}
+
+	virtual uint32_t getTopicCount(void) const override final
+	{
+		return uint32_t(mTopics.size());
+	}
+
+	virtual void release(void) override final
+	{
+		delete this;
+	}
+
+private:
+	Member *findMember(easywsclient::WebSocket *connection) const
+	{
+		MemberMap::const_iterator found = mMemberMap.find(connection);
+		return found == mMemberMap.end() ? nullptr : found->second;
+	}
+
+	Topic *findTopic(const char *topic) const
+	{
+		TopicMap::const_iterator found = mTopics.find(std::string(topic));
+		return found == mTopics.end() ? nullptr : found->second;
+	}
+
+	uint32_t sendToTopic(Topic *t, easywsclient::PreparedFrame *frame)
+	{
+		for (auto &i : t->mSubscribers)
+		{
+			i.mMember->mConnection->sendFrame(frame);
+		}
+		return uint32_t(t->mSubscribers.size());
+	}
+
+	// Drops one of the member's subscriptions. Both arrays fill the hole with their last entry,
+	// and the moved entries' back references are patched, so this doesn't depend on either array's size.
+	void removeSubscription(Member *m, uint32_t index)
+	{
+		Subscription s = m->mSubscriptions[index];
+		Topic *t = s.mTopic;
+		TopicSlot moved = t->mSubscribers.back();
+		t->mSubscribers[s.mIndex] = moved;
+		moved.mMember->mSubscriptions[moved.mSubscription].mIndex = s.mIndex;
+		t->mSubscribers.pop_back();
+		if (t->mSubscribers.empty())
+		{
+			mTopics.erase(t->mName);
+			delete t;
+		}
+		if (index + 1 < uint32_t(m->mSubscriptions.size()))
+		{
+			Subscription last = m->mSubscriptions.back();
+			m->mSubscriptions[index] = last;
+			last.mTopic->mSubscribers[last.mIndex].mSubscription = index;
+		}
+		m->mSubscriptions.pop_back();
+	}
+
+	bool			mUseMask{ true };
+	MemberVector	mMembers;		// Every connection; a removed one is replaced by the last
+	MemberMap		mMemberMap;
+	TopicMap		mTopics;		// Topics with at least one subscriber
+};
+
+Hub *Hub::create(bool useMask)
+{
+	auto ret = new HubImpl(useMask);
+	return static_cast<Hub *>(ret);
+}
+
+}
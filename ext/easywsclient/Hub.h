@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+
+// Topic based publish/subscribe over a set of websocket connections.
+// Each published message is encoded once as a PreparedFrame and queued by reference on every
+// subscriber, so fanning out costs one encode plus a pointer per connection.
+// Every topic keeps its subscribers in a dense array and every connection remembers its slot in
+// each topic it joined, so subscribing, unsubscribing and removing a connection are all O(1) per topic.
+// A hub is not thread safe; use it from the thread which polls its connections.
+
+namespace easywsclient
+{
+class WebSocket;
+class PreparedFrame;
+}
+
+namespace hub
+{
+
+class Hub
+{
+public:
+	// 'useMask' is applied to every published frame and should match how the connections were created
+	static Hub *create(bool useMask = true);
+
+	// Adds a connection which can then subscribe to topics and receives every 'broadcast'.
+	// The hub does not own the connection; call 'removeConnection' before deleting it.
+	virtual void addConnection(easywsclient::WebSocket *connection) = 0;
+
+	// Removes the connection and all of its subscriptions
+	virtual void removeConnection(easywsclient::WebSocket *connection) = 0;
+
+	// Subscribes a connection to a topic; returns false if it was already subscribed or was never added
+	virtual bool subscribe(easywsclient::WebSocket *connection, const char *topic) = 0;
+
+	// Returns false if the connection wasn't subscribed to this topic
+	virtual bool unsubscribe(easywsclient::WebSocket *connection, const char *topic) = 0;
+
+	// Sends a message to every subscriber of the topic; returns the number of subscribers it was queued on
+	virtual uint32_t publish(const char *topic, const void *data, uint32_t dataLen, bool isAscii) = 0;
+
+	// Queues an already prepared frame on every subscriber of the topic
+	virtual uint32_t publishFrame(const char *topic, easywsclient::PreparedFrame *frame) = 0;
+
+	// Sends a message to every connection in the hub
+	virtual uint32_t broadcast(const void *data, uint32_t dataLen, bool isAscii) = 0;
+
+	// Number of connections in the hub
+	virtual uint32_t getConnectionCount(void) const = 0;
+
+	// Number of connections subscribed to this topic
+	virtual uint32_t getSubscriberCount(const char *topic) const = 0;
+
+	// Number of topics with at least one subscriber
+	virtual uint32_t getTopicCount(void) const = 0;
+
+	virtual void release(void) = 0;
+protected:
+	virtual ~Hub(void)
+	{
+	}
+};
+
+}
@@ -0,0 +1,145 @@
+#pragma  once
+
+#include <stdint.h>
+#include "RelaxedAtomic.h"
+
+namespace latencyhistogram
+{
+
+#define HISTOGRAM_SUB_BITS 4								// Each power of two is split into 16 buckets
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 27								// Samples of 2^27 (about two minutes in microseconds) or more share the last bucket
+#define HISTOGRAM_BUCKET_COUNT ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+// Log-linear histogram of latency samples. Small values are counted exactly and larger ones
+// within about 6%, in a fixed 1.5kb of counters, so recording a sample is a few instructions.
+// Min, max and mean are kept exactly.
+// Samples are recorded by one thread, and any thread may read the histogram while it does.
+class LatencyHistogram
+{
+public:
+	LatencyHistogram(void)
+	{
+		reset();
+	}
+
+	// Only from the thread which records samples
+	void reset(void)
+	{
+		for (auto &b : mBuckets)
+		{
+			b = 0;
+		}
+		mCount = 0;
+		mSum = 0;
+		mMin = UINT32_MAX;
+		mMax = 0;
+	}
+
+	void record(uint32_t value)
+	{
+		mBuckets[getBucket(value)]++;
+		mCount++;
+		mSum += value;
+		mMin.lower(value);
+		mMax.raise(value);
+	}
+
+	uint64_t getCount(void) const
+	{
+		return mCount;
+	}
+
+	uint32_t getMin(void) const
+	{
+		return mCount ? uint32_t(mMin) : 0;
+	}
+
+	uint32_t getMax(void) const
+	{
+		return mMax;
+	}
+
+	uint32_t getMean(void) const
+	{
+		uint64_t count = mCount; // read once, as it may be reset in between
+		return count ? uint32_t(mSum / count) : 0;
+	}
+
+	// The value below which this fraction of the samples fall; the middle of the bucket it lands in
+	uint32_t getPercentile(double fraction) const
+	{
+		uint64_t count = mCount;
+		if (!count)
+		{
+			return 0;
+		}
+		uint64_t rank = uint64_t(fraction * double(count));
+		if (rank >= count)
+		{
+			rank = count - 1;
+		}
+		uint64_t seen = 0;
+		for (uint32_t i = 0; i < HISTOGRAM_BUCKET_COUNT; i++)
+		{
+			seen += mBuckets[i];
+			if (seen > rank)
+			{
+				if (i == HISTOGRAM_BUCKET_COUNT - 1)
+				{
+					return mMax; // the last bucket has no upper bound
+				}
+				uint32_t value = getBucketValue(i);
+				uint32_t low = mMin;
+				uint32_t high = mMax;
+				// Never report past the samples actually seen
+				value = value < low ? low : value;
+				return value > high ? high : value;
+			}
+		}
+		return mMax;
+	}
+
+private:
+	static uint32_t getBucket(uint32_t value)
+	{
+		if (value < HISTOGRAM_SUB_COUNT)
+		{
+			return value;
+		}
+		uint32_t msb = 31;
+		while (!(value & (1u << msb)))
+		{
+			msb--;
+		}
+		if (msb >= HISTOGRAM_MAX_BITS)
+		{
+			return HISTOGRAM_BUCKET_COUNT - 1;
+		}
+		uint32_t sub = (value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1);
+		return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT + sub;
+	}
+
+	static uint32_t getBucketValue(uint32_t bucket)
+	{
+		if (bucket < HISTOGRAM_SUB_COUNT)
+		{
+			return bucket;
+		}
+		uint32_t msb = bucket / HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_BITS - 1;
+		uint32_t sub = bucket % HISTOGRAM_SUB_COUNT;
+		uint32_t width = 1u << (msb - HISTOGRAM_SUB_BITS);
+		return (1u << msb) + sub * width + width / 2;
+	}
+
+	typedef relaxedatomic::RelaxedAtomic< uint32_t > Counter32;
+	typedef relaxedatomic::RelaxedAtomic< uint64_t > Counter64;
+
+	Counter32	mBuckets[HISTOGRAM_BUCKET_COUNT];
+	Counter64	mCount{ 0 };
+	Counter64	mSum{ 0 };
+	Counter32	mMin{ UINT32_MAX };
+	Counter32	mMax{ 0 };
+};
+
+}
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+
+// Implements a multiple producer single consumer message queue
+// Lock-free communications from any number of threads and/or processes to one reader using shared memory
+// The buffer is an array of fixed size slots. A writer claims the slots for a message with a compare-exchange
+// on the head position, which only succeeds if the reader has already freed all of them, and then publishes
+// each slot by stamping it with a sequence number.
+// The reader consumes slots in order as their stamps become valid, so writers never take a lock and never
+// wait on the reader: a full ring simply refuses the write. Writers can even be callbacks running on the
+// reader's own thread.
+// Messages larger than one slot span consecutive slots; the reader gathers those into a local buffer.
+namespace mpsc
+{
+
+const uint32_t cSharedMemoryVersion=202;	// Differs from the spsc version so a mismatched ring type is rejected
+const uint32_t cSlotSize=64;				// Size of one slot; one cache line
+const uint32_t cSlotHeaderSize=16;			// Sequence stamp, length and type at the start of each slot
+const uint32_t cSlotPayload=cSlotSize-cSlotHeaderSize; // Message bytes carried by each slot
+
+class MPSC
+{
+public:
+	struct SharedMemoryHeader
+	{
+		std::atomic<uint32_t>	mVersionNumber{ cSharedMemoryVersion };	// Version number
+		std::atomic<uint32_t>	mBufferSize{ 0 };							// Size of the shared memory buffer (including header)
+		std::atomic<uint32_t>	mSlotCount{ 0 };							// Number of slots in the ring
+		std::atomic<uint32_t>	mSequenceNumber{ 0 };						// a sequence number that can be used for general purposes
+		alignas(64) std::atomic<uint64_t>	mHead{ 0 };					// Next slot position to be claimed by a writer
+		alignas(64) std::atomic<uint64_t>	mTail{ 0 };					// Next slot position to be read
+	};
+
+	// A slot is free for the writer of position P when its sequence is P.
+	// It is published when its sequence is P+1 and becomes free again (P+slotCount) once read.
+	struct alignas(64) Slot
+	{
+		std::atomic<uint64_t>	mSequence;
+		uint32_t				mLength;		// Length of the whole message this slot is part of
+		uint32_t				mType;			// User defined message type
+		uint8_t					mData[cSlotPayload];
+	};
+
+	~MPSC(void)
+	{
+		free(mScratch);
+	}
+
+	bool init(void *sharedMemory,uint32_t maxLen,bool isWriter,bool isServer)
+	{
+		bool ret = true; // default return code
+		mIsWriter = isWriter;
+		if (maxLen >= sizeof(SharedMemoryHeader) + cSlotSize * 2)
+		{
+			mHeader = (SharedMemoryHeader *)sharedMemory;
+			mSlots = (Slot *)((uint8_t *)sharedMemory + sizeof(SharedMemoryHeader));
+			mSlotCount = (maxLen - uint32_t(sizeof(SharedMemoryHeader))) / cSlotSize;
+
+			if (isServer)
+			{
+				mHeader->mVersionNumber = cSharedMemoryVersion;
+				mHeader->mBufferSize = maxLen;
+				mHeader->mSlotCount = mSlotCount;
+				mHeader->mSequenceNumber.store(0, std::memory_order_relaxed);
+				mHeader->mHead.store(0, std::memory_order_relaxed);
+				mHeader->mTail.store(0, std::memory_order_relaxed);
+				for (uint32_t i = 0; i < mSlotCount; i++)
+				{
+					mSlots[i].mSequence.store(i, std::memory_order_relaxed);
+				}
+				std::atomic_thread_fence(std::memory_order_release);
+			}
+			else
+			{
+				if (mHeader->mVersionNumber != cSharedMemoryVersion || mHeader->mBufferSize != maxLen)
+				{
+					mHeader = nullptr;
+					mSlots = nullptr;
+					ret = false;
+				}
+			}
+		}
+		else
+		{
+			ret = false;
+		}
+		return ret;
+	}
+
+	// Writes one whole message. Safe to call from any number of threads/processes at the same time.
+	// Returns false, without waiting, if there is not enough room right now.
+	bool writeMessage(const void *data,uint32_t len,uint32_t type=0)
+	{
+		if (!mIsWriter || !mHeader) return false; // can't write if we are not a writer!
+		if (len > getMaxMessageSize()) return false;
+		uint32_t count = getSlotCount(len);
+		// A claim can't be undone, so only claim slots the reader has already freed. The reader frees a
+		// slot before moving the tail past it, so every position below tail+slotCount is free; the
+		// compare-exchange fails if another writer claimed in between, and we check again.
+		uint64_t position = mHeader->mHead.load(std::memory_order_relaxed);
+		do
+		{
+			uint64_t tail = mHeader->mTail.load(std::memory_order_acquire);
+			if (position - tail + count > mSlotCount)
+			{
+				return false;
+			}
+		} while (!mHeader->mHead.compare_exchange_weak(position, position + count, std::memory_order_relaxed));
+		const uint8_t *scan = (const uint8_t *)data;
+		uint32_t remaining = len;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			Slot &slot = getSlot(position + i);
+			uint32_t chunk = remaining < cSlotPayload ? remaining : cSlotPayload;
+			slot.mLength = len;
+			slot.mType = type;
+			if (chunk)
+			{
+				memcpy(slot.mData, scan, chunk);
+				scan += chunk;
+				remaining -= chunk;
+			}
+			slot.mSequence.store(position + i + 1, std::memory_order_release);
+		}
+		return true;
+	}
+
+	// Returns the next message or null if none is fully published yet.
+	// Single slot messages are returned in place; larger messages are gathered into a local buffer.
+	// The message remains valid until 'release' is called.
+	const uint8_t *peek(uint32_t &len,uint32_t &type)
+	{
+		if (mIsWriter || !mHeader) return nullptr; // writers cannot read!
+		uint64_t tail = mHeader->mTail.load(std::memory_order_relaxed);
+		Slot &first = getSlot(tail);
+		if (first.mSequence.load(std::memory_order_acquire) != tail + 1)
+		{
+			return nullptr;
+		}
+		len = first.mLength;
+		type = first.mType;
+		uint32_t count = getSlotCount(len);
+		if (count == 1)
+		{
+			mPeekCount = 1;
+			return first.mData;
+		}
+		for (uint32_t i = 1; i < count; i++)
+		{
+			if (getSlot(tail + i).mSequence.load(std::memory_order_acquire) != tail + i + 1)
+			{
+				return nullptr; // the writer is still filling in the rest of the message
+			}
+		}
+		if (len > mScratchSize)
+		{
+			free(mScratch);
+			mScratch = (uint8_t *)malloc(len);
+			mScratchSize = len;
+		}
+		uint8_t *dest = mScratch;
+		uint32_t remaining = len;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint32_t chunk = remaining < cSlotPayload ? remaining : cSlotPayload;
+			memcpy(dest, getSlot(tail + i).mData, chunk);
+			dest += chunk;
+			remaining -= chunk;
+		}
+		mPeekCount = count;
+		return mScratch;
+	}
+
+	// Releases the message returned by 'peek' so writers can reuse its slots
+	void release(void)
+	{
+		if (mIsWriter || !mHeader || !mPeekCount) return;
+		uint64_t tail = mHeader->mTail.load(std::memory_order_relaxed);
+		for (uint32_t i = 0; i < mPeekCount; i++)
+		{
+			getSlot(tail + i).mSequence.store(tail + i + mSlotCount, std::memory_order_release);
+		}
+		mHeader->mTail.store(tail + mPeekCount, std::memory_order_release);
+		mPeekCount = 0;
+	}
+
+	// The largest message which can be written to the ring
+	uint32_t getMaxMessageSize(void) const
+	{
+		return (mSlotCount / 2) * cSlotPayload;
+	}
+
+	// Number of slots a message of this length occupies
+	inline uint32_t getSlotCount(uint32_t len) const
+	{
+		return len ? (len + cSlotPayload - 1) / cSlotPayload : 1;
+	}
+
+	uint32_t incrementSequenceNumber(void)
+	{
+		uint32_t ret = 0;
+		if (mHeader)
+		{
+			ret = mHeader->mSequenceNumber++;
+		}
+		return ret;
+	}
+
+	uint32_t getSequenceNumber(void) const
+	{
+		uint32_t ret = 0;
+		if (mHeader)
+		{
+			ret = mHeader->mSequenceNumber;
+		}
+		return ret;
+	}
+
+private:
+	inline Slot &getSlot(uint64_t position) const
+	{
+		return mSlots[position % mSlotCount];
+	}
+
+	SharedMemoryHeader	*mHeader{nullptr};      		// points to the head of the shared memory;
+	Slot				*mSlots{nullptr};				// The slots follow the header
+	uint32_t			mSlotCount{ 0 };				// Number of slots in the ring
+	uint32_t			mPeekCount{ 0 };				// Number of slots used by the message returned from 'peek'
+	uint8_t				*mScratch{ nullptr };			// Buffer used to gather messages which span several slots
+	uint32_t			mScratchSize{ 0 };
+	bool				mIsWriter{ true };				// Whether or not we are a writer instance (can only do writes)
+};
+
+}
@@ -25,6 +25,8 @@
 #include <dirent.h>
 #endif
 
+#define HUGE_PAGE_SIZE (1024*1024*2)	// Huge pages are 2mb
+
 namespace memorymap
 {
 
@@ -33,9 +35,11 @@ namespace memorymap
 
 	{
 	public:
-		MemoryMapImpl(const char *mappingObject, uint64_t &size, bool createOk, bool readOnly)
+		// Large pages on windows require the SeLockMemoryPrivilege and a pagefile backed section, so 'hugePages' is ignored here
+		MemoryMapImpl(const char *mappingObject, uint64_t &size, bool createOk, bool readOnly, bool hugePages)
 		{
 			mData = nullptr;
+			(void)hugePages;
 			mMapFile = nullptr;
 			mMapHandle = nullptr;
 			bool createFile = true;
@@ -164,36 +168,71 @@ namespace memorymap
 	class MemoryMapImpl :public MemoryMap
 	{
 	public:
-		MemoryMapImpl(const char *mappingObject, uint64_t &size, bool createOk, bool readOnly)
+		MemoryMapImpl(const char *mappingObject, uint64_t &size, bool createOk, bool readOnly, bool hugePages)
 		{
-			mFileNumber = 0;
+			mFileNumber = -1;
 			mData = nullptr;
 			mMapLength = 0;
-			mFileNumber = open(mappingObject, O_RDONLY);
-			if (mFileNumber != -1)
+			if (createOk)
 			{
-				mMapLength = lseek(mFileNumber, 0L, SEEK_END);
-				if (mMapLength)
+				if (hugePages)
 				{
-					mData = mmap(0, mMapLength, PROT_READ, MAP_SHARED, mFileNumber, 0);
+					size = (size + HUGE_PAGE_SIZE - 1) & ~uint64_t(HUGE_PAGE_SIZE - 1);
 				}
+				mFileNumber = open(mappingObject, O_RDWR | O_CREAT | O_TRUNC, 0666);
+				if (mFileNumber != -1)
+				{
+					if (ftruncate(mFileNumber, off_t(size)) == 0)
+					{
+						mMapLength = size_t(size);
+					}
+				}
+			}
+			else
+			{
+				mFileNumber = open(mappingObject, readOnly ? O_RDONLY : O_RDWR);
+				if (mFileNumber != -1)
+				{
+					mMapLength = lseek(mFileNumber, 0L, SEEK_END);
+				}
+			}
+			if (mMapLength)
+			{
+				mData = mmap(0, mMapLength, readOnly ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, mFileNumber, 0);
 				if (mData == MAP_FAILED)
 				{
-					close(mFileNumber);
-					mFileNumber = 0;
-					mMapLength = 0;
 					mData = nullptr;
 				}
-				else
+			}
+			if (mData)
+			{
+#ifdef MADV_HUGEPAGE
+				if (hugePages)
+				{
+					// Files on hugetlbfs are always backed by huge pages; for tmpfs this is a hint
+					madvise(mData, mMapLength, MADV_HUGEPAGE);
+				}
+#endif
+				size = mMapLength;
+			}
+			else
+			{
+				if (mFileNumber != -1)
 				{
-					size = mMapLength;
+					close(mFileNumber);
+					mFileNumber = -1;
 				}
+				mMapLength = 0;
 			}
 		}
 
 		virtual ~MemoryMapImpl(void)
 		{
-			if (mFileNumber)
+			if (mData)
+			{
+				munmap(mData, mMapLength);
+			}
+			if (mFileNumber != -1)
 			{
 				close(mFileNumber);
 			}
@@ -222,9 +261,9 @@ namespace memorymap
 
 
 
-MemoryMap * MemoryMap::createMemoryMap(const char *fileName, uint64_t &size, bool createOk, bool readOnly)
+MemoryMap * MemoryMap::createMemoryMap(const char *fileName, uint64_t &size, bool createOk, bool readOnly, bool hugePages)
 {
-	MemoryMapImpl *m = new MemoryMapImpl(fileName, size, createOk, readOnly);
+	MemoryMapImpl *m = new MemoryMapImpl(fileName, size, createOk, readOnly, hugePages);
 	if (m->getBaseAddress() == nullptr)
 	{
 		m->release();
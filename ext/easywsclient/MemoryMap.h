@@ -7,7 +7,9 @@ namespace memorymap
     class MemoryMap
     {
     public:
-    	static MemoryMap * createMemoryMap(const char *fileName, uint64_t &size, bool createOk,bool readOnly);
+        // If 'hugePages' is true the size is rounded up to a multiple of 2mb and the mapping is backed
+        // by huge pages when the platform supports it (place the file on a hugetlbfs mount to guarantee it)
+    	static MemoryMap * createMemoryMap(const char *fileName, uint64_t &size, bool createOk,bool readOnly,bool hugePages=false);
         virtual uint64_t getFileSize(void) = 0;
         virtual void *getBaseAddress(void) = 0;
         virtual void release(void) = 0;
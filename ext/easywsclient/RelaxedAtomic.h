@@ -0,0 +1,67 @@
+#pragma  once
+
+#include <atomic>
+
+namespace relaxedatomic
+{
+
+// A value with a single writer, usually the thread polling a connection, which any thread may read.
+// With only one writer an increment needs no locked instruction: a relaxed load and store compile to
+// plain moves, so a counter costs what an ordinary integer would, yet a reader never sees a torn value.
+// Readers get no ordering between fields, so a snapshot of several may be a moment apart.
+template <typename T>
+class RelaxedAtomic
+{
+public:
+	RelaxedAtomic(void) : mValue(T())
+	{
+	}
+
+	RelaxedAtomic(T value) : mValue(value)
+	{
+	}
+
+	operator T(void) const
+	{
+		return mValue.load(std::memory_order_relaxed);
+	}
+
+	RelaxedAtomic &operator=(T value)
+	{
+		mValue.store(value, std::memory_order_relaxed);
+		return *this;
+	}
+
+	void operator++(int)
+	{
+		mValue.store(mValue.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	void operator+=(T value)
+	{
+		mValue.store(mValue.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+
+	// Keeps the larger of the two; for high water marks
+	void raise(T value)
+	{
+		if (value > mValue.load(std::memory_order_relaxed))
+		{
+			mValue.store(value, std::memory_order_relaxed);
+		}
+	}
+
+	// Keeps the smaller of the two
+	void lower(T value)
+	{
+		if (value < mValue.load(std::memory_order_relaxed))
+		{
+			mValue.store(value, std::memory_order_relaxed);
+		}
+	}
+
+private:
+	std::atomic<T>	mValue;
+};
+
+}
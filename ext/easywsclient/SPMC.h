@@ -0,0 +1,331 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include "wplatform.h"
+
+// Implements a single producer multiple consumer broadcast ring
+// One process/thread appends messages to the shared buffer
+// Any number of processes/threads (up to cMaxReaders) read every message, each at their own pace
+// The writer never waits for readers. A reader which falls a full lap behind has lost messages;
+// this is detected and the reader is resynchronized to the newest data in the ring.
+// Because the writer may overwrite a message while a slow reader is looking at it, readers always
+// copy messages out and then confirm the copy was not overwritten.
+// Each reader slot records the process which claimed it, so the slots of readers which crashed
+// without detaching are reclaimed by the next reader to attach.
+namespace spmc
+{
+
+const uint32_t cSharedMemoryVersion=101;
+const uint32_t cMaxReaders=64;				// Maximum number of readers attached to one ring
+const uint32_t cPaddingRecord=0xFFFFFFFF;	// Record type which marks unused space at the top of the ring
+const uint32_t cRecordAlignment=16;			// All records start on a 16 byte boundary
+
+enum class ReadStatus : uint32_t
+{
+	EMPTY,					// No new messages
+	MESSAGE,				// A message was copied out
+	LAPPED,					// The reader fell a full lap behind; it has been moved up to the newest data
+	BUFFER_TOO_SMALL,		// The next message is larger than the destination buffer; 'len' is the size required
+};
+
+class SPMC
+{
+public:
+	// Each reader's cursor lives in its own cache line so readers never contend with each other
+	struct alignas(64) ReaderSlot
+	{
+		std::atomic<uint32_t>	mPid{ 0 };					// Process id of the reader which claimed this slot; zero if free
+		std::atomic<uint32_t>	mLapCount{ 0 };				// Number of times this reader was lapped by the writer
+		std::atomic<uint64_t>	mReadPosition{ 0 };			// Position of the next message this reader will read
+	};
+
+	struct SharedMemoryHeader
+	{
+		std::atomic<uint32_t>	mVersionNumber{ cSharedMemoryVersion };	// Version number
+		std::atomic<uint32_t>	mBufferSize{ 0 };							// Size of the shared memory buffer (including header)
+		std::atomic<uint32_t>	mUnused1{ 0 };
+		std::atomic<uint32_t>	mUnused2{ 0 };
+		// Positions are byte offsets which increase forever; the buffer offset is position % capacity
+		alignas(64) std::atomic<uint64_t>	mWritePosition{ 0 };		// Everything before this is published
+		std::atomic<uint64_t>				mReservePosition{ 0 };	// The writer may be overwriting anything before this, minus one lap
+		ReaderSlot				mReaders[cMaxReaders];
+	};
+
+	// Every message in the ring is prefixed by this header
+	struct RecordHeader
+	{
+		uint32_t	mLength;		// Length of the message payload in bytes
+		uint32_t	mType;			// User defined message type, or cPaddingRecord
+		uint64_t	mPosition;		// Position this record was written at; lets readers detect stale data
+	};
+
+	~SPMC(void)
+	{
+		detach();
+	}
+
+	// The server creates the ring; clients verify the header matches
+	bool init(void *sharedMemory,uint32_t maxLen,bool isWriter,bool isServer)
+	{
+		bool ret = true; // default return code
+		mIsWriter = isWriter;
+		if (maxLen > sizeof(SharedMemoryHeader) + cRecordAlignment)
+		{
+			mSharedMemory = (uint8_t *)sharedMemory;
+			mBaseMemory = mSharedMemory + sizeof(SharedMemoryHeader);
+			mHeader = (SharedMemoryHeader *)mSharedMemory;
+			mCapacity = (maxLen - uint32_t(sizeof(SharedMemoryHeader))) & ~(cRecordAlignment - 1);
+
+			if (isServer)
+			{
+				mHeader->mVersionNumber = cSharedMemoryVersion;
+				mHeader->mBufferSize = maxLen;
+				mHeader->mWritePosition.store(0, std::memory_order_relaxed);
+				mHeader->mReservePosition.store(0, std::memory_order_relaxed);
+				for (uint32_t i = 0; i < cMaxReaders; i++)
+				{
+					mHeader->mReaders[i].mPid.store(0, std::memory_order_relaxed);
+					mHeader->mReaders[i].mLapCount.store(0, std::memory_order_relaxed);
+					mHeader->mReaders[i].mReadPosition.store(0, std::memory_order_relaxed);
+				}
+			}
+			else
+			{
+				if (mHeader->mVersionNumber != cSharedMemoryVersion || mHeader->mBufferSize != maxLen)
+				{
+					mSharedMemory = nullptr;
+					mBaseMemory = nullptr;
+					mHeader = nullptr;
+					ret = false;
+				}
+			}
+			if (ret && !mIsWriter)
+			{
+				ret = attach();
+			}
+		}
+		else
+		{
+			ret = false;
+		}
+		return ret;
+	}
+
+	// Appends a message to the ring. Never blocks; returns false only if the message can never fit.
+	bool write(const void *data,uint32_t len,uint32_t type=0)
+	{
+		if (!mIsWriter || !mHeader) return false; // can't write if we are not a writer!
+		if (len > getMaxMessageSize()) return false;
+		uint32_t recordSize = getRecordSize(len);
+		uint64_t writePosition = mHeader->mWritePosition.load(std::memory_order_relaxed);
+		uint32_t offset = uint32_t(writePosition % mCapacity);
+		uint32_t availTop = mCapacity - offset;
+		uint64_t recordPosition = writePosition;
+		if (recordSize > availTop)
+		{
+			recordPosition += availTop; // doesn't fit at the top, wrap around to the bottom of the ring
+		}
+		uint64_t endPosition = recordPosition + recordSize;
+		// Announce which bytes are about to be overwritten *before* touching them, so a reader
+		// copying an old message out can tell its copy may be torn
+		mHeader->mReservePosition.store(endPosition, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		if (recordPosition != writePosition)
+		{
+			RecordHeader *padding = (RecordHeader *)&mBaseMemory[offset];
+			padding->mLength = availTop;
+			padding->mType = cPaddingRecord;
+			padding->mPosition = writePosition;
+			offset = 0;
+		}
+		RecordHeader *rh = (RecordHeader *)&mBaseMemory[offset];
+		rh->mLength = len;
+		rh->mType = type;
+		rh->mPosition = recordPosition;
+		if (len)
+		{
+			memcpy(rh + 1, data, len);
+		}
+		mHeader->mWritePosition.store(endPosition, std::memory_order_release);
+		return true;
+	}
+
+	// Copies the next message into 'dest'.
+	ReadStatus read(void *dest,uint32_t maxLen,uint32_t &len,uint32_t &type)
+	{
+		if (mIsWriter || !mHeader || !mSlot) return ReadStatus::EMPTY; // writers cannot read!
+		while (true)
+		{
+			uint64_t writePosition = mHeader->mWritePosition.load(std::memory_order_acquire);
+			if (mReadPosition == writePosition)
+			{
+				return ReadStatus::EMPTY;
+			}
+			if (writePosition - mReadPosition > mCapacity)
+			{
+				return resync();
+			}
+			uint32_t offset = uint32_t(mReadPosition % mCapacity);
+			RecordHeader rh;
+			memcpy(&rh, &mBaseMemory[offset], sizeof(rh));
+			if (rh.mType == cPaddingRecord)
+			{
+				if (isOverwritten(mReadPosition))
+				{
+					return resync();
+				}
+				advance(mCapacity - offset); // skip the unused top of the ring
+				continue;
+			}
+			if (rh.mPosition != mReadPosition || offset + sizeof(RecordHeader) + rh.mLength > mCapacity)
+			{
+				return resync(); // stale or torn header
+			}
+			if (rh.mLength > maxLen)
+			{
+				if (isOverwritten(mReadPosition))
+				{
+					return resync();
+				}
+				len = rh.mLength;
+				return ReadStatus::BUFFER_TOO_SMALL;
+			}
+			if (rh.mLength)
+			{
+				memcpy(dest, &mBaseMemory[offset + sizeof(RecordHeader)], rh.mLength);
+			}
+			if (isOverwritten(mReadPosition))
+			{
+				return resync();
+			}
+			len = rh.mLength;
+			type = rh.mType;
+			advance(getRecordSize(rh.mLength));
+			return ReadStatus::MESSAGE;
+		}
+	}
+
+	// The largest message which can be written to the ring
+	uint32_t getMaxMessageSize(void) const
+	{
+		uint32_t half = (mCapacity / 2) & ~(cRecordAlignment - 1);
+		return half > sizeof(RecordHeader) ? half - uint32_t(sizeof(RecordHeader)) : 0;
+	}
+
+	// Size of a message in the ring including the header, rounded up to the record alignment
+	inline uint32_t getRecordSize(uint32_t len) const
+	{
+		return (uint32_t(sizeof(RecordHeader)) + len + (cRecordAlignment - 1)) & ~(cRecordAlignment - 1);
+	}
+
+	// Number of times this reader has been lapped by the writer
+	uint32_t getLapCount(void) const
+	{
+		return mSlot ? mSlot->mLapCount.load(std::memory_order_relaxed) : 0;
+	}
+
+	// How many bytes this reader is behind the writer
+	uint64_t getLag(void) const
+	{
+		return mHeader ? mHeader->mWritePosition.load(std::memory_order_relaxed) - mReadPosition : 0;
+	}
+
+	// Number of readers currently attached to the ring
+	uint32_t getReaderCount(void) const
+	{
+		uint32_t ret = 0;
+		if (mHeader)
+		{
+			for (uint32_t i = 0; i < cMaxReaders; i++)
+			{
+				if (mHeader->mReaders[i].mPid.load(std::memory_order_relaxed))
+				{
+					ret++;
+				}
+			}
+		}
+		return ret;
+	}
+
+	// Gives up this reader's slot so another reader can attach
+	void detach(void)
+	{
+		if (mSlot)
+		{
+			mSlot->mPid.store(0, std::memory_order_release);
+			mSlot = nullptr;
+		}
+	}
+
+private:
+	// Claims a free reader slot, or failing that the slot of a reader whose process has died.
+	// New readers start with the next message written.
+	bool attach(void)
+	{
+		uint32_t myPid = wplatform::getProcessId();
+		for (uint32_t i = 0; i < cMaxReaders; i++)
+		{
+			uint32_t expected = 0;
+			if (mHeader->mReaders[i].mPid.compare_exchange_strong(expected, myPid))
+			{
+				claimSlot(i);
+				return true;
+			}
+		}
+		for (uint32_t i = 0; i < cMaxReaders; i++)
+		{
+			uint32_t pid = mHeader->mReaders[i].mPid.load(std::memory_order_acquire);
+			if (pid && !wplatform::isProcessAlive(pid) && mHeader->mReaders[i].mPid.compare_exchange_strong(pid, myPid))
+			{
+				claimSlot(i);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void claimSlot(uint32_t index)
+	{
+		mSlot = &mHeader->mReaders[index];
+		mReadPosition = mHeader->mWritePosition.load(std::memory_order_acquire);
+		mSlot->mLapCount.store(0, std::memory_order_relaxed);
+		mSlot->mReadPosition.store(mReadPosition, std::memory_order_relaxed);
+	}
+
+	// Returns true if the writer may have started overwriting the data at this position
+	inline bool isOverwritten(uint64_t position) const
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t reservePosition = mHeader->mReservePosition.load(std::memory_order_relaxed);
+		return reservePosition - position > mCapacity;
+	}
+
+	inline void advance(uint32_t size)
+	{
+		mReadPosition += size;
+		mSlot->mReadPosition.store(mReadPosition, std::memory_order_relaxed);
+	}
+
+	// Skip everything we missed and continue with the next message the writer publishes
+	ReadStatus resync(void)
+	{
+		mReadPosition = mHeader->mWritePosition.load(std::memory_order_acquire);
+		mSlot->mReadPosition.store(mReadPosition, std::memory_order_relaxed);
+		mSlot->mLapCount.fetch_add(1, std::memory_order_relaxed);
+		return ReadStatus::LAPPED;
+	}
+
+	SharedMemoryHeader	*mHeader{nullptr};      		// points to the head of the shared memory;
+	uint8_t				*mSharedMemory{nullptr};		// Address of shared memory between processes (includes header)
+	uint8_t				*mBaseMemory{nullptr};			// Base address of the circular buffer (mSharedMemory+header)
+	ReaderSlot			*mSlot{nullptr};				// This reader's cursor in shared memory
+	uint64_t			mReadPosition{ 0 };				// Local copy of this reader's cursor
+	uint32_t			mCapacity{ 0 };					// The total capacity of the circular buffer
+	bool				mIsWriter{ true };				// Whether or not we are a writer instance (can only do writes)
+};
+
+}
@@ -10,10 +10,17 @@
 // Lock-free thread safe communications between two threads and/or processes using shared memory
 // One process/thread can write to the shared buffer
 // One process/thread can read from the shared buffer
+//
+// The ring can be used in one of two modes, but never both at the same time on the same buffer:
+// As a byte stream using 'read' and 'write'
+// As a message queue using 'reserve'/'commit' on the writer and 'peek'/'release' on the reader.
+// In message mode every message is stored contiguously so the reader can process it in place.
 namespace spsc
 {
 
 const uint32_t cSharedMemoryVersion=100;
+const uint32_t cPaddingRecord=0xFFFFFFFF;	// Record type which marks unused space at the top of the ring
+const uint32_t cRecordAlignment=8;			// All records start on an 8 byte boundary
 
 class SPSC
 {
@@ -30,6 +37,13 @@ public:
 		std::atomic<uint32_t>	mUnused3{ 0 };
 	};
 
+	// Every message in the ring is prefixed by this header
+	struct RecordHeader
+	{
+		uint32_t	mLength;		// Length of the message payload in bytes
+		uint32_t	mType;			// User defined message type, or cPaddingRecord
+	};
+
 	bool init(void *sharedMemory,uint32_t maxLen,bool isWriter,bool isServer)
 	{
 		bool ret = true; // default return code
@@ -177,6 +191,137 @@ public:
 		return avail;
 	}
 
+	// Returns a pointer to 'len' contiguous bytes in the ring the caller can write the message into.
+	// Returns null if there is not enough room right now.
+	// Nothing is visible to the reader until 'commit' is called.
+	uint8_t *reserve(uint32_t len,uint32_t type=0)
+	{
+		if (!mIsWriter || !mHeader) return nullptr; // can't write if we are not a writer!
+		uint32_t recordSize = getRecordSize(len);
+		uint32_t recordCapacity = getRecordCapacity();
+		uint32_t writeIndex = mHeader->mWriteIndex.load(std::memory_order_relaxed);
+		uint32_t readIndex = mHeader->mReadIndex.load(std::memory_order_acquire);
+		uint32_t recordIndex = writeIndex;
+		if (writeIndex >= readIndex)
+		{
+			uint32_t availTop = recordCapacity - writeIndex;
+			// If the record ends exactly at the top the write index wraps to zero, which would
+			// look like an empty buffer if the reader is also sitting at zero.
+			if (recordSize < availTop || (recordSize == availTop && readIndex != 0))
+			{
+				// fits at the current write location
+			}
+			else if (recordSize < readIndex)
+			{
+				recordIndex = 0; // doesn't fit at the top, wrap around to the bottom of the ring
+			}
+			else
+			{
+				return nullptr;
+			}
+		}
+		else if (recordSize >= (readIndex - writeIndex))
+		{
+			return nullptr;
+		}
+		if (recordIndex != writeIndex)
+		{
+			// Mark the rest of the top of the ring as unused so the reader skips it
+			RecordHeader *padding = (RecordHeader *)&mBaseMemory[writeIndex];
+			padding->mLength = recordCapacity - writeIndex;
+			padding->mType = cPaddingRecord;
+		}
+		RecordHeader *rh = (RecordHeader *)&mBaseMemory[recordIndex];
+		rh->mLength = len;
+		rh->mType = type;
+		mReserveIndex = recordIndex;
+		mReserveSize = recordSize;
+		return (uint8_t *)(rh + 1);
+	}
+
+	// Publishes the message previously returned by 'reserve' to the reader
+	bool commit(void)
+	{
+		if (mReserveSize == 0) return false;
+		uint32_t writeIndex = mReserveIndex + mReserveSize;
+		if (writeIndex == getRecordCapacity())
+		{
+			writeIndex = 0;
+		}
+		mReserveSize = 0;
+		mHeader->mWriteIndex.store(writeIndex, std::memory_order_release);
+		return true;
+	}
+
+	// Convenience method to reserve, copy, and commit a message in one call.
+	// Returns false if there is not enough room right now.
+	bool writeMessage(const void *data,uint32_t len,uint32_t type=0)
+	{
+		uint8_t *dest = reserve(len, type);
+		if (!dest) return false;
+		if (len)
+		{
+			memcpy(dest, data, len);
+		}
+		return commit();
+	}
+
+	// Returns the next message in the ring, in place, or null if the ring is empty.
+	// The message remains valid until 'release' is called.
+	const uint8_t *peek(uint32_t &len,uint32_t &type)
+	{
+		if (mIsWriter || !mHeader) return nullptr; // writers cannot read!
+		uint32_t readIndex = mHeader->mReadIndex.load(std::memory_order_relaxed);
+		uint32_t writeIndex = mHeader->mWriteIndex.load(std::memory_order_acquire);
+		if (readIndex == writeIndex)
+		{
+			return nullptr;
+		}
+		const RecordHeader *rh = (const RecordHeader *)&mBaseMemory[readIndex];
+		if (rh->mType == cPaddingRecord)
+		{
+			// The writer wrapped around; the message is at the bottom of the ring
+			mHeader->mReadIndex.store(0, std::memory_order_release);
+			rh = (const RecordHeader *)mBaseMemory;
+		}
+		len = rh->mLength;
+		type = rh->mType;
+		return (const uint8_t *)(rh + 1);
+	}
+
+	// Releases the message returned by 'peek' so the writer can reuse the space
+	void release(void)
+	{
+		if (mIsWriter || !mHeader) return;
+		uint32_t readIndex = mHeader->mReadIndex.load(std::memory_order_relaxed);
+		const RecordHeader *rh = (const RecordHeader *)&mBaseMemory[readIndex];
+		readIndex += getRecordSize(rh->mLength);
+		if (readIndex == getRecordCapacity())
+		{
+			readIndex = 0;
+		}
+		mHeader->mReadIndex.store(readIndex, std::memory_order_release);
+	}
+
+	// The largest message which is guaranteed to eventually fit in the ring
+	uint32_t getMaxMessageSize(void) const
+	{
+		uint32_t half = (getRecordCapacity() / 2) & ~(cRecordAlignment - 1);
+		return half > sizeof(RecordHeader) ? half - uint32_t(sizeof(RecordHeader)) : 0;
+	}
+
+	// Size of a message in the ring including the header, rounded up to the record alignment
+	inline uint32_t getRecordSize(uint32_t len) const
+	{
+		return (uint32_t(sizeof(RecordHeader)) + len + (cRecordAlignment - 1)) & ~(cRecordAlignment - 1);
+	}
+
+	// Usable ring size in message mode; trimmed so the top of the ring is record aligned
+	inline uint32_t getRecordCapacity(void) const
+	{
+		return mCapacity & ~(cRecordAlignment - 1);
+	}
+
 	uint32_t incrementSequenceNumber(void)
 	{
 		uint32_t ret = 0;
@@ -203,6 +348,8 @@ private:
 	uint8_t				*mBaseMemory{nullptr};			// Base address of the read/write circular buffer (mSharedMemory+header)
 	uint32_t			mCapacity{ 0 };					// The total capacity of the read/write buffer
 	bool				mIsWriter{ true };				// Whether or not we are a writer instance (can only do writes)
+	uint32_t			mReserveIndex{ 0 };				// Location of the message currently reserved by the writer
+	uint32_t			mReserveSize{ 0 };				// Size of the reserved record; zero if nothing is reserved
 };
 
 }
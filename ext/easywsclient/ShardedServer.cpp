@@ -0,0 +1,712 @@
+#include "ShardedServer.h"
+#include "easywsclient.h"
+#include "wsocket.h"
+#include "wplatform.h"
+#include "Hub.h"
+#include "MPSC.h"
+#include "TimerWheel.h"
+#include "Timer.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <string>
+
+#ifdef _MSC_VER
+#pragma warning(disable:4100)
+#endif
+
+#define IDLE_SLEEP_NANO (100*1000)	// How long a worker sleeps after a pass where nothing happened
+#define POST_RING_SIZE (1024*256)	// Size of each worker's queue of broadcasts posted from other threads
+#define MIN_STEAL_COUNT 2			// An idle worker only steals from a backlog at least this long
+
+namespace shardedserver
+{
+
+class Worker;
+
+// Routes the messages of one connection to the server callback
+class Connection : public easywsclient::WebSocketCallback
+{
+public:
+	Connection(Worker *worker,easywsclient::WebSocket *webSocket) : mWorker(worker), mWebSocket(webSocket)
+	{
+	}
+
+	virtual ~Connection(void)
+	{
+		delete mWebSocket;
+	}
+
+	virtual void receiveMessage(const void *data, uint32_t dataLen, bool isAscii) override final;
+	virtual void onStalePeer(void) override final;
+
+	Worker					*mWorker{ nullptr };
+	easywsclient::WebSocket	*mWebSocket{ nullptr };
+};
+
+typedef std::vector< Connection * > ConnectionVector;
+typedef std::deque< wsocket::Wsocket * > WsocketQueue;
+typedef std::vector< Worker * > WorkerVector;
+
+// A broadcast which couldn't fit in a worker's post ring
+struct PostedFrame
+{
+	easywsclient::PreparedFrame	*mFrame{ nullptr };
+	std::string					mTopic;		// Empty for every connection
+};
+
+typedef std::vector< PostedFrame > PostedFrameVector;
+
+// One thread which owns a listener (when it has its own) and a set of connections.
+class Worker
+{
+public:
+	Worker(uint32_t index,ShardedServerCallback *callback,const wsocket::SocketOptions &options,const easywsclient::Timeouts *timeouts) : mIndex(index), mCallback(callback)
+	{
+		if (timeouts)
+		{
+			mTimeouts = *timeouts;
+			mTimerWheel = timerwheel::TimerWheel::create();
+		}
+		mAcceptBatchSize = options.mAcceptBatchSize ? options.mAcceptBatchSize : 1;
+		mMaxPendingHandshakes = options.mMaxPendingHandshakes;
+		mAccepted.resize(mAcceptBatchSize);
+		mHub = hub::Hub::create(true);
+		// One ring memory, seen through a reader for this worker and a writer shared by every other thread
+		mPostMemory = malloc(POST_RING_SIZE + 64);
+		void *ring = (void *)((uintptr_t(mPostMemory) + 63) & ~uintptr_t(63));
+		mPostReader.init(ring, POST_RING_SIZE, false, true);
+		mPostWriter.init(ring, POST_RING_SIZE, true, false);
+	}
+
+	~Worker(void)
+	{
+		stop();
+		for (auto &i : mConnections)
+		{
+			mCallback->onDisconnect(mIndex, i->mWebSocket);
+			delete i;
+		}
+		for (auto &i : mInbox)
+		{
+			i->release();
+		}
+		if (mListener)
+		{
+			mListener->release();
+		}
+		deliverPosted(false);
+		mHub->release();
+		if (mTimerWheel)
+		{
+			mTimerWheel->release(); // after the connections, which cancel their timers on it
+		}
+		free(mPostMemory);
+	}
+
+	void start(void)
+	{
+		mThread = new std::thread([this]()
+		{
+			run();
+		});
+	}
+
+	// True if called from this worker's own thread, as its callbacks are
+	bool isWorkerThread(void) const
+	{
+		return mThread && mThread->get_id() == std::this_thread::get_id();
+	}
+
+	void stop(void)
+	{
+		if (mThread)
+		{
+			mExit = true;
+			mThread->join();
+			delete mThread;
+			mThread = nullptr;
+		}
+	}
+
+	// Gives this worker a connection accepted by another worker's listener
+	void handOff(wsocket::Wsocket *socket)
+	{
+		std::lock_guard<std::mutex> lock(mInboxMutex);
+		mInbox.push_back(socket);
+		mInboxSize.store(uint32_t(mInbox.size()), std::memory_order_relaxed);
+	}
+
+	// Queues a frame for every connection of this worker, or the subscribers of a topic.
+	// Called from any thread. The common case is one lock-free write to the post ring; if the
+	// ring is full the frame goes to an overflow list, and stays there in order until it is drained.
+	void post(easywsclient::PreparedFrame *frame, const char *topic)
+	{
+		frame->addRef();
+		if (mPostOverflowing.load(std::memory_order_acquire))
+		{
+			std::lock_guard<std::mutex> lock(mPostMutex);
+			if (mPostOverflowing.load(std::memory_order_relaxed))
+			{
+				addOverflow(frame, topic);
+				return;
+			}
+		}
+		uint8_t message[256];
+		uint32_t topicLen = uint32_t(strlen(topic));
+		if (topicLen + sizeof(frame) <= sizeof(message))
+		{
+			memcpy(message, &frame, sizeof(frame));
+			memcpy(message + sizeof(frame), topic, topicLen);
+			if (mPostWriter.writeMessage(message, uint32_t(sizeof(frame)) + topicLen))
+			{
+				return;
+			}
+		}
+		std::lock_guard<std::mutex> lock(mPostMutex);
+		addOverflow(frame, topic);
+		mPostOverflowing.store(true, std::memory_order_release);
+	}
+
+	void run(void)
+	{
+		while (!mExit)
+		{
+			uint64_t activity = mActivity;
+			bool draining = mDraining.load(std::memory_order_acquire);
+			if (mTimerWheel && mTimerWheel->update())
+			{
+				mActivity++;
+			}
+			if (draining)
+			{
+				drainConnections();
+			}
+			else
+			{
+				acceptConnections();
+			}
+			pollConnections();
+			deliverPosted(true);
+			if (activity == mActivity && (draining || !stealConnections()))
+			{
+				wplatform::sleepNano(IDLE_SLEEP_NANO);
+			}
+		}
+	}
+
+	// Accepts a batch of waiting connections from our listener, then adopts anything handed to us.
+	// Once too many handshakes are pending, new connections are refused until some complete.
+	void acceptConnections(void)
+	{
+		if (mListener)
+		{
+			uint32_t batch = mAcceptBatchSize;
+			uint32_t overflow = 0;
+			if (mMaxPendingHandshakes && !mHandOffWorkers)
+			{
+				uint32_t pending = mPendingHandshakes + mInboxSize.load(std::memory_order_relaxed);
+				uint32_t room = pending < mMaxPendingHandshakes ? mMaxPendingHandshakes - pending : 0;
+				if (room < batch)
+				{
+					overflow = batch - room;
+					batch = room;
+				}
+			}
+			uint32_t count = mListener->pollServerBatch(&mAccepted[0], batch);
+			if (overflow && count == batch)
+			{
+				// We're full and more are waiting; refuse them now rather than let them time out
+				uint32_t shed = mListener->rejectPending(overflow);
+				if (shed)
+				{
+					mActivity++;
+					mShedCount += shed;
+				}
+			}
+			for (uint32_t i = 0; i < count; i++)
+			{
+				wsocket::Wsocket *socket = mAccepted[i];
+				Worker *w = this;
+				if (mHandOffWorkers)
+				{
+					// We are the only listener; spread the connections round robin
+					w = (*mHandOffWorkers)[mNextWorker];
+					mNextWorker = (mNextWorker + 1) % uint32_t(mHandOffWorkers->size());
+				}
+				w->handOff(socket);
+				mActivity++;
+			}
+		}
+		// Start at most one batch of handshakes per pass; the rest wait where an idle worker can steal them
+		wsocket::Wsocket *adopt[64];
+		uint32_t adoptCount = 0;
+		if (mInboxSize.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> lock(mInboxMutex);
+			while (!mInbox.empty() && adoptCount < 64 && adoptCount < mAcceptBatchSize)
+			{
+				adopt[adoptCount++] = mInbox.front();
+				mInbox.pop_front();
+			}
+			mInboxSize.store(uint32_t(mInbox.size()), std::memory_order_relaxed);
+		}
+		for (uint32_t i = 0; i < adoptCount; i++)
+		{
+			addConnection(adopt[i]);
+		}
+	}
+
+	// Called when a pass found nothing to do. Takes half of the longest backlog of connections waiting
+	// for another worker to start their handshake. Returns true if anything was taken.
+	bool stealConnections(void)
+	{
+		if (!mPeers || mPeers->size() < 2)
+		{
+			return false;
+		}
+		Worker *victim = nullptr;
+		uint32_t most = MIN_STEAL_COUNT - 1;
+		for (auto &i : *mPeers)
+		{
+			uint32_t size = i->mInboxSize.load(std::memory_order_relaxed);
+			if (i != this && size > most)
+			{
+				victim = i;
+				most = size;
+			}
+		}
+		if (!victim)
+		{
+			return false;
+		}
+		WsocketQueue stolen;
+		{
+			// Never wait on a busy worker's lock; there will be another chance on the next idle pass
+			std::unique_lock<std::mutex> lock(victim->mInboxMutex, std::try_to_lock);
+			if (!lock.owns_lock())
+			{
+				return false;
+			}
+			uint32_t take = uint32_t(victim->mInbox.size()) / 2;
+			while (take--)
+			{
+				stolen.push_back(victim->mInbox.back());
+				victim->mInbox.pop_back();
+			}
+			victim->mInboxSize.store(uint32_t(victim->mInbox.size()), std::memory_order_relaxed);
+		}
+		for (auto &i : stolen)
+		{
+			addConnection(i);
+		}
+		mStealCount += stolen.size();
+		return !stolen.empty();
+	}
+
+	// Hands every posted frame to our connections; when 'send' is false they are only released
+	void deliverPosted(bool send)
+	{
+		uint32_t len;
+		uint32_t type;
+		const uint8_t *message;
+		while ((message = mPostReader.peek(len, type)) != nullptr)
+		{
+			easywsclient::PreparedFrame *frame;
+			memcpy(&frame, message, sizeof(frame));
+			if (send)
+			{
+				std::string topic((const char *)message + sizeof(frame), len - sizeof(frame));
+				deliver(frame, topic);
+			}
+			frame->release();
+			mPostReader.release();
+		}
+		if (mPostOverflowing.load(std::memory_order_acquire))
+		{
+			PostedFrameVector overflow;
+			{
+				std::lock_guard<std::mutex> lock(mPostMutex);
+				overflow.swap(mPostOverflow);
+				mPostOverflowing.store(false, std::memory_order_release);
+			}
+			for (auto &i : overflow)
+			{
+				if (send)
+				{
+					deliver(i.mFrame, i.mTopic);
+				}
+				i.mFrame->release();
+			}
+		}
+	}
+
+	void deliver(easywsclient::PreparedFrame *frame, const std::string &topic)
+	{
+		mActivity++;
+		if (topic.empty())
+		{
+			for (auto &i : mConnections)
+			{
+				i->mWebSocket->sendFrame(frame);
+			}
+		}
+		else
+		{
+			mHub->publishFrame(topic.c_str(), frame);
+		}
+	}
+
+	void addOverflow(easywsclient::PreparedFrame *frame, const char *topic)
+	{
+		PostedFrame p;
+		p.mFrame = frame;
+		p.mTopic = topic;
+		mPostOverflow.push_back(p);
+	}
+
+	void addConnection(wsocket::Wsocket *socket)
+	{
+		mActivity++;
+		easywsclient::WebSocket *ws = easywsclient::WebSocket::create(socket);
+		if (ws)
+		{
+			if (mTimerWheel)
+			{
+				ws->setTimeouts(mTimeouts, mTimerWheel);
+			}
+			mConnections.push_back(new Connection(this, ws));
+			mHub->addConnection(ws);
+			mConnectionCount++;
+			mAcceptCount++;
+			mPendingHandshakes++;
+			mCallback->onConnect(mIndex, ws);
+		}
+	}
+
+	void pollConnections(void)
+	{
+		uint32_t pending = 0;
+		size_t i = 0;
+		while (i < mConnections.size())
+		{
+			Connection *c = mConnections[i];
+			c->mWebSocket->poll(c);
+			if (c->mWebSocket->hasPendingWork())
+			{
+				mActivity++; // it stopped at its poll budget, so don't sleep before the next pass
+			}
+			easywsclient::WebSocket::ReadyStateValues state = c->mWebSocket->getReadyState();
+			if (state == easywsclient::WebSocket::CONNECTING)
+			{
+				pending++;
+			}
+			if (state == easywsclient::WebSocket::CLOSED)
+			{
+				removeConnection(i);
+			}
+			else
+			{
+				i++;
+			}
+		}
+		mPendingHandshakes = pending;
+	}
+
+	// Deletes a connection; order doesn't matter, so the hole is filled with the last connection
+	void removeConnection(size_t i)
+	{
+		Connection *c = mConnections[i];
+		mActivity++;
+		mCallback->onDisconnect(mIndex, c->mWebSocket);
+		mHub->removeConnection(c->mWebSocket);
+		delete c;
+		mConnections[i] = mConnections.back();
+		mConnections.pop_back();
+		mConnectionCount--;
+	}
+
+	// Called each pass once 'drain' has been asked for. The first call closes our listener, so new
+	// connects are refused (or go to another process sharing the port) rather than wait in its backlog,
+	// closes every connection, and abandons the ones still in their handshake; the normal poll then
+	// removes them as they finish. Whatever is left when the deadline passes is dropped.
+	void drainConnections(void)
+	{
+		if (mInboxSize.load(std::memory_order_relaxed))
+		{
+			// Including any a listening worker handed us before it saw the drain
+			std::lock_guard<std::mutex> lock(mInboxMutex);
+			for (auto &i : mInbox)
+			{
+				i->release();
+			}
+			mInbox.clear();
+			mInboxSize.store(0, std::memory_order_relaxed);
+		}
+		if (!mDrainStarted)
+		{
+			mDrainStarted = true;
+			mDrainTimer.reset();
+			if (mListener)
+			{
+				mListener->release();
+				mListener = nullptr;
+			}
+			size_t i = 0;
+			while (i < mConnections.size())
+			{
+				easywsclient::WebSocket *ws = mConnections[i]->mWebSocket;
+				if (ws->getReadyState() == easywsclient::WebSocket::CONNECTING)
+				{
+					removeConnection(i);
+				}
+				else
+				{
+					ws->close();
+					i++;
+				}
+			}
+			mActivity++;
+		}
+		if (mDrained.load(std::memory_order_relaxed))
+		{
+			return;
+		}
+		if (!mConnections.empty() && mDrainTimer.peekElapsedSeconds() * 1000 >= mDrainMilliseconds.load(std::memory_order_relaxed))
+		{
+			mDrainDropped += uint32_t(mConnections.size());
+			while (!mConnections.empty())
+			{
+				removeConnection(mConnections.size() - 1);
+			}
+		}
+		if (mConnections.empty())
+		{
+			mDrained.store(true, std::memory_order_release);
+		}
+	}
+
+	uint32_t					mIndex{ 0 };
+	ShardedServerCallback		*mCallback{ nullptr };
+	wsocket::Wsocket			*mListener{ nullptr };	// Our own listener; null if another worker accepts for us
+	WorkerVector				*mHandOffWorkers{ nullptr };	// Set if we are the only listener and must share connections
+	WorkerVector				*mPeers{ nullptr };		// Every worker, including this one; used to find work to steal
+	uint32_t					mNextWorker{ 0 };		// Next worker to receive a handed off connection
+	uint32_t					mAcceptBatchSize{ 1 };	// Most connections accepted from the listener per pass
+	uint32_t					mMaxPendingHandshakes{ 0 };	// Admission cap; zero means no limit
+	uint32_t					mPendingHandshakes{ 0 };	// Connections still in their handshake as of the last pass
+	std::vector< wsocket::Wsocket * >	mAccepted;			// Scratch space for a batch of accepted connections
+	ConnectionVector			mConnections;
+	std::mutex					mInboxMutex;
+	WsocketQueue				mInbox;					// Accepted connections waiting for a worker to start their handshake
+	std::atomic<uint32_t>		mInboxSize{ 0 };		// Size of mInbox, readable without the lock
+	hub::Hub					*mHub{ nullptr };		// Topic subscriptions of our connections
+	timerwheel::TimerWheel		*mTimerWheel{ nullptr };	// Timeouts of our connections; null if there are none
+	easywsclient::Timeouts		mTimeouts;
+	void						*mPostMemory{ nullptr };
+	mpsc::MPSC					mPostReader;			// Frames posted to us by any thread
+	mpsc::MPSC					mPostWriter;
+	std::mutex					mPostMutex;
+	PostedFrameVector			mPostOverflow;			// Posted frames which didn't fit in the ring
+	std::atomic<bool>			mPostOverflowing{ false };
+	std::atomic<uint64_t>		mStealCount{ 0 };
+	uint64_t					mActivity{ 0 };			// Changes whenever the worker did something; used to decide when to sleep
+	std::atomic<uint32_t>		mConnectionCount{ 0 };
+	std::atomic<uint64_t>		mAcceptCount{ 0 };
+	std::atomic<uint64_t>		mShedCount{ 0 };
+	std::atomic<bool>			mDraining{ false };		// Set by 'drain'; no more connections are accepted
+	std::atomic<uint32_t>		mDrainMilliseconds{ 0 };
+	std::atomic<bool>			mDrained{ false };		// Set once every connection is gone
+	std::atomic<uint32_t>		mDrainDropped{ 0 };		// Connections still closing at the deadline
+	bool						mDrainStarted{ false };
+	timer::Timer				mDrainTimer;
+	std::atomic<bool>			mExit{ false };
+	std::thread					*mThread{ nullptr };
+};
+
+void Connection::receiveMessage(const void *data, uint32_t dataLen, bool isAscii)
+{
+	mWorker->mActivity++;
+	mWorker->mCallback->onMessage(mWorker->mIndex, mWebSocket, data, dataLen, isAscii);
+}
+
+void Connection::onStalePeer(void)
+{
+	mWorker->mCallback->onStalePeer(mWorker->mIndex, mWebSocket);
+}
+
+class ShardedServerImpl : public ShardedServer
+{
+public:
+	ShardedServerImpl(int32_t port,uint32_t workerCount,ShardedServerCallback *callback,const wsocket::SocketOptions *options,const easywsclient::Timeouts *timeouts)
+	{
+		if (workerCount == 0)
+		{
+			workerCount = std::thread::hardware_concurrency();
+			if (workerCount == 0)
+			{
+				workerCount = 1;
+			}
+		}
+		wsocket::SocketOptions listenOptions;
+		if (options)
+		{
+			listenOptions = *options;
+		}
+		listenOptions.mReusePort = true;
+		bool sharedListener = false;
+		for (uint32_t i = 0; i < workerCount; i++)
+		{
+			Worker *w = new Worker(i, callback, listenOptions, timeouts);
+			mWorkers.push_back(w);
+			w->mPeers = &mWorkers;
+			if (!sharedListener)
+			{
+				w->mListener = wsocket::Wsocket::create(SOCKET_SERVER, port, &listenOptions);
+				if (!w->mListener && i)
+				{
+					// The port can't be shared, so the first worker accepts for everyone
+					fprintf(stderr, "WARNING: unable to share port %d between workers; using a single listener\n", port);
+					sharedListener = true;
+					for (auto &j : mWorkers)
+					{
+						if (j->mListener && j->mIndex)
+						{
+							j->mListener->release();
+							j->mListener = nullptr;
+						}
+					}
+					mWorkers[0]->mHandOffWorkers = &mWorkers;
+				}
+			}
+		}
+		if (isValid())
+		{
+			for (auto &i : mWorkers)
+			{
+				i->start();
+			}
+		}
+	}
+
+	virtual ~ShardedServerImpl(void)
+	{
+		// Stop every thread first, since the listener may still be handing connections to other workers
+		for (auto &i : mWorkers)
+		{
+			i->stop();
+		}
+		for (auto &i : mWorkers)
+		{
+			delete i;
+		}
+	}
+
+	bool isValid(void) const
+	{
+		return !mWorkers.empty() && mWorkers[0]->mListener;
+	}
+
+	virtual uint32_t getWorkerCount(void) const override final
+	{
+		return uint32_t(mWorkers.size());
+	}
+
+	virtual uint32_t getConnectionCount(uint32_t worker) const override final
+	{
+		return worker < mWorkers.size() ? mWorkers[worker]->mConnectionCount.load(std::memory_order_relaxed) : 0;
+	}
+
+	virtual uint64_t getAcceptCount(uint32_t worker) const override final
+	{
+		return worker < mWorkers.size() ? mWorkers[worker]->mAcceptCount.load(std::memory_order_relaxed) : 0;
+	}
+
+	virtual uint64_t getShedCount(uint32_t worker) const override final
+	{
+		return worker < mWorkers.size() ? mWorkers[worker]->mShedCount.load(std::memory_order_relaxed) : 0;
+	}
+
+	virtual uint64_t getStealCount(uint32_t worker) const override final
+	{
+		return worker < mWorkers.size() ? mWorkers[worker]->mStealCount.load(std::memory_order_relaxed) : 0;
+	}
+
+	virtual void broadcast(const void *data, uint32_t dataLen, bool isAscii) override final
+	{
+		publish("", data, dataLen, isAscii);
+	}
+
+	virtual void publish(const char *topic, const void *data, uint32_t dataLen, bool isAscii) override final
+	{
+		easywsclient::PreparedFrame *frame = easywsclient::PreparedFrame::create(data, dataLen, isAscii, true);
+		for (auto &i : mWorkers)
+		{
+			i->post(frame, topic);
+		}
+		frame->release();
+	}
+
+	virtual bool subscribe(uint32_t worker, easywsclient::WebSocket *connection, const char *topic) override final
+	{
+		return worker < mWorkers.size() && *topic ? mWorkers[worker]->mHub->subscribe(connection, topic) : false;
+	}
+
+	virtual bool unsubscribe(uint32_t worker, easywsclient::WebSocket *connection, const char *topic) override final
+	{
+		return worker < mWorkers.size() ? mWorkers[worker]->mHub->unsubscribe(connection, topic) : false;
+	}
+
+	virtual uint32_t drain(uint32_t timeoutMilliseconds) override final
+	{
+		for (auto &i : mWorkers)
+		{
+			i->mDrainMilliseconds.store(timeoutMilliseconds, std::memory_order_relaxed);
+			i->mDraining.store(true, std::memory_order_release);
+		}
+		// A worker can't drain while it is in one of its callbacks, so from there we can't wait for it
+		for (auto &i : mWorkers)
+		{
+			if (i->isWorkerThread())
+			{
+				return 0;
+			}
+		}
+		// Every worker closes its own connections at the same time; wait for the slowest
+		uint32_t dropped = 0;
+		for (auto &i : mWorkers)
+		{
+			while (!i->mDrained.load(std::memory_order_acquire))
+			{
+				wplatform::sleepNano(IDLE_SLEEP_NANO);
+			}
+			dropped += i->mDrainDropped.load(std::memory_order_relaxed);
+		}
+		return dropped;
+	}
+
+	virtual void release(void) override final
+	{
+		delete this;
+	}
+
+	WorkerVector	mWorkers;
+};
+
+ShardedServer *ShardedServer::create(int32_t port, uint32_t workerCount, ShardedServerCallback *callback, const wsocket::SocketOptions *options, const easywsclient::Timeouts *timeouts)
+{
+	auto ret = new ShardedServerImpl(port, workerCount, callback, options, timeouts);
+	if (!ret->isValid())
+	{
+		delete ret;
+		ret = nullptr;
+	}
+	return static_cast<ShardedServer *>(ret);
+}
+
+}
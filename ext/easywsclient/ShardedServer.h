@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdint.h>
+
+// A websocket server which spreads its connections across several worker threads.
+// Each worker opens its own SO_REUSEPORT listener on the same port and runs its own
+// accept, handshake and message loop, so the kernel balances new connections across cores
+// and a burst of reconnects is not serialized behind a single accepting thread.
+// Where SO_REUSEPORT isn't available the first worker accepts and hands connections to the others.
+// Accepted connections wait in their worker's backlog until it starts their handshake; a worker with
+// nothing to do steals half of the longest backlog, so a burst landing on one core is shared out.
+// Broadcasts and topic publishes may come from any thread: each is encoded once and posted to every
+// worker through a lock-free queue, and each worker queues it on its own connections.
+
+namespace easywsclient
+{
+class WebSocket;
+struct Timeouts;
+}
+
+namespace wsocket
+{
+struct SocketOptions;
+}
+
+namespace shardedserver
+{
+
+// All callbacks for a connection are made on the worker thread which owns it, so state kept
+// per connection or per worker needs no locking. Callbacks from different workers run concurrently.
+class ShardedServerCallback
+{
+public:
+	// A new client connection was accepted by this worker
+	virtual void onConnect(uint32_t worker, easywsclient::WebSocket *connection) = 0;
+
+	// A message was received on one of this worker's connections
+	virtual void onMessage(uint32_t worker, easywsclient::WebSocket *connection, const void *data, uint32_t dataLen, bool isAscii) = 0;
+
+	// The connection was closed; it is deleted as soon as this returns
+	virtual void onDisconnect(uint32_t worker, easywsclient::WebSocket *connection) = 0;
+
+	// The connection stopped answering pings (see easywsclient::Timeouts) and was dropped; onDisconnect follows
+	virtual void onStalePeer(uint32_t worker, easywsclient::WebSocket *connection)
+	{
+	}
+};
+
+class ShardedServer
+{
+public:
+	// Starts 'workerCount' workers listening on this port; zero means one per hardware thread.
+	// 'options' is optional; mReusePort is always turned on for the listeners.
+	// mAcceptBatchSize and mMaxPendingHandshakes apply to each worker separately.
+	// 'timeouts' is optional; each worker keeps its connections' timeouts on one TimerWheel of its own.
+	// Returns null if no listener could be created.
+	static ShardedServer *create(int32_t port, uint32_t workerCount, ShardedServerCallback *callback, const wsocket::SocketOptions *options=nullptr, const easywsclient::Timeouts *timeouts=nullptr);
+
+	// Number of worker threads
+	virtual uint32_t getWorkerCount(void) const = 0;
+
+	// Number of open connections currently owned by this worker
+	virtual uint32_t getConnectionCount(uint32_t worker) const = 0;
+
+	// Total number of connections this worker has accepted since it started
+	virtual uint64_t getAcceptCount(uint32_t worker) const = 0;
+
+	// Number of connections this worker refused because too many handshakes were pending
+	virtual uint64_t getShedCount(uint32_t worker) const = 0;
+
+	// Number of connections this worker took from another worker's backlog
+	virtual uint64_t getStealCount(uint32_t worker) const = 0;
+
+	// Sends a message to every connection on every worker. Thread safe; may be called from callbacks.
+	virtual void broadcast(const void *data, uint32_t dataLen, bool isAscii) = 0;
+
+	// Sends a message to every connection subscribed to this topic, on every worker. Thread safe.
+	virtual void publish(const char *topic, const void *data, uint32_t dataLen, bool isAscii) = 0;
+
+	// Subscribes a connection to a topic. Only call this from the callbacks of the connection's own worker.
+	virtual bool subscribe(uint32_t worker, easywsclient::WebSocket *connection, const char *topic) = 0;
+	virtual bool unsubscribe(uint32_t worker, easywsclient::WebSocket *connection, const char *topic) = 0;
+
+	// Closes every connection on every worker at once and waits for them to finish, but for no longer
+	// than 'timeoutMilliseconds'; connections still closing then are dropped. The listeners are closed,
+	// so no connection is accepted afterwards; this is the first step of shutting down.
+	// Returns the number of connections dropped. Called from a callback it only starts the drain and
+	// returns zero at once, since the calling worker can't drain until the callback returns.
+	virtual uint32_t drain(uint32_t timeoutMilliseconds) = 0;
+
+	// Stops the workers and closes every connection
+	virtual void release(void) = 0;
+protected:
+	virtual ~ShardedServer(void)
+	{
+	}
+};
+
+}
@@ -1,4 +1,5 @@
 #include "SimpleBuffer.h"
+#include "RelaxedAtomic.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -58,6 +59,7 @@ namespace simplebuffer
 					memcpy(&mBuffer[mEndLoc], data, dataLen);
 				}
 				mEndLoc += dataLen;
+                mPeakSize.raise(mEndLoc - mStartLoc);
                 ret = true;
 			}
             return ret;
@@ -109,6 +111,7 @@ namespace simplebuffer
                 }
                 mStartLoc = 0;              // Reset the current read location to zero
                 mEndLoc = keepSize;         // The current end location is the active buffer size
+                mCompactCount++;
                 ret = true;                 // Return true that we grew enough to accommodate the request
             }
             else
@@ -138,6 +141,7 @@ namespace simplebuffer
                     mBuffer = newBuffer;    // This is the new active buffer
                     mStartLoc = 0;
                     mEndLoc = bufferSize;
+                    mGrowCount++;
                 }
             }
             return ret;
@@ -184,6 +188,11 @@ namespace simplebuffer
 			return mMaxLen;
 		}
 
+		virtual uint32_t getAvailable(void) const override final
+		{
+			return mMaxLen - mEndLoc;
+		}
+
         // Shrinks the current buffer back down to the default size, or current size whichever is greater
         virtual uint32_t shrinkBuffer(void) override final
         {
@@ -209,6 +218,21 @@ namespace simplebuffer
             return mMaxGrowSize;
         }
 
+        virtual uint32_t getPeakSize(void) const override final
+        {
+            return mPeakSize;
+        }
+
+        virtual uint64_t getGrowCount(void) const override final
+        {
+            return mGrowCount;
+        }
+
+        virtual uint64_t getCompactCount(void) const override final
+        {
+            return mCompactCount;
+        }
+
 	private:
 		uint8_t		*mBuffer{ nullptr };
         uint32_t     mStartLoc{ 0 };        // Current start location of the buffer
@@ -216,6 +240,9 @@ namespace simplebuffer
 		uint32_t	mMaxLen{ 0 };           // Maximum size of the buffer
         uint32_t    mMaxGrowSize{ (1024 * 1024) * 64 }; // default maximum grow size is 64mb
         uint32_t    mDefaultSize{ 1024 };
+        relaxedatomic::RelaxedAtomic< uint32_t > mPeakSize;      // Statistics, readable from other threads
+        relaxedatomic::RelaxedAtomic< uint64_t > mGrowCount;
+        relaxedatomic::RelaxedAtomic< uint64_t > mCompactCount;
 	};
 
 SimpleBuffer *SimpleBuffer::create(uint32_t defaultSize,uint32_t maxGrowSize)
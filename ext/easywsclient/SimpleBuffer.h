@@ -40,6 +40,17 @@ public:
 	// Make sure the buffer is large enough for this capacity; return the *current* read location in the buffer
 	virtual	uint8_t	*confirmCapacity(uint32_t capacity) = 0;
 
+	// How many bytes can be written at the location returned by 'confirmCapacity' without growing the buffer
+	virtual uint32_t getAvailable(void) const = 0;
+
+	// Most bytes the buffer has held at once
+	virtual uint32_t getPeakSize(void) const = 0;
+
+	// Times the buffer reallocated to make room, and times it moved its contents to the front instead.
+	// These and 'getPeakSize' may be read from any thread while another adds data.
+	virtual uint64_t getGrowCount(void) const = 0;
+	virtual uint64_t getCompactCount(void) const = 0;
+
 	// Note, the reset command does not retain the previous data buffer!
 	virtual void		reset(uint32_t defaultSize) = 0;
 
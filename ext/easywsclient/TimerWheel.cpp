@@ -0,0 +1,243 @@
+#include "TimerWheel.h"
+#include <vector>
+#include <chrono>
+
+#ifdef _MSC_VER
+#pragma warning(disable:4100)
+#endif
+
+#define LEVEL_BITS 6
+#define LEVEL_SLOTS (1 << LEVEL_BITS)
+#define LEVEL_MASK (LEVEL_SLOTS - 1)
+#define LEVEL_COUNT 4
+#define MAX_TICKS ((uint64_t(1) << (LEVEL_BITS * LEVEL_COUNT)) - 1)
+#define FIRE_LIST (LEVEL_SLOTS * LEVEL_COUNT)	// Head of the list of timers being fired this tick
+#define HEAD_COUNT (FIRE_LIST + 1)
+#define NO_NODE 0xFFFFFFFF
+
+namespace timerwheel
+{
+
+// A timer, or the head of a slot's list. Nodes live in one array and link to each other by
+// index, so the array can grow while a callback is scheduling more timers.
+struct Node
+{
+	uint32_t			mNext{ 0 };
+	uint32_t			mPrev{ 0 };
+	uint64_t			mExpires{ 0 };			// Tick on which the timer fires
+	uint32_t			mGeneration{ 1 };		// Bumped when the node is freed, so stale handles miss
+	uint32_t			mId{ 0 };
+	TimerWheelCallback	*mCallback{ nullptr };	// Null while the node is free
+};
+
+typedef std::vector< Node > NodeVector;
+
+class TimerWheelImpl : public TimerWheel
+{
+public:
+	TimerWheelImpl(uint32_t tickMilliseconds) : mTickMilliseconds(tickMilliseconds ? tickMilliseconds : 1)
+	{
+		mNodes.resize(HEAD_COUNT);
+		for (uint32_t i = 0; i < HEAD_COUNT; i++)
+		{
+			mNodes[i].mNext = i;
+			mNodes[i].mPrev = i;
+		}
+		mStart = std::chrono::steady_clock::now();
+	}
+
+	virtual ~TimerWheelImpl(void)
+	{
+	}
+
+	virtual uint64_t schedule(uint32_t delayMilliseconds, TimerWheelCallback *callback, uint32_t id) override final
+	{
+		uint32_t index = mFree;
+		if (index == NO_NODE)
+		{
+			index = uint32_t(mNodes.size());
+			mNodes.push_back(Node());
+		}
+		else
+		{
+			mFree = mNodes[index].mNext;
+		}
+		Node &n = mNodes[index];
+		n.mCallback = callback;
+		n.mId = id;
+		// Measured from the clock rather than the last update, which may have been a while ago
+		n.mExpires = (readClock() + delayMilliseconds + mTickMilliseconds - 1) / mTickMilliseconds;
+		addTimer(index);
+		mTimerCount++;
+		return (uint64_t(n.mGeneration) << 32) | index;
+	}
+
+	virtual bool cancel(uint64_t timer) override final
+	{
+		uint32_t index = uint32_t(timer);
+		if (index < HEAD_COUNT || index >= mNodes.size())
+		{
+			return false;
+		}
+		Node &n = mNodes[index];
+		if (n.mGeneration != uint32_t(timer >> 32) || !n.mCallback)
+		{
+			return false;
+		}
+		unlink(index);
+		freeNode(index);
+		return true;
+	}
+
+	virtual uint32_t update(void) override final
+	{
+		mMilliseconds = readClock();
+		uint64_t target = mMilliseconds / mTickMilliseconds;
+		uint32_t fired = 0;
+		while (mNow < target)
+		{
+			if (!mTimerCount)
+			{
+				mNow = target; // nothing is waiting, so the slots we skip are all empty
+				break;
+			}
+			fired += tick();
+		}
+		return fired;
+	}
+
+	virtual uint64_t getMilliseconds(void) const override final
+	{
+		return mMilliseconds;
+	}
+
+	virtual uint32_t getTimerCount(void) const override final
+	{
+		return mTimerCount;
+	}
+
+	virtual void release(void) override final
+	{
+		delete this;
+	}
+
+private:
+	uint64_t readClock(void) const
+	{
+		auto now = std::chrono::steady_clock::now();
+		return uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(now - mStart).count());
+	}
+
+	// Puts a timer in the slot of the lowest level whose span covers the time left until it is due
+	void addTimer(uint32_t index)
+	{
+		Node &n = mNodes[index];
+		if (n.mExpires < mNow)
+		{
+			n.mExpires = mNow; // already late; fire on the next tick
+		}
+		if (n.mExpires - mNow > MAX_TICKS)
+		{
+			n.mExpires = mNow + MAX_TICKS;
+		}
+		uint64_t delta = n.mExpires - mNow;
+		uint32_t level = 0;
+		while (level + 1 < LEVEL_COUNT && delta >= (uint64_t(1) << (LEVEL_BITS * (level + 1))))
+		{
+			level++;
+		}
+		uint32_t slot = uint32_t(n.mExpires >> (LEVEL_BITS * level)) & LEVEL_MASK;
+		link(index, level * LEVEL_SLOTS + slot);
+	}
+
+	// Spreads one slot of a higher level over the levels below it; returns the slot's index
+	uint32_t cascade(uint32_t level)
+	{
+		uint32_t slot = uint32_t(mNow >> (LEVEL_BITS * level)) & LEVEL_MASK;
+		uint32_t head = level * LEVEL_SLOTS + slot;
+		while (mNodes[head].mNext != head)
+		{
+			uint32_t index = mNodes[head].mNext;
+			unlink(index);
+			addTimer(index);
+		}
+		return slot;
+	}
+
+	// Fires every timer due on the current tick and moves to the next one
+	uint32_t tick(void)
+	{
+		uint32_t slot = uint32_t(mNow) & LEVEL_MASK;
+		if (!slot && !cascade(1) && !cascade(2))
+		{
+			cascade(3);
+		}
+		mNow++;
+		// Move the slot aside first, so a callback scheduling a timer for this slot doesn't run it now
+		uint32_t head = slot;
+		while (mNodes[head].mNext != head)
+		{
+			uint32_t index = mNodes[head].mNext;
+			unlink(index);
+			link(index, FIRE_LIST);
+		}
+		uint32_t fired = 0;
+		while (mNodes[FIRE_LIST].mNext != FIRE_LIST)
+		{
+			uint32_t index = mNodes[FIRE_LIST].mNext;
+			TimerWheelCallback *callback = mNodes[index].mCallback;
+			uint32_t id = mNodes[index].mId;
+			unlink(index);
+			freeNode(index);
+			callback->onTimer(id);
+			fired++;
+		}
+		return fired;
+	}
+
+	void link(uint32_t index, uint32_t head)
+	{
+		uint32_t tail = mNodes[head].mPrev;
+		mNodes[index].mPrev = tail;
+		mNodes[index].mNext = head;
+		mNodes[tail].mNext = index;
+		mNodes[head].mPrev = index;
+	}
+
+	void unlink(uint32_t index)
+	{
+		Node &n = mNodes[index];
+		mNodes[n.mPrev].mNext = n.mNext;
+		mNodes[n.mNext].mPrev = n.mPrev;
+	}
+
+	void freeNode(uint32_t index)
+	{
+		Node &n = mNodes[index];
+		n.mCallback = nullptr;
+		n.mGeneration++;
+		if (!n.mGeneration)
+		{
+			n.mGeneration = 1; // keep handles non-zero
+		}
+		n.mNext = mFree;
+		mFree = index;
+		mTimerCount--;
+	}
+
+	uint32_t			mTickMilliseconds{ 1 };
+	uint64_t			mNow{ 0 };				// The next tick to fire
+	uint64_t			mMilliseconds{ 0 };		// Clock as of the last update
+	uint32_t			mTimerCount{ 0 };
+	uint32_t			mFree{ NO_NODE };		// Free nodes, linked through mNext
+	NodeVector			mNodes;					// Slot heads first, then timers
+	std::chrono::steady_clock::time_point	mStart;
+};
+
+TimerWheel *TimerWheel::create(uint32_t tickMilliseconds)
+{
+	auto ret = new TimerWheelImpl(tickMilliseconds);
+	return static_cast<TimerWheel *>(ret);
+}
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+// A hierarchical timing wheel for the timeouts of many connections on one thread.
+// Four levels of 64 slots each; a timer goes into the level whose span covers its delay, and a
+// level's slot is spread over the level below when the wheel reaches it. Scheduling, cancelling
+// and firing are all O(1), however many timers there are.
+// Time only moves forward when 'update' is called, usually once per pass of the polling loop.
+// A wheel is not thread safe; use it from the thread which polls its connections.
+
+namespace timerwheel
+{
+
+class TimerWheelCallback
+{
+public:
+	// 'id' is the value given to 'schedule'. The timer is already gone, so it may be scheduled again from here.
+	virtual void onTimer(uint32_t id) = 0;
+};
+
+class TimerWheel
+{
+public:
+	// Every delay is rounded up to a whole number of ticks.
+	// Delays longer than 64^4 ticks (4.6 hours with 1ms ticks) are clamped to that.
+	static TimerWheel *create(uint32_t tickMilliseconds = 1);
+
+	// Calls 'callback->onTimer(id)' once, no sooner than 'delayMilliseconds' from now.
+	// Returns a handle for 'cancel'; never zero.
+	virtual uint64_t schedule(uint32_t delayMilliseconds, TimerWheelCallback *callback, uint32_t id) = 0;
+
+	// Returns false if the timer already fired or was cancelled; old handles are never reused
+	virtual bool cancel(uint64_t timer) = 0;
+
+	// Reads the clock and fires every timer which has come due. Returns the number fired.
+	virtual uint32_t update(void) = 0;
+
+	// Milliseconds since the wheel was created, as of the last 'update'
+	virtual uint64_t getMilliseconds(void) const = 0;
+
+	// Number of timers waiting to fire
+	virtual uint32_t getTimerCount(void) const = 0;
+
+	virtual void release(void) = 0;
+protected:
+	virtual ~TimerWheel(void)
+	{
+	}
+};
+
+}
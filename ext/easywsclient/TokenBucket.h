@@ -0,0 +1,68 @@
+#pragma  once
+
+#include <stdint.h>
+#include <chrono>
+
+namespace tokenbucket
+{
+
+// Allows 'rate' units per second on average, with up to 'burst' units saved up while idle.
+// Tokens are added lazily from the elapsed time whenever the bucket is looked at.
+class TokenBucket
+{
+public:
+	// A rate of zero means unlimited
+	void setRate(uint32_t rate, uint32_t burstMilliseconds)
+	{
+		mRate = rate;
+		mBurst = uint64_t(rate) * burstMilliseconds / 1000;
+		if (mBurst < 1)
+		{
+			mBurst = 1;
+		}
+		mTokens = mBurst;
+		mLast = std::chrono::steady_clock::now();
+	}
+
+	bool isLimited(void) const
+	{
+		return mRate != 0;
+	}
+
+	// Tokens which may be spent right now
+	uint64_t getAvailable(void)
+	{
+		if (!mRate)
+		{
+			return UINT64_MAX;
+		}
+		auto now = std::chrono::steady_clock::now();
+		uint64_t elapsed = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(now - mLast).count());
+		uint64_t add = elapsed * mRate / 1000000;
+		if (add)
+		{
+			// Only move the clock forward by the time those tokens took, so fractions aren't lost
+			mTokens += add;
+			mLast += std::chrono::microseconds(add * 1000000 / mRate);
+		}
+		if (mTokens >= mBurst)
+		{
+			mTokens = mBurst;
+			mLast = now;
+		}
+		return mTokens;
+	}
+
+	void consume(uint64_t count)
+	{
+		mTokens = count < mTokens ? mTokens - count : 0;
+	}
+
+private:
+	uint32_t	mRate{ 0 };			// Tokens added per second
+	uint64_t	mBurst{ 0 };		// Most tokens the bucket holds
+	uint64_t	mTokens{ 0 };
+	std::chrono::steady_clock::time_point	mLast;	// When tokens were last added
+};
+
+}
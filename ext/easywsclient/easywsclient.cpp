@@ -9,6 +9,16 @@
 #include "SimpleBuffer.h"
 #include "FastXOR.h"
 #include "Timer.h"
+#include "TokenBucket.h"
+#include "TimerWheel.h"
+#include "LatencyHistogram.h"
+#include "RelaxedAtomic.h"
+#include <deque>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <chrono>
 
 #define USE_PROXY_SERVER 0
 
@@ -22,11 +32,29 @@
 
 #define DEFAULT_TRANSMIT_BUFFER_SIZE (1024*16)	// Default transmit buffer size is 16k
 #define DEFAULT_RECEIVE_BUFFER_SIZE (1024*16)	// Default transmit buffer size is 16k
-#define DEFAULT_MAX_READ_SIZE (1024*4)			// Maximum size of a single read operation
+#define DEFAULT_MAX_READ_SIZE (1024*4)			// Space reserved for each read while a connection is quiet
+#define MAXIMUM_READ_SIZE (1024*256)			// Most space reserved for a single read once a connection is busy
 #define DEFAULT_MAXIMUM_BUFFER_SIZE (1024*1024)*512  // Don't ever cache more than 64 mb of data (for the moment...)
 
+#define MAX_SEND_BUFFERS 64					// Most buffers gathered into one send
+
 #define CONNECTION_TIME_OUT 60	// wait no more than this number of seconds for connection to complete
 
+#define PING_TAG "wsrt"			// Marks the payload of our own pings: this tag, then the time sent in microseconds
+#define PING_TAG_SIZE 4
+#define PING_PAYLOAD_SIZE (PING_TAG_SIZE + 8)
+
+// The timers each connection may have running on its TimerWheel
+enum TimerId : uint32_t
+{
+	HANDSHAKE_TIMER,
+	PING_TIMER,
+	PONG_TIMER,
+	IDLE_TIMER,
+	CLOSE_TIMER,
+	TIMER_COUNT
+};
+
 
 #define USE_LOGGING 1
 
@@ -35,6 +63,7 @@ namespace easywsclient
 
 	enum class ConnectionPhase :uint32_t 
 	{
+		SOCKET_CONNECT	= 0,			// Client waiting for the socket to resolve the host and connect
 		// These are the responses we expect from the server
 		HTTP_STATUS		= 1,			// "HTTP/1.1 101 Switching Protocols"
 		HCONNECTION_UPGRADE,			// "HConnection: upgrade"
@@ -45,7 +74,122 @@ namespace easywsclient
 		SERVER_CLIENT_STRINGS,			// Server just parsing incoming strings from the client connection
 	};
 
-	class WebSocketImpl : public easywsclient::WebSocket
+	typedef relaxedatomic::RelaxedAtomic< uint64_t > Counter;
+
+	// WebSocketStats as a connection keeps them. Only the polling thread writes them, and getStats
+	// copies them out from any thread; see RelaxedAtomic.h
+	struct ConnectionStats
+	{
+		Counter		mReceiveCalls;
+		Counter		mReceiveWouldBlock;
+		Counter		mReceiveBytes;
+		Counter		mReceiveAvailableCalls;
+		Counter		mSendCalls;
+		Counter		mSendWouldBlock;
+		Counter		mSendBytes;
+		Counter		mSendPartial;
+		Counter		mConflatedMessages;
+		Counter		mSendThrottled;
+		Counter		mReceiveThrottled;
+		Counter		mPollBudgetExhausted;
+		Counter		mTimeouts;
+		Counter		mFramesIn[STAT_FRAME_TYPES];
+		Counter		mPayloadBytesIn[STAT_FRAME_TYPES];
+		Counter		mFramesOut[STAT_FRAME_TYPES];
+		Counter		mPayloadBytesOut[STAT_FRAME_TYPES];
+		relaxedatomic::RelaxedAtomic< bool >		mTls;			// Noted when the connection opens, after the TLS handshake
+		relaxedatomic::RelaxedAtomic< bool >		mKernelTlsSend;
+		relaxedatomic::RelaxedAtomic< bool >		mKernelTlsReceive;
+	};
+
+	// A prepared frame queued on a connection, behind any frames which were copied into the transmit buffer first
+	struct QueuedFrame
+	{
+		uint32_t		mBufferBytes{ 0 };	// Bytes of the transmit buffer which go out before this frame
+		PreparedFrame	*mFrame{ nullptr };
+	};
+
+	typedef std::deque< QueuedFrame > QueuedFrameQueue;
+
+	// The latest unsent message for one key; see sendConflated
+	struct ConflatedMessage
+	{
+		uint64_t				mKey{ 0 };
+		std::vector< uint8_t >	mData;
+		bool					mAscii{ false };
+	};
+
+	typedef std::vector< ConflatedMessage > ConflatedMessageVector;
+	typedef std::unordered_map< uint64_t, uint32_t > ConflatedIndexMap;
+
+	// The token buckets behind a RateLimit
+	enum RateBucket
+	{
+		SEND_BYTES,
+		SEND_MESSAGES,
+		RECEIVE_BYTES,
+		RECEIVE_MESSAGES,
+		RATE_BUCKET_COUNT
+	};
+
+	struct RateLimiter
+	{
+		void set(const RateLimit &limit)
+		{
+			mBuckets[SEND_BYTES].setRate(limit.mSendBytesPerSecond, limit.mBurstMilliseconds);
+			mBuckets[SEND_MESSAGES].setRate(limit.mSendMessagesPerSecond, limit.mBurstMilliseconds);
+			mBuckets[RECEIVE_BYTES].setRate(limit.mReceiveBytesPerSecond, limit.mBurstMilliseconds);
+			mBuckets[RECEIVE_MESSAGES].setRate(limit.mReceiveMessagesPerSecond, limit.mBurstMilliseconds);
+		}
+
+		tokenbucket::TokenBucket	mBuckets[RATE_BUCKET_COUNT];
+	};
+
+	class RateLimitGroupImpl : public RateLimitGroup
+	{
+	public:
+		RateLimitGroupImpl(const RateLimit &limit)
+		{
+			mLimiter.set(limit);
+		}
+
+		virtual void addRef(void) override final
+		{
+			mRefCount.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		virtual void release(void) override final
+		{
+			if (mRefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				delete this;
+			}
+		}
+
+		// The rates never change after creation, so this needs no lock
+		bool isLimited(uint32_t bucket) const
+		{
+			return mLimiter.mBuckets[bucket].isLimited();
+		}
+
+		uint64_t getAvailable(uint32_t bucket)
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			return mLimiter.mBuckets[bucket].getAvailable();
+		}
+
+		void consume(uint32_t bucket, uint64_t count)
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mLimiter.mBuckets[bucket].consume(count);
+		}
+
+		std::atomic<uint32_t>	mRefCount{ 1 };
+		std::mutex				mMutex;
+		RateLimiter				mLimiter;
+	};
+
+	class WebSocketImpl : public easywsclient::WebSocket, public timerwheel::TimerWheelCallback
 #if USE_PROXY_SERVER
 		, public apiserver::ApiServer::Callback
 #endif
@@ -94,14 +238,16 @@ namespace easywsclient
 		{
 			mIsServerClient = true;	// we are a server connection to a client
 			mSocket = clientSocket;
+			mMessageBased = clientSocket ? clientSocket->isMessageBased() : false;
 			mUseMask = useMask;
 			mTransmitBuffer = simplebuffer::SimpleBuffer::create(DEFAULT_TRANSMIT_BUFFER_SIZE, DEFAULT_MAXIMUM_BUFFER_SIZE);
 			mReceivedData = simplebuffer::SimpleBuffer::create(DEFAULT_RECEIVE_BUFFER_SIZE, DEFAULT_MAXIMUM_BUFFER_SIZE);
 			mReceiveBuffer = simplebuffer::SimpleBuffer::create(DEFAULT_RECEIVE_BUFFER_SIZE, DEFAULT_MAXIMUM_BUFFER_SIZE);
 			mReadyState = CONNECTING;
+			mConnectionPhase = ConnectionPhase::SOCKET_CONNECT; // TLS connections finish their own handshake first
 		}
 
-		WebSocketImpl(const char *url,const char *origin, bool useMask) : mReadyState(OPEN), mUseMask(useMask)
+		WebSocketImpl(const char *url,const char *origin, bool useMask, const wsocket::SocketOptions *options) : mReadyState(OPEN), mUseMask(useMask)
 		{
 #if USE_PROXY_SERVER
             if (strcmp(url, "apiserver") == 0)
@@ -130,20 +276,37 @@ namespace easywsclient
                 }
                 else
                 {
-                    if (sscanf(url, "ws://%[^:/]:%d/%s", host, &port, path) == 3)
+                    bool isUnix = false;
+                    // wss:// is the same as ws:// over a TLS socket
+                    bool isSecure = strncmp(url, "wss://", 6) == 0;
+                    int defaultPort = isSecure ? 443 : 80;
+                    const char *address = isSecure ? url + 6 : (strncmp(url, "ws://", 5) == 0 ? url + 5 : nullptr);
+                    if (strncmp(url, "ws+unix://", 10) == 0)
+                    {
+                        // ws+unix:///path/to/socket connects to a Unix domain socket on this host
+                        wplatform::stringFormat(host, 128, "%s%s", UNIX_SOCKET_PREFIX, url + 10);
+                        port = 80;
+                        path[0] = '\0';
+                        isUnix = true;
+                    }
+                    else if (address == nullptr)
                     {
+                        fprintf(stderr, "ERROR: Could not parse WebSocket url: %s\n", url);
                     }
-                    else if (sscanf(url, "ws://%[^:/]/%s", host, path) == 2)
+                    else if (sscanf(address, "%[^:/]:%d/%s", host, &port, path) == 3)
                     {
-                        port = 80;
                     }
-                    else if (sscanf(url, "ws://%[^:/]:%d", host, &port) == 2)
+                    else if (sscanf(address, "%[^:/]/%s", host, path) == 2)
+                    {
+                        port = defaultPort;
+                    }
+                    else if (sscanf(address, "%[^:/]:%d", host, &port) == 2)
                     {
                         path[0] = '\0';
                     }
-                    else if (sscanf(url, "ws://%[^:/]", host) == 1)
+                    else if (sscanf(address, "%[^:/]", host) == 1)
                     {
-                        port = 80;
+                        port = defaultPort;
                         path[0] = '\0';
                     }
                     else
@@ -156,7 +319,16 @@ namespace easywsclient
 #ifdef TEST_PLAYBACK
                         mSocket = wsocket::Wsocket::create(TEST_PLAYBACK);
 #else
-                        mSocket = wsocket::Wsocket::create(host, port);
+                        if (isSecure)
+                        {
+                            char tlsHost[256];
+                            wplatform::stringFormat(tlsHost, sizeof(tlsHost), "%s%s", TLS_SOCKET_PREFIX, host);
+                            mSocket = wsocket::Wsocket::create(tlsHost, port, options);
+                        }
+                        else
+                        {
+                            mSocket = wsocket::Wsocket::create(host, port, options);
+                        }
 #endif
                         if (mSocket == nullptr)
                         {
@@ -165,37 +337,44 @@ namespace easywsclient
 						else
 						{
 							mReadyState = ReadyStateValues::CONNECTING;
-							// XXX: this should be done non-blocking,
+							mMessageBased = mSocket->isMessageBased();
+							// The socket may still be resolving or connecting, so the request is held until it connects
+							mConnectionPhase = ConnectionPhase::SOCKET_CONNECT;
+							mHandshakeBuffer = simplebuffer::SimpleBuffer::create(1024, DEFAULT_MAXIMUM_BUFFER_SIZE);
 							char line[256];
 							wplatform::stringFormat(line, 256, "GET /%s HTTP/1.1\r\n", path);
-							mSocket->send(line, uint32_t(strlen(line)));
-							if (port == 80)
+							mHandshakeBuffer->addBuffer(line, uint32_t(strlen(line)));
+							if (isUnix)
+							{
+								wplatform::stringFormat(line, 256, "Host: localhost\r\n");
+								mHandshakeBuffer->addBuffer(line, uint32_t(strlen(line)));
+							}
+							else if (port == defaultPort)
 							{
 								wplatform::stringFormat(line, 256, "Host: %s\r\n", host);
-								mSocket->send(line, uint32_t(strlen(line)));
+								mHandshakeBuffer->addBuffer(line, uint32_t(strlen(line)));
 							}
 							else
 							{
 								wplatform::stringFormat(line, 256, "Host: %s:%d\r\n", host, port);
-								mSocket->send(line, uint32_t(strlen(line)));
+								mHandshakeBuffer->addBuffer(line, uint32_t(strlen(line)));
 							}
 							wplatform::stringFormat(line, 256, "Upgrade: websocket\r\n");
-							mSocket->send(line, uint32_t(strlen(line)));
+							mHandshakeBuffer->addBuffer(line, uint32_t(strlen(line)));
 							wplatform::stringFormat(line, 256, "Connection: Upgrade\r\n");
-							mSocket->send(line, uint32_t(strlen(line)));
+							mHandshakeBuffer->addBuffer(line, uint32_t(strlen(line)));
 							if (originSize)
 							{
 								wplatform::stringFormat(line, 256, "Origin: %s\r\n", origin);
-								mSocket->send(line, uint32_t(strlen(line)));
+								mHandshakeBuffer->addBuffer(line, uint32_t(strlen(line)));
 							}
 							wplatform::stringFormat(line, 256, "Sec-WebSocket-Key: x3JJHMbDL1EzLkh9GBhXDw==\r\n");
-							mSocket->send(line, uint32_t(strlen(line)));
+							mHandshakeBuffer->addBuffer(line, uint32_t(strlen(line)));
 							wplatform::stringFormat(line, 256, "Sec-WebSocket-Version: 13\r\n");
-							mSocket->send(line, uint32_t(strlen(line)));
+							mHandshakeBuffer->addBuffer(line, uint32_t(strlen(line)));
 							wplatform::stringFormat(line, 256, "\r\n");
-							mSocket->send(line, uint32_t(strlen(line)));
+							mHandshakeBuffer->addBuffer(line, uint32_t(strlen(line)));
 							mConnectionTimer.getElapsedSeconds();
-							// Ok...send all of the connection strings
 						}
                     }
                 }
@@ -204,16 +383,13 @@ namespace easywsclient
 
 		virtual ~WebSocketImpl(void)
 		{
+			// Never wait on the peer here: one pass writes whatever of the close frame, and anything queued
+			// ahead of it, the socket will take right now. Hand the connection to a ClosingSet instead of
+			// deleting it to give it time to finish.
 			close();
-			timer::Timer t;
-			#define CLOSE_TIMEOUT 1		// if we don't receive a response to our close command in this time, go ahead and exit
-			while (mReadyState != CLOSED)
+			if (mSocket && mReadyState != CLOSED)
 			{
-				poll(nullptr, 1);
-				if (t.getElapsedSeconds() >= CLOSE_TIMEOUT)
-				{
-					break;
-				}
+				poll(nullptr, 0);
 			}
 			if (mSocket)
 			{
@@ -231,6 +407,25 @@ namespace easywsclient
 			{
 				mTransmitBuffer->release();
 			}
+			if (mHandshakeBuffer)
+			{
+				mHandshakeBuffer->release();
+			}
+			for (auto &i : mFrameQueue)
+			{
+				i.mFrame->release();
+			}
+			if (mRateGroup)
+			{
+				mRateGroup->release();
+			}
+			cancelTimers();
+			if (mOwnTimerWheel)
+			{
+				mTimerWheel->release();
+			}
+			delete mLatency.load(std::memory_order_relaxed);
+			delete mDispatchTime.load(std::memory_order_relaxed);
 #if USE_LOGGING
             if (mLogFile)
             {
@@ -257,9 +452,44 @@ namespace easywsclient
 #endif
             if (!mSocket) return;
 
+			if (mOwnTimerWheel)
+			{
+				mTimerWheel->update();
+				if (!mSocket) return; // the handshake timed out
+			}
+			if (mStalePeer && callback)
+			{
+				mStalePeer = false;
+				callback->onStalePeer();
+			}
+			mPendingWork = false;
 			if (mReadyState == CONNECTING)
 			{
-				processConnection();
+				if (mConnectionPhase == ConnectionPhase::SOCKET_CONNECT && !completeConnect())
+				{
+					return;
+				}
+				if (!sendHandshake())
+				{
+					return;
+				}
+				// Consume as much of the handshake as has arrived, rather than a byte per poll
+				while (mReadyState == CONNECTING && processConnection())
+				{
+				}
+				if (mReadyState == OPEN)
+				{
+					// Any TLS handshake finished before the upgrade, so how the connection is encrypted is settled
+					bool kernelSend;
+					bool kernelReceive;
+					mStats.mTls = mSocket->isTls(kernelSend, kernelReceive);
+					mStats.mKernelTlsSend = kernelSend;
+					mStats.mKernelTlsReceive = kernelReceive;
+					if (mTimerWheel)
+					{
+						armTimers();
+					}
+				}
 				return;
 			}
 
@@ -271,25 +501,68 @@ namespace easywsclient
 				}
 				return;
 			}
+			if (mMessageBased)
+			{
+				pollMessages(callback);
+				return;
+			}
 #if 0
 			if (timeout != 0)
 			{
 				mSocket->select(timeout, mTransmitBuffer->getSize());
 			}
 #endif
+			uint32_t readSize = mReadSize;
+			uint64_t receiveAllowance = UINT64_MAX;
+			uint64_t received = 0;
+			uint32_t readBudget = mPollBudget.mReadBytes ? mPollBudget.mReadBytes : UINT32_MAX;
+			if (mReceiveLimited)
+			{
+				receiveAllowance = getAllowance(RECEIVE_BYTES);
+				if (getAllowance(RECEIVE_MESSAGES) == 0)
+				{
+					receiveAllowance = 0; // leave it in the socket until we may dispatch again
+				}
+			}
 			while (true)
 			{
+				if (receiveAllowance == 0)
+				{
+					// Only count polls where the limit actually held data back, not every poll of an idle connection
+					mStats.mReceiveAvailableCalls++;
+					if (mSocket->getReceiveAvailable() > 0)
+					{
+						mStats.mReceiveThrottled++;
+					}
+					break;
+				}
+				if (readBudget == 0)
+				{
+					budgetExhausted(); // there may be more waiting in the socket
+					break;
+				}
                 // Get the current read buffer address, and make sure we have room for this many bytes
-				uint8_t *rbuffer = mReceiveBuffer->confirmCapacity(DEFAULT_MAX_READ_SIZE);
+				uint8_t *rbuffer = mReceiveBuffer->confirmCapacity(readSize);
                 if (!rbuffer)
                 {
                     break;
                 }
-                // Read from the socket
-				int32_t ret = mSocket->receive(rbuffer, DEFAULT_MAX_READ_SIZE);
+				// Read into all of the free space, which is often more than we asked for
+				uint32_t space = mReceiveBuffer->getAvailable();
+				if (space > receiveAllowance)
+				{
+					space = uint32_t(receiveAllowance);
+				}
+				if (space > readBudget)
+				{
+					space = readBudget;
+				}
+				int32_t ret = mSocket->receive(rbuffer, space);
+				mStats.mReceiveCalls++;
                 // If we got no data but the transmission is still valid, just exit
 				if (ret < 0 && (mSocket->wouldBlock() || mSocket->inProgress()))
 				{
+					mStats.mReceiveWouldBlock++;
 					break;
 				}
 				else if (ret <= 0) // If the socket is in a bad state and we got no data, close the connection
@@ -299,42 +572,68 @@ namespace easywsclient
 					fputs(ret < 0 ? "Connection error!\n" : "Connection closed!\n", stderr);
 					break;
 				}
-				else
+				// Advance the buffer pointer by the number of bytes read
+				mReceiveBuffer->addBuffer(nullptr, ret);
+				mStats.mReceiveBytes += uint32_t(ret);
+				received += uint32_t(ret);
+				receiveAllowance -= uint32_t(ret);
+				if (mPollBudget.mReadBytes)
 				{
-					// Advance the buffer pointer by the number of bytes read
-					mReceiveBuffer->addBuffer(nullptr, ret);
+					readBudget -= uint32_t(ret);
 				}
-			}
-			if (mReadyState == CLOSED)
-			{
-				return;
-			}
-			while (mTransmitBuffer->getSize())
-			{
-				uint32_t dataLen;
-				const uint8_t *buffer = mTransmitBuffer->getData(dataLen);
-				int32_t ret = mSocket->send(buffer, dataLen);
-				if (ret < 0 && (mSocket->wouldBlock() || mSocket->inProgress()))
+				if (uint32_t(ret) < space && mSocket->isDrainedByShortReceive())
 				{
+					// A stream socket hands over everything it has, so a short read means it is drained and
+					// another receive would only report 'would block'. Quiet connections drift back to small reads.
+					if (uint32_t(ret) < mReadSize / 4 && mReadSize > DEFAULT_MAX_READ_SIZE)
+					{
+						mReadSize = mReadSize / 2;
+					}
 					break;
 				}
-				else if (ret <= 0)
+				// We filled the buffer, so this connection is busy; reserve more next time, and enough
+				// for everything already waiting so it arrives in one receive rather than many
+				if (uint32_t(ret) < space)
+				{
+					continue; // a TLS record; keep reading until the socket would block
+				}
+				if (mReadSize < MAXIMUM_READ_SIZE)
+				{
+					mReadSize = mReadSize * 2;
+				}
+				uint32_t waiting = mSocket->getReceiveAvailable();
+				mStats.mReceiveAvailableCalls++;
+				if (waiting == 0)
 				{
-					mSocket->close();
-					mReadyState = CLOSED;
-					fputs(ret < 0 ? "Connection error!\n" : "Connection closed!\n", stderr);
 					break;
 				}
-				else
+				readSize = waiting < MAXIMUM_READ_SIZE ? waiting : MAXIMUM_READ_SIZE;
+				if (readSize < mReadSize)
 				{
-					mTransmitBuffer->consume(ret); // shrink the transmit buffer by the number of bytes we managed to send..
+					readSize = mReadSize;
 				}
 			}
+			if (mReceiveLimited && received)
+			{
+				chargeAllowance(RECEIVE_BYTES, received);
+			}
+			if (mReadyState == CLOSED)
+			{
+				return;
+			}
+			if (mConflatedCount && !mCorked && !getTransmitBufferSize())
+			{
+				promoteConflated();
+			}
+			if (readyToSend())
+			{
+				sendQueued(mPollBudget.mWriteBytes ? mPollBudget.mWriteBytes : UINT32_MAX);
+			}
 			if (mReadyState == WebSocket::CLOSED)
 			{
 				return;
 			}
-			if (!mTransmitBuffer->getSize() && mReadyState == CLOSING)
+			if (!getTransmitBufferSize() && mReadyState == CLOSING)
 			{
 				mSocket->close();
 				mReadyState = CLOSED;
@@ -345,97 +644,821 @@ namespace easywsclient
 			}
 		}
 
-		virtual void _dispatchBinary(WebSocketCallback *callback)
+		// Decides whether the send policy lets the queued frames go out now
+		bool readyToSend(void)
 		{
-			while (true)
+			uint32_t size = getTransmitBufferSize();
+			if (size == 0)
 			{
-				wsheader_type ws;
-				uint32_t dataLen;
-				uint8_t *data = mReceiveBuffer->getData(dataLen);
-				if (dataLen < 2) 
-				{ 
-					break;
-				}
-				ws.fin		= (data[0] & 0x80) == 0x80;
-				ws.opcode	= (wsheader_type::opcode_type) (data[0] & 0x0f);
-				ws.mask		= (data[1] & 0x80) == 0x80;
-				ws.N0		= (data[1] & 0x7f);
-				ws.header_size = 2 + (ws.N0 == 126 ? 2 : 0) + (ws.N0 == 127 ? 8 : 0) + (ws.mask ? 4 : 0);
+				return false;
+			}
+			if (mReadyState == CLOSING)
+			{
+				return true; // the close frame, and everything before it, goes out regardless
+			}
+			if (mCorked)
+			{
+				return false;
+			}
+			if (mSendPolicy == SendPolicy::COALESCE)
+			{
+				return size >= mCoalesceBytes || mCoalesceTimer.peekElapsedSeconds() * 1000000 >= mCoalesceMicroseconds;
+			}
+			return true;
+		}
 
-				if (dataLen < ws.header_size) 
-				{ 
-					break;
+		// Writes as much of the transmit buffer as the socket and the send rate limits will take,
+		// but no more than 'budget' bytes
+		void sendQueued(uint32_t budget = UINT32_MAX)
+		{
+			uint32_t limit = budget;
+			if (mSendLimited)
+			{
+				uint64_t allowance = getAllowance(SEND_BYTES);
+				if (mCountFrames)
+				{
+					uint64_t frameBytes = getFrameBytes(getAllowance(SEND_MESSAGES));
+					allowance = frameBytes < allowance ? frameBytes : allowance;
 				}
-
-				int32_t i = 0;
-				if (ws.N0 < 126)
+				if (allowance == 0)
 				{
-					ws.N = ws.N0;
-					i = 2;
+					mStats.mSendThrottled++;
+					return;
 				}
-				else if (ws.N0 == 126)
+				limit = allowance < limit ? uint32_t(allowance) : limit;
+			}
+			uint32_t sent = writeQueued(limit);
+			if (sent == budget && getTransmitBufferSize())
+			{
+				budgetExhausted();
+			}
+			if (mSendLimited && sent)
+			{
+				chargeAllowance(SEND_BYTES, sent);
+				if (mCountFrames)
 				{
-					ws.N = 0;
-					ws.N |= ((uint64_t)data[2]) << 8;
-					ws.N |= ((uint64_t)data[3]) << 0;
-					i = 4;
+					chargeAllowance(SEND_MESSAGES, completeFrames(sent));
 				}
-				else if (ws.N0 == 127)
+				if (sent == limit && getTransmitBufferSize())
 				{
-					ws.N = 0;
-					ws.N |= ((uint64_t)data[2]) << 56;
-					ws.N |= ((uint64_t)data[3]) << 48;
-					ws.N |= ((uint64_t)data[4]) << 40;
-					ws.N |= ((uint64_t)data[5]) << 32;
-					ws.N |= ((uint64_t)data[6]) << 24;
-					ws.N |= ((uint64_t)data[7]) << 16;
-					ws.N |= ((uint64_t)data[8]) << 8;
-					ws.N |= ((uint64_t)data[9]) << 0;
-					i = 10;
+					mStats.mSendThrottled++;
 				}
-				if (ws.mask)
+			}
+		}
+
+		// Writes up to 'limit' bytes of the queued frames; returns the number written
+		uint32_t writeQueued(uint32_t limit)
+		{
+			uint32_t sent = 0;
+			if (!mFrameQueue.empty())
+			{
+				sent = sendFrameQueue(limit);
+				if (!mFrameQueue.empty())
 				{
-					ws.masking_key[0] = ((uint8_t)data[i + 0]) << 0;
-					ws.masking_key[1] = ((uint8_t)data[i + 1]) << 0;
-					ws.masking_key[2] = ((uint8_t)data[i + 2]) << 0;
-					ws.masking_key[3] = ((uint8_t)data[i + 3]) << 0;
+					return sent;
 				}
-				else
+			}
+			while (mTransmitBuffer->getSize() && sent < limit)
+			{
+				uint32_t dataLen;
+				const uint8_t *buffer = mTransmitBuffer->getData(dataLen);
+				if (dataLen > limit - sent)
 				{
-					ws.masking_key[0] = 0;
-					ws.masking_key[1] = 0;
-					ws.masking_key[2] = 0;
-					ws.masking_key[3] = 0;
+					dataLen = limit - sent;
 				}
-                uint32_t frameSize = ws.header_size + uint32_t(ws.N);
-                // If we don't have the full packet worth of data yet...
-				if (dataLen < frameSize) 
-				{ 
+				int32_t ret = mSocket->send(buffer, dataLen);
+				mStats.mSendCalls++;
+				if (ret < 0 && (mSocket->wouldBlock() || mSocket->inProgress()))
+				{
+					mStats.mSendWouldBlock++;
+					break;
+				}
+				else if (ret <= 0)
+				{
+					mSocket->close();
+					mReadyState = CLOSED;
+					fputs(ret < 0 ? "Connection error!\n" : "Connection closed!\n", stderr);
 					break;
 				}
+				else
+				{
+					mStats.mSendBytes += uint32_t(ret);
+					if (uint32_t(ret) < dataLen)
+					{
+						mStats.mSendPartial++;
+					}
+					sent += uint32_t(ret);
+					mTransmitBuffer->consume(ret); // shrink the transmit buffer by the number of bytes we managed to send..
+				}
+			}
+			return sent;
+		}
 
-				// We got a whole message, now do something with it:
-				if (ws.opcode == wsheader_type::TEXT_FRAME
-					|| ws.opcode == wsheader_type::BINARY_FRAME
-					|| ws.opcode == wsheader_type::CONTINUATION)
+		// Writes queued prepared frames, and the copied frames between them, with as few sends as possible.
+		// Stops after 'limit' bytes; returns the number written.
+		uint32_t sendFrameQueue(uint32_t limit)
+		{
+			uint32_t sent = 0;
+			while (!mFrameQueue.empty() && mReadyState != CLOSED && sent < limit)
+			{
+				const void *buffers[MAX_SEND_BUFFERS];
+				uint32_t lengths[MAX_SEND_BUFFERS];
+				uint32_t count = 0;
+				uint32_t total = 0;
+				uint32_t dataLen;
+				const uint8_t *data = mTransmitBuffer->getData(dataLen);
+				uint32_t bufferOffset = 0;
+				uint32_t frameOffset = mFrameOffset;
+				uint32_t room = limit - sent;
+				for (auto &q : mFrameQueue)
 				{
-					if (ws.mask)
+					if (count + 2 > MAX_SEND_BUFFERS || total == room)
 					{
-						fastxor::fastXOR(data + ws.header_size,uint32_t(ws.N), ws.masking_key);
+						break;
 					}
-					// If we are finished and there is no previous received data we can avoid a memory
-					// copy by just calling back directly with this receive buffer
-					if (ws.fin && mReceivedData->getSize() == 0)
+					if (q.mBufferBytes)
 					{
-						if (callback )
+						uint32_t n = q.mBufferBytes < room - total ? q.mBufferBytes : room - total;
+						buffers[count] = data + bufferOffset;
+						lengths[count++] = n;
+						bufferOffset += n;
+						total += n;
+						if (total == room)
 						{
-#if USE_LOGGING
-                            logReceive(data + ws.header_size, uint32_t(ws.N));
-#endif
-							callback->receiveMessage(data+ws.header_size, uint32_t(ws.N), ws.opcode == wsheader_type::TEXT_FRAME);
+							break;
 						}
 					}
-					else
+					uint32_t frameLen;
+					const uint8_t *frame = q.mFrame->getFrame(frameLen);
+					uint32_t n = frameLen - frameOffset < room - total ? frameLen - frameOffset : room - total;
+					buffers[count] = frame + frameOffset;
+					lengths[count++] = n;
+					total += n;
+					frameOffset = 0;
+				}
+				int32_t ret = mSocket->sendv(buffers, lengths, count);
+				mStats.mSendCalls++;
+				if (ret < 0 && (mSocket->wouldBlock() || mSocket->inProgress()))
+				{
+					mStats.mSendWouldBlock++;
+					break;
+				}
+				else if (ret <= 0)
+				{
+					mSocket->close();
+					mReadyState = CLOSED;
+					fputs(ret < 0 ? "Connection error!\n" : "Connection closed!\n", stderr);
+					break;
+				}
+				mStats.mSendBytes += uint32_t(ret);
+				sent += uint32_t(ret);
+				consumeFrameQueue(uint32_t(ret));
+				if (uint32_t(ret) < total)
+				{
+					mStats.mSendPartial++;
+					break; // the socket is full
+				}
+			}
+			return sent;
+		}
+
+		// Advances past this many bytes written from the front of the frame queue
+		void consumeFrameQueue(uint32_t sent)
+		{
+			while (sent && !mFrameQueue.empty())
+			{
+				QueuedFrame &q = mFrameQueue.front();
+				if (q.mBufferBytes)
+				{
+					uint32_t n = sent < q.mBufferBytes ? sent : q.mBufferBytes;
+					mTransmitBuffer->consume(n);
+					q.mBufferBytes -= n;
+					mQueuedBufferBytes -= n;
+					sent -= n;
+					continue;
+				}
+				uint32_t frameLen;
+				q.mFrame->getFrame(frameLen);
+				uint32_t left = frameLen - mFrameOffset;
+				uint32_t n = sent < left ? sent : left;
+				mFrameOffset += n;
+				mQueuedFrameBytes -= n;
+				sent -= n;
+				if (mFrameOffset == frameLen)
+				{
+					q.mFrame->release();
+					mFrameQueue.pop_front();
+					mFrameOffset = 0;
+				}
+			}
+			if (sent)
+			{
+				mTransmitBuffer->consume(sent);
+			}
+		}
+
+		virtual void setSendPolicy(SendPolicy policy, uint32_t coalesceBytes, uint32_t coalesceMicroseconds) override final
+		{
+			mSendPolicy = policy;
+			mCoalesceBytes = coalesceBytes;
+			mCoalesceMicroseconds = coalesceMicroseconds;
+		}
+
+		virtual void setTimeouts(const Timeouts &timeouts, timerwheel::TimerWheel *wheel) override final
+		{
+			cancelTimers();
+			if (mOwnTimerWheel && wheel)
+			{
+				mTimerWheel->release();
+				mOwnTimerWheel = false;
+			}
+			if (wheel)
+			{
+				mTimerWheel = wheel;
+			}
+			else if (!mOwnTimerWheel)
+			{
+				mTimerWheel = timerwheel::TimerWheel::create();
+				mOwnTimerWheel = true;
+			}
+			mTimeouts = timeouts;
+			mLastActivityTime = mTimerWheel->getMilliseconds();
+			armTimers();
+		}
+
+		// Starts the timers which apply to the current state and stops the rest
+		void armTimers(void)
+		{
+			cancelTimers();
+			switch (mReadyState)
+			{
+				case CONNECTING:
+					startTimer(HANDSHAKE_TIMER, mTimeouts.mHandshakeMilliseconds);
+					break;
+				case OPEN:
+					startTimer(PING_TIMER, mTimeouts.mPingIntervalMilliseconds);
+					startTimer(IDLE_TIMER, mTimeouts.mIdleMilliseconds);
+					break;
+				case CLOSING:
+					startTimer(CLOSE_TIMER, mTimeouts.mCloseMilliseconds);
+					break;
+				case CLOSED:
+					break;
+			}
+		}
+
+		void startTimer(TimerId id, uint32_t milliseconds)
+		{
+			if (milliseconds)
+			{
+				mTimers[id] = mTimerWheel->schedule(milliseconds, this, id);
+			}
+		}
+
+		void cancelTimers(void)
+		{
+			for (uint32_t i = 0; i < TIMER_COUNT; i++)
+			{
+				if (mTimers[i])
+				{
+					mTimerWheel->cancel(mTimers[i]);
+					mTimers[i] = 0;
+				}
+			}
+		}
+
+		// Ping and idle timers are not moved on every message; when one fires it checks the time of the
+		// last traffic and, if there was some since, sleeps again for whatever is left of its interval.
+		virtual void onTimer(uint32_t id) override final
+		{
+			mTimers[id] = 0;
+			uint64_t now = mTimerWheel->getMilliseconds();
+			switch (id)
+			{
+				case HANDSHAKE_TIMER:
+					if (mReadyState == CONNECTING && mSocket)
+					{
+						mStats.mTimeouts++;
+						mSocket->release();
+						mSocket = nullptr;
+						mReadyState = CLOSED;
+					}
+					break;
+				case PING_TIMER:
+					if (mReadyState == OPEN)
+					{
+						sendPing();
+						mPingSentTime = now;
+						if (!mTimers[PONG_TIMER])
+						{
+							mPongDeadlinePing = now;
+							startTimer(PONG_TIMER, mTimeouts.mPongMilliseconds);
+						}
+						startTimer(PING_TIMER, mTimeouts.mPingIntervalMilliseconds);
+					}
+					break;
+				case PONG_TIMER:
+					if (mReadyState != OPEN)
+					{
+						break;
+					}
+					if (mLastPongTime < mPongDeadlinePing)
+					{
+						// No pong since that ping, so the peer or the path to it is gone; don't wait on a close handshake
+						mStats.mTimeouts++;
+						mSocket->close();
+						mReadyState = CLOSED;
+						mStalePeer = true;
+					}
+					else if (mLastPongTime < mPingSentTime)
+					{
+						// A later ping is still waiting for its pong; give it the rest of its own deadline
+						uint64_t waited = now - mPingSentTime;
+						mPongDeadlinePing = mPingSentTime;
+						startTimer(PONG_TIMER, waited < mTimeouts.mPongMilliseconds ? uint32_t(mTimeouts.mPongMilliseconds - waited) : 1);
+					}
+					break;
+				case IDLE_TIMER:
+					if (mReadyState == OPEN)
+					{
+						uint64_t idle = now - mLastActivityTime;
+						if (idle < mTimeouts.mIdleMilliseconds)
+						{
+							startTimer(IDLE_TIMER, uint32_t(mTimeouts.mIdleMilliseconds - idle));
+							break;
+						}
+						mStats.mTimeouts++;
+						close();
+					}
+					break;
+				case CLOSE_TIMER:
+					if (mReadyState == CLOSING)
+					{
+						// The peer isn't reading, so the rest of the transmit buffer is dropped
+						mStats.mTimeouts++;
+						mSocket->close();
+						mReadyState = CLOSED;
+					}
+					break;
+			}
+		}
+
+		// Notes that a message was sent or received, for the idle timeout
+		void noteActivity(void)
+		{
+			if (mTimerWheel)
+			{
+				mLastActivityTime = mTimerWheel->getMilliseconds();
+			}
+		}
+
+		virtual void setPollBudget(const PollBudget &budget) override final
+		{
+			mPollBudget = budget;
+		}
+
+		virtual bool hasPendingWork(void) const override final
+		{
+			return mPendingWork;
+		}
+
+		// Poll stopped short to leave time for other connections
+		void budgetExhausted(void)
+		{
+			if (!mPendingWork)
+			{
+				mPendingWork = true;
+				mStats.mPollBudgetExhausted++;
+			}
+		}
+
+		virtual void setRateLimit(const RateLimit &limit) override final
+		{
+			mRateLimit.set(limit);
+			updateRateLimits();
+		}
+
+		virtual void setRateLimitGroup(RateLimitGroup *group) override final
+		{
+			if (group)
+			{
+				group->addRef();
+			}
+			if (mRateGroup)
+			{
+				mRateGroup->release();
+			}
+			mRateGroup = static_cast<RateLimitGroupImpl *>(group);
+			updateRateLimits();
+		}
+
+		bool isRateLimited(uint32_t bucket) const
+		{
+			return mRateLimit.mBuckets[bucket].isLimited() || (mRateGroup && mRateGroup->isLimited(bucket));
+		}
+
+		// Tokens this connection may spend now; the lower of its own and its group's
+		uint64_t getAllowance(uint32_t bucket)
+		{
+			uint64_t ret = mRateLimit.mBuckets[bucket].getAvailable();
+			if (mRateGroup && mRateGroup->isLimited(bucket))
+			{
+				uint64_t group = mRateGroup->getAvailable(bucket);
+				ret = group < ret ? group : ret;
+			}
+			return ret;
+		}
+
+		void chargeAllowance(uint32_t bucket, uint64_t count)
+		{
+			mRateLimit.mBuckets[bucket].consume(count);
+			if (mRateGroup && mRateGroup->isLimited(bucket))
+			{
+				mRateGroup->consume(bucket, count);
+			}
+		}
+
+		void updateRateLimits(void)
+		{
+			mSendLimited = isRateLimited(SEND_BYTES) || isRateLimited(SEND_MESSAGES);
+			mReceiveLimited = isRateLimited(RECEIVE_BYTES) || isRateLimited(RECEIVE_MESSAGES);
+			bool countFrames = isRateLimited(SEND_MESSAGES);
+			if (countFrames && !mCountFrames)
+			{
+				// Whatever is already queued is charged as one message
+				mFrameLengths.clear();
+				mFrameLengthSent = 0;
+				if (getTransmitBufferSize())
+				{
+					mFrameLengths.push_back(getTransmitBufferSize());
+				}
+			}
+			else if (!countFrames)
+			{
+				mFrameLengths.clear();
+				mFrameLengthSent = 0;
+			}
+			mCountFrames = countFrames;
+		}
+
+		// Remembers the size of each queued frame while messages per second are limited
+		void countFrame(uint32_t frameLen)
+		{
+			if (mCountFrames)
+			{
+				mFrameLengths.push_back(frameLen);
+			}
+		}
+
+		// Where frames with this opcode are counted in WebSocketStats; STAT_FRAME_TYPES if they aren't
+		static uint32_t getStatFrameType(uint32_t opcode)
+		{
+			switch (opcode)
+			{
+				case wsheader_type::TEXT_FRAME:		return STAT_TEXT;
+				case wsheader_type::BINARY_FRAME:	return STAT_BINARY;
+				case wsheader_type::CONTINUATION:	return STAT_CONTINUATION;
+				case wsheader_type::CLOSE:			return STAT_CLOSE;
+				case wsheader_type::PING:			return STAT_PING;
+				case wsheader_type::PONG:			return STAT_PONG;
+			}
+			return STAT_FRAME_TYPES;
+		}
+
+		void countFrameIn(uint32_t opcode, uint64_t payloadLen)
+		{
+			uint32_t type = getStatFrameType(opcode);
+			if (type < STAT_FRAME_TYPES)
+			{
+				mStats.mFramesIn[type]++;
+				mStats.mPayloadBytesIn[type] += payloadLen;
+			}
+		}
+
+		void countFrameOut(uint32_t opcode, uint64_t payloadLen)
+		{
+			uint32_t type = getStatFrameType(opcode);
+			if (type < STAT_FRAME_TYPES)
+			{
+				mStats.mFramesOut[type]++;
+				mStats.mPayloadBytesOut[type] += payloadLen;
+			}
+		}
+
+		// Hands a message to the callback, timing how long it keeps us if this one is sampled
+		void dispatchMessage(WebSocketCallback *callback, const void *data, uint32_t dataLen, bool isAscii)
+		{
+			if (!mDispatchSampleInterval || ++mDispatchUntimed < mDispatchSampleInterval)
+			{
+				callback->receiveMessage(data, dataLen, isAscii);
+				return;
+			}
+			mDispatchUntimed = 0;
+			auto start = std::chrono::steady_clock::now();
+			callback->receiveMessage(data, dataLen, isAscii);
+			uint64_t elapsed = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+			mLastDispatchTime = elapsed < UINT32_MAX ? uint32_t(elapsed) : UINT32_MAX;
+			mDispatchTime.load(std::memory_order_relaxed)->record(mLastDispatchTime);
+		}
+
+		virtual void setDispatchTiming(uint32_t sampleInterval) override final
+		{
+			if (sampleInterval)
+			{
+				getHistogram(mDispatchTime);
+			}
+			mDispatchSampleInterval = sampleInterval;
+			mDispatchUntimed = 0;
+		}
+
+		// Bytes from the front of the queue up to the end of the first 'frames' whole frames
+		uint64_t getFrameBytes(uint64_t frames) const
+		{
+			uint64_t ret = 0;
+			for (auto &i : mFrameLengths)
+			{
+				if (frames-- == 0)
+				{
+					break;
+				}
+				ret += i;
+			}
+			return ret > mFrameLengthSent ? ret - mFrameLengthSent : 0;
+		}
+
+		// Accounts for 'sent' bytes written from the front of the queue; returns how many frames were finished
+		uint32_t completeFrames(uint32_t sent)
+		{
+			uint32_t ret = 0;
+			while (sent && !mFrameLengths.empty())
+			{
+				uint32_t left = mFrameLengths.front() - mFrameLengthSent;
+				if (sent < left)
+				{
+					mFrameLengthSent += sent;
+					break;
+				}
+				sent -= left;
+				mFrameLengths.pop_front();
+				mFrameLengthSent = 0;
+				ret++;
+			}
+			return ret;
+		}
+
+		virtual void flush(void) override final
+		{
+			if (mSocket && !mMessageBased && (mReadyState == OPEN || mReadyState == CLOSING))
+			{
+				sendQueued();
+				if (mConflatedCount && mReadyState == OPEN && !getTransmitBufferSize())
+				{
+					promoteConflated();
+					sendQueued();
+				}
+			}
+		}
+
+		virtual void cork(void) override final
+		{
+			if (mSocket && !mCorked && !mMessageBased)
+			{
+				mCorked = true;
+				mSocket->setCork(true);
+			}
+		}
+
+		virtual void uncork(void) override final
+		{
+			if (mCorked)
+			{
+				mCorked = false;
+				flush();
+				if (mSocket && mReadyState != CLOSED)
+				{
+					mSocket->setCork(false); // pushes out any partial packet the kernel was holding
+				}
+			}
+		}
+
+		// Message based transports (shared memory) deliver whole messages, so there is no
+		// framing or masking to deal with. Messages are handed to the callback in place.
+		void pollMessages(WebSocketCallback *callback)
+		{
+			flushMessages();
+			if (mReadyState == CLOSED)
+			{
+				return;
+			}
+			if (!mTransmitBuffer->getSize() && mReadyState == CLOSING)
+			{
+				mSocket->close();
+				mReadyState = CLOSED;
+				return;
+			}
+			uint32_t dispatched = 0;
+			while (callback && mReadyState != CLOSED)
+			{
+				uint32_t dataLen;
+				uint32_t messageType;
+				const void *data = mSocket->peekMessage(dataLen, messageType);
+				if (!data)
+				{
+					break;
+				}
+				if (messageType == wsheader_type::TEXT_FRAME || messageType == wsheader_type::BINARY_FRAME)
+				{
+					if (dispatched == mPollBudget.mDispatchFrames && dispatched)
+					{
+						budgetExhausted(); // the message stays in the ring for the next poll
+						break;
+					}
+					dispatched++;
+					noteActivity();
+					countFrameIn(messageType, dataLen);
+#if USE_LOGGING
+					logReceive(data, dataLen);
+#endif
+					dispatchMessage(callback, data, dataLen, messageType == wsheader_type::TEXT_FRAME);
+				}
+				else if (messageType == wsheader_type::PING)
+				{
+					countFrameIn(messageType, dataLen);
+					queueMessage(wsheader_type::PONG, data, dataLen);
+				}
+				else if (messageType == wsheader_type::PONG)
+				{
+					countFrameIn(messageType, dataLen);
+					receivePong((const uint8_t *)data, dataLen);
+				}
+				else if (messageType == wsheader_type::CLOSE)
+				{
+					countFrameIn(messageType, dataLen);
+					mSocket->releaseMessage();
+					close();
+					break;
+				}
+				else
+				{
+					fprintf(stderr, "ERROR: Got unexpected WebSocket message.\n");
+					mSocket->releaseMessage();
+					close();
+					break;
+				}
+				mSocket->releaseMessage();
+			}
+			// The transport reports the peer went away (closed, crashed or was replaced) by no longer blocking
+			if (mReadyState != CLOSED && !mSocket->wouldBlock() && !mSocket->inProgress())
+			{
+				mSocket->close();
+				mReadyState = CLOSED;
+				fputs("Connection closed!\n", stderr);
+			}
+		}
+
+		// Sends a message directly to a message based transport.
+		// If the transport is full, or we are not connected yet, the message is queued in the transmit buffer
+		// behind a small length/type header until 'flushMessages' can send it.
+		void queueMessage(uint32_t messageType, const void *data, uint32_t dataLen)
+		{
+			countFrameOut(messageType, dataLen);
+			if (mReadyState != CONNECTING && mTransmitBuffer->getSize() == 0)
+			{
+				if (mSocket->sendMessage(data, dataLen, messageType))
+				{
+					return;
+				}
+			}
+			uint32_t header[2] = { dataLen, messageType };
+			mTransmitBuffer->addBuffer(header, sizeof(header));
+			if (dataLen)
+			{
+				mTransmitBuffer->addBuffer(data, dataLen);
+			}
+		}
+
+		void flushMessages(void)
+		{
+			while (mTransmitBuffer->getSize())
+			{
+				uint32_t dataLen;
+				const uint8_t *buffer = mTransmitBuffer->getData(dataLen);
+				uint32_t header[2];
+				memcpy(header, buffer, sizeof(header));
+				if (!mSocket->sendMessage(buffer + sizeof(header), header[0], header[1]))
+				{
+					break;
+				}
+				mTransmitBuffer->consume(uint32_t(sizeof(header)) + header[0]);
+			}
+		}
+
+		virtual void _dispatchBinary(WebSocketCallback *callback)
+		{
+			uint64_t messageAllowance = mReceiveLimited ? getAllowance(RECEIVE_MESSAGES) : UINT64_MAX;
+			uint64_t dispatchBudget = mPollBudget.mDispatchFrames ? mPollBudget.mDispatchFrames : UINT64_MAX;
+			uint64_t dispatched = 0;
+			while (true)
+			{
+				wsheader_type ws;
+				uint32_t dataLen;
+				uint8_t *data = mReceiveBuffer->getData(dataLen);
+				if (dataLen < 2) 
+				{ 
+					break;
+				}
+				ws.fin		= (data[0] & 0x80) == 0x80;
+				ws.opcode	= (wsheader_type::opcode_type) (data[0] & 0x0f);
+				ws.mask		= (data[1] & 0x80) == 0x80;
+				ws.N0		= (data[1] & 0x7f);
+				ws.header_size = 2 + (ws.N0 == 126 ? 2 : 0) + (ws.N0 == 127 ? 8 : 0) + (ws.mask ? 4 : 0);
+
+				if (dataLen < ws.header_size) 
+				{ 
+					break;
+				}
+
+				int32_t i = 0;
+				if (ws.N0 < 126)
+				{
+					ws.N = ws.N0;
+					i = 2;
+				}
+				else if (ws.N0 == 126)
+				{
+					ws.N = 0;
+					ws.N |= ((uint64_t)data[2]) << 8;
+					ws.N |= ((uint64_t)data[3]) << 0;
+					i = 4;
+				}
+				else if (ws.N0 == 127)
+				{
+					ws.N = 0;
+					ws.N |= ((uint64_t)data[2]) << 56;
+					ws.N |= ((uint64_t)data[3]) << 48;
+					ws.N |= ((uint64_t)data[4]) << 40;
+					ws.N |= ((uint64_t)data[5]) << 32;
+					ws.N |= ((uint64_t)data[6]) << 24;
+					ws.N |= ((uint64_t)data[7]) << 16;
+					ws.N |= ((uint64_t)data[8]) << 8;
+					ws.N |= ((uint64_t)data[9]) << 0;
+					i = 10;
+				}
+				if (ws.mask)
+				{
+					ws.masking_key[0] = ((uint8_t)data[i + 0]) << 0;
+					ws.masking_key[1] = ((uint8_t)data[i + 1]) << 0;
+					ws.masking_key[2] = ((uint8_t)data[i + 2]) << 0;
+					ws.masking_key[3] = ((uint8_t)data[i + 3]) << 0;
+				}
+				else
+				{
+					ws.masking_key[0] = 0;
+					ws.masking_key[1] = 0;
+					ws.masking_key[2] = 0;
+					ws.masking_key[3] = 0;
+				}
+                uint32_t frameSize = ws.header_size + uint32_t(ws.N);
+                // If we don't have the full packet worth of data yet...
+				if (dataLen < frameSize) 
+				{ 
+					break;
+				}
+
+				// We got a whole message, now do something with it:
+				if (ws.opcode == wsheader_type::TEXT_FRAME
+					|| ws.opcode == wsheader_type::BINARY_FRAME
+					|| ws.opcode == wsheader_type::CONTINUATION)
+				{
+					if (dispatched == messageAllowance)
+					{
+						mStats.mReceiveThrottled++;
+						break; // the rest waits in the receive buffer for the next poll
+					}
+					if (dispatched == dispatchBudget)
+					{
+						budgetExhausted();
+						break;
+					}
+					dispatched++;
+					countFrameIn(ws.opcode, ws.N);
+					if (ws.mask)
+					{
+						fastxor::fastXOR(data + ws.header_size,uint32_t(ws.N), ws.masking_key);
+					}
+					// If we are finished and there is no previous received data we can avoid a memory
+					// copy by just calling back directly with this receive buffer
+					if (ws.fin && mReceivedData->getSize() == 0)
+					{
+						if (callback )
+						{
+#if USE_LOGGING
+                            logReceive(data + ws.header_size, uint32_t(ws.N));
+#endif
+							dispatchMessage(callback, data+ws.header_size, uint32_t(ws.N), ws.opcode == wsheader_type::TEXT_FRAME);
+						}
+					}
+					else
 					{
 						// Add the input data to the receive data frame we are accumulating
 						mReceivedData->addBuffer(data + ws.header_size, uint32_t(ws.N));
@@ -448,7 +1471,7 @@ namespace easywsclient
 #if USE_LOGGING
                                 logReceive(rdata, dlen);
 #endif
-								callback->receiveMessage(rdata, dlen, ws.opcode == wsheader_type::TEXT_FRAME);
+								dispatchMessage(callback, rdata, dlen, ws.opcode == wsheader_type::TEXT_FRAME);
 							}
 							mReceivedData->clear();
 						}
@@ -458,6 +1481,7 @@ namespace easywsclient
 				}
 				else if (ws.opcode == wsheader_type::PING)
 				{
+					countFrameIn(ws.opcode, ws.N);
 					if (ws.mask)
 					{
 						fastxor::fastXOR(data + ws.header_size, uint32_t(ws.N), ws.masking_key);
@@ -472,10 +1496,18 @@ namespace easywsclient
 				}
 				else if (ws.opcode == wsheader_type::PONG)
 				{
+					countFrameIn(ws.opcode, ws.N);
+					if (ws.mask)
+					{
+						fastxor::fastXOR(data + ws.header_size, uint32_t(ws.N), ws.masking_key);
+					}
+					receivePong(data + ws.header_size, uint32_t(ws.N));
                     mReceiveBuffer->consume(frameSize);
 				}
 				else if (ws.opcode == wsheader_type::CLOSE)
 				{
+					countFrameIn(ws.opcode, ws.N);
+					mReceiveBuffer->clear(); // nothing after a close frame is dispatched, so it isn't parsed again either
 					close();
 					break;
 				}
@@ -486,6 +1518,14 @@ namespace easywsclient
 					break;
 				}
 			}
+			if (mReceiveLimited && dispatched)
+			{
+				chargeAllowance(RECEIVE_MESSAGES, dispatched);
+			}
+			if (dispatched)
+			{
+				noteActivity();
+			}
 		}
 
 		virtual void sendPing() override final
@@ -493,7 +1533,84 @@ namespace easywsclient
 #if USE_PROXY_SERVER
             if (mProxyServer) return;
 #endif
-			sendData(wsheader_type::PING, nullptr, 0);
+			uint8_t payload[PING_PAYLOAD_SIZE];
+			uint64_t sent = getMicroseconds();
+			memcpy(payload, PING_TAG, PING_TAG_SIZE);
+			memcpy(payload + PING_TAG_SIZE, &sent, sizeof(sent));
+			sendData(wsheader_type::PING, payload, sizeof(payload));
+		}
+
+		static uint64_t getMicroseconds(void)
+		{
+			auto now = std::chrono::steady_clock::now().time_since_epoch();
+			return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+		}
+
+		// A pong echoing one of our own pings is a round trip time sample; any other is only proof of life
+		void receivePong(const uint8_t *payload, uint32_t payloadLen)
+		{
+			if (mTimerWheel)
+			{
+				mLastPongTime = mTimerWheel->getMilliseconds();
+			}
+			if (payloadLen == PING_PAYLOAD_SIZE && memcmp(payload, PING_TAG, PING_TAG_SIZE) == 0)
+			{
+				uint64_t sent;
+				memcpy(&sent, payload + PING_TAG_SIZE, sizeof(sent));
+				uint64_t now = getMicroseconds();
+				if (sent <= now)
+				{
+					uint64_t rtt = now - sent;
+					mLastRtt = rtt < UINT32_MAX ? uint32_t(rtt) : UINT32_MAX;
+					getHistogram(mLatency)->record(mLastRtt);
+				}
+			}
+		}
+
+		// Histograms are only allocated once there is something to record, as most connections never
+		// sample anything. Only the polling thread creates one; other threads may be reading the pointer.
+		static latencyhistogram::LatencyHistogram *getHistogram(std::atomic< latencyhistogram::LatencyHistogram * > &histogram)
+		{
+			latencyhistogram::LatencyHistogram *ret = histogram.load(std::memory_order_relaxed);
+			if (!ret)
+			{
+				ret = new latencyhistogram::LatencyHistogram;
+				histogram.store(ret, std::memory_order_release);
+			}
+			return ret;
+		}
+
+		// Fills 'stats' from a histogram and the latest sample recorded in it; all zero if there isn't one yet
+		static void summarize(const std::atomic< latencyhistogram::LatencyHistogram * > &source, uint32_t last, LatencyStats &stats)
+		{
+			const latencyhistogram::LatencyHistogram *histogram = source.load(std::memory_order_acquire);
+			if (!histogram)
+			{
+				stats = LatencyStats();
+				return;
+			}
+			stats.mSamples = histogram->getCount();
+			stats.mMin = histogram->getMin();
+			stats.mMean = histogram->getMean();
+			stats.mMax = histogram->getMax();
+			stats.mP50 = histogram->getPercentile(0.5);
+			stats.mP99 = histogram->getPercentile(0.99);
+			stats.mP999 = histogram->getPercentile(0.999);
+			stats.mLast = last;
+		}
+
+		virtual void getLatencyStats(LatencyStats &stats) const override final
+		{
+			summarize(mLatency, mLastRtt, stats);
+		}
+
+		virtual void resetLatencyStats(void) override final
+		{
+			latencyhistogram::LatencyHistogram *histogram = mLatency.load(std::memory_order_relaxed);
+			if (histogram)
+			{
+				histogram->reset();
+			}
 		}
 
 		virtual void sendText(const char *str) override final
@@ -535,7 +1652,7 @@ namespace easywsclient
 		// we just take the bottom 32 bits of the current high resolution time
 		// It doesn't have the most entropy in the world, but it's good enough for
 		// this use case and is reasonably fast and portable.
-		inline void getMaskingKey(uint8_t maskingKey[4])
+		static inline void getMaskingKey(uint8_t maskingKey[4])
 		{
 #if 1
 			uint64_t seed = wplatform::getRandomTime();
@@ -598,9 +1715,80 @@ namespace easywsclient
 #endif
 
 
+		// Writes the header of a frame carrying 'message_size' bytes; returns the size of the header
+		static uint32_t encodeHeader(uint8_t header[14], uint32_t type, uint64_t message_size, bool useMask, const uint8_t masking_key[4])
+		{
+				uint32_t expectedHeaderLen = 2 + (message_size >= 126 ? 2 : 0) + (message_size >= 65536 ? 6 : 0) + (useMask ? 4 : 0);
+				uint32_t headerLen = expectedHeaderLen;
+
+				header[0] = uint8_t(0x80 | type);
+
+				if (message_size < 126)
+				{
+					header[1] = (message_size & 0xff) | (useMask ? 0x80 : 0);
+					if (useMask)
+					{
+						header[2] = masking_key[0];
+						header[3] = masking_key[1];
+						header[4] = masking_key[2];
+						header[5] = masking_key[3];
+						headerLen = 6;
+					}
+					else
+					{
+						headerLen = 2;
+					}
+				}
+				else if (message_size < 65536)
+				{
+					header[1] = 126 | (useMask ? 0x80 : 0);
+					header[2] = (message_size >> 8) & 0xff;
+					header[3] = (message_size >> 0) & 0xff;
+					if (useMask)
+					{
+						header[4] = masking_key[0];
+						header[5] = masking_key[1];
+						header[6] = masking_key[2];
+						header[7] = masking_key[3];
+						headerLen = 8;
+					}
+					else
+					{
+						headerLen = 4;
+					}
+				}
+				else
+				{ // TODO: run coverage testing here
+					header[1] = 127 | (useMask ? 0x80 : 0);
+					header[2] = (message_size >> 56) & 0xff;
+					header[3] = (message_size >> 48) & 0xff;
+					header[4] = (message_size >> 40) & 0xff;
+					header[5] = (message_size >> 32) & 0xff;
+					header[6] = (message_size >> 24) & 0xff;
+					header[7] = (message_size >> 16) & 0xff;
+					header[8] = (message_size >> 8) & 0xff;
+					header[9] = (message_size >> 0) & 0xff;
+					if (useMask)
+					{
+						header[10] = masking_key[0];
+						header[11] = masking_key[1];
+						header[12] = masking_key[2];
+						header[13] = masking_key[3];
+						headerLen = 14;
+					}
+					else
+					{
+						headerLen = 10;
+					}
+				}
+			assert(headerLen == expectedHeaderLen);
+			return headerLen;
+		}
+
 		void sendData(wsheader_type::opcode_type type,	// Type of data we are sending
 					  const void *messageData,			// The optional message data (this can be null)
-					  uint64_t message_size)			// The size of the message data
+					  uint64_t message_size,			// The size of the message data
+					  bool applyPolicy = true)			// False to only queue the frame, whatever the send policy
 		{
 #if USE_LOGGING
             logSend(messageData, uint32_t(message_size));
@@ -612,87 +1800,173 @@ namespace easywsclient
 			{
 				return;
 			}
+			if (type == wsheader_type::TEXT_FRAME || type == wsheader_type::BINARY_FRAME)
+			{
+				noteActivity();
+			}
+			if (mMessageBased)
+			{
+				queueMessage(type, messageData, uint32_t(message_size));
+				return;
+			}
+			countFrameOut(type, message_size);
 
 			uint8_t header[14];
-			uint32_t expectedHeaderLen = 2 + (message_size >= 126 ? 2 : 0) + (message_size >= 65536 ? 6 : 0) + (mUseMask ? 4 : 0);
-			uint32_t headerLen = expectedHeaderLen;
-
-			header[0] = uint8_t(0x80 | type);
+			uint32_t headerLen = encodeHeader(header, type, message_size, mUseMask, masking_key);
+			if (getTransmitBufferSize() == 0)
+			{
+				mCoalesceTimer.reset(); // coalescing waits are measured from the oldest queued frame
+			}
+			countFrame(headerLen + uint32_t(message_size));
+			// N.B. - mTransmitBuffer will keep growing until it can be transmitted over the socket:
+			mTransmitBuffer->addBuffer(header, headerLen);
+			if (messageData)
+			{
+				mTransmitBuffer->addBuffer(messageData, uint32_t(message_size));
+			}
+			// If we are using masking then we need to XOR the message by the mask
+			if (mUseMask)
+			{
+				uint32_t message_offset = mTransmitBuffer->getSize() - uint32_t(message_size);
+				uint32_t dataLen;
+				uint8_t *data = mTransmitBuffer->getData(dataLen);
+				uint8_t *maskData = &data[message_offset];
+				fastxor::fastXOR(maskData, uint32_t(message_size), masking_key);
+			}
+			if (applyPolicy)
+			{
+				sendIfDue();
+			}
+		}
 
-			if (message_size < 126)
+		virtual void sendConflated(uint64_t key, const void *data, uint32_t dataLen, bool isAscii) override final
+		{
+#if USE_PROXY_SERVER
+			if (mProxyServer)
 			{
-				header[1] = (message_size & 0xff) | (mUseMask ? 0x80 : 0);
-				if (mUseMask)
+				if (isAscii)
 				{
-					header[2] = masking_key[0];
-					header[3] = masking_key[1];
-					header[4] = masking_key[2];
-					header[5] = masking_key[3];
-					headerLen = 6;
+					sendText((const char *)data);
 				}
 				else
 				{
-					headerLen = 2;
+					sendBinary(data, dataLen);
 				}
+				return;
+			}
+#endif
+			if (mReadyState == CLOSING || mReadyState == CLOSED)
+			{
+				return;
 			}
-			else if (message_size < 65536)
+			noteActivity();
+			if (mMessageBased)
 			{
-				header[1] = 126 | (mUseMask ? 0x80 : 0);
-				header[2] = (message_size >> 8) & 0xff;
-				header[3] = (message_size >> 0) & 0xff;
-				if (mUseMask)
-				{
-					header[4] = masking_key[0];
-					header[5] = masking_key[1];
-					header[6] = masking_key[2];
-					header[7] = masking_key[3];
-					headerLen = 8;
-				}
-				else
+				queueMessage(isAscii ? wsheader_type::TEXT_FRAME : wsheader_type::BINARY_FRAME, data, dataLen);
+				return;
+			}
+			ConflatedMessage *m;
+			ConflatedIndexMap::iterator found = mConflatedIndex.find(key);
+			if (found != mConflatedIndex.end())
+			{
+				// Replace the unsent message in place, so this key keeps its turn
+				m = &mConflated[found->second];
+				mConflatedBytes -= uint32_t(m->mData.size());
+				mStats.mConflatedMessages++;
+			}
+			else
+			{
+				if (mConflatedCount == mConflated.size())
 				{
-					headerLen = 4;
+					mConflated.push_back(ConflatedMessage());
 				}
+				mConflatedIndex[key] = mConflatedCount;
+				m = &mConflated[mConflatedCount++];
+				m->mKey = key;
 			}
-			else
-			{ // TODO: run coverage testing here
-				header[1] = 127 | (mUseMask ? 0x80 : 0);
-				header[2] = (message_size >> 56) & 0xff;
-				header[3] = (message_size >> 48) & 0xff;
-				header[4] = (message_size >> 40) & 0xff;
-				header[5] = (message_size >> 32) & 0xff;
-				header[6] = (message_size >> 24) & 0xff;
-				header[7] = (message_size >> 16) & 0xff;
-				header[8] = (message_size >> 8) & 0xff;
-				header[9] = (message_size >> 0) & 0xff;
-				if (mUseMask)
-				{
-					header[10] = masking_key[0];
-					header[11] = masking_key[1];
-					header[12] = masking_key[2];
-					header[13] = masking_key[3];
-					headerLen = 14;
+			const uint8_t *scan = (const uint8_t *)data;
+			m->mData.assign(scan, scan + dataLen);
+			m->mAscii = isAscii;
+			mConflatedBytes += dataLen;
+			if (mSendPolicy == SendPolicy::IMMEDIATE && mReadyState == OPEN && !mCorked && !getTransmitBufferSize())
+			{
+				promoteConflated();
+				sendQueued();
+			}
+		}
+
+		// Moves every conflated message into the transmit buffer, in the order their keys were first queued.
+		// The entries keep their buffers so the next round of updates doesn't allocate.
+		void promoteConflated(void)
+		{
+			for (uint32_t i = 0; i < mConflatedCount; i++)
+			{
+				ConflatedMessage &m = mConflated[i];
+				sendData(m.mAscii ? wsheader_type::TEXT_FRAME : wsheader_type::BINARY_FRAME, m.mData.empty() ? nullptr : &m.mData[0], m.mData.size(), false);
+			}
+			mConflatedCount = 0;
+			mConflatedBytes = 0;
+			mConflatedIndex.clear();
+		}
+
+		// Applies the send policy after a frame has been queued
+		void sendIfDue(void)
+		{
+			if (mReadyState == OPEN && !mCorked &&
+				(mSendPolicy == SendPolicy::IMMEDIATE || (mSendPolicy == SendPolicy::COALESCE && getTransmitBufferSize() >= mCoalesceBytes)))
+			{
+				sendQueued();
+			}
+		}
+
+		virtual void sendFrame(PreparedFrame *frame) override final
+		{
+			uint32_t payloadLen;
+			const uint8_t *payload = frame->getPayload(payloadLen);
+#if USE_PROXY_SERVER
+			if (mProxyServer)
+			{
+				if (frame->isAscii())
+				{
+					mProxyServer->sendText((const char *)payload);
 				}
 				else
 				{
-					headerLen = 10;
+					mProxyServer->sendBinary(payload, payloadLen);
 				}
+				return;
 			}
-			assert(headerLen == expectedHeaderLen);
-			// N.B. - mTransmitBuffer will keep growing until it can be transmitted over the socket:
-			mTransmitBuffer->addBuffer(header, headerLen);
-			if (messageData)
+#endif
+			if (mReadyState == CLOSING || mReadyState == CLOSED)
 			{
-				mTransmitBuffer->addBuffer(messageData, uint32_t(message_size));
+				return;
 			}
-			// If we are using masking then we need to XOR the message by the mask
-			if (mUseMask)
+#if USE_LOGGING
+			logSend(payload, payloadLen);
+#endif
+			noteActivity();
+			if (mMessageBased)
 			{
-				uint32_t message_offset = mTransmitBuffer->getSize() - uint32_t(message_size);
-				uint32_t dataLen;
-				uint8_t *data = mTransmitBuffer->getData(dataLen);
-				uint8_t *maskData = &data[message_offset];
-				fastxor::fastXOR(maskData, uint32_t(message_size), masking_key);
+				// Shared memory carries the payload itself, so it is copied into the ring
+				queueMessage(frame->isAscii() ? wsheader_type::TEXT_FRAME : wsheader_type::BINARY_FRAME, payload, payloadLen);
+				return;
+			}
+			if (getTransmitBufferSize() == 0)
+			{
+				mCoalesceTimer.reset();
 			}
+			uint32_t frameLen;
+			frame->getFrame(frameLen);
+			countFrame(frameLen);
+			countFrameOut(frame->isAscii() ? wsheader_type::TEXT_FRAME : wsheader_type::BINARY_FRAME, payloadLen);
+			frame->addRef();
+			QueuedFrame q;
+			q.mBufferBytes = mTransmitBuffer->getSize() - mQueuedBufferBytes;
+			q.mFrame = frame;
+			mQueuedBufferBytes += q.mBufferBytes;
+			mQueuedFrameBytes += frameLen;
+			mFrameQueue.push_back(q);
+			sendIfDue();
 		}
 
 		virtual void close() override final
@@ -709,9 +1983,39 @@ namespace easywsclient
                 {
                     return;
                 }
+                if (mReadyState == CONNECTING)
+                {
+                    // There's no websocket to close yet; a close frame would go out ahead of, or instead of,
+                    // the upgrade, so just drop the connection
+                    abortConnect();
+                    return;
+                }
+                if (mConflatedCount)
+                {
+                    promoteConflated(); // the latest state still goes out ahead of the close frame
+                }
+                if (mCorked)
+                {
+                    mCorked = false;
+                    if (mSocket)
+                    {
+                        mSocket->setCork(false);
+                    }
+                }
                 // add the 'close frame' command to the transmit buffer and set the closing state on
                 mReadyState = CLOSING;
+                if (mTimerWheel)
+                {
+                    armTimers();
+                }
+                if (mMessageBased)
+                {
+                    queueMessage(wsheader_type::CLOSE, nullptr, 0);
+                    return;
+                }
                 uint8_t closeFrame[6] = { 0x88, 0x80, 0x00, 0x00, 0x00, 0x00 }; // last 4 bytes are a masking key
+                countFrame(sizeof(closeFrame));
+                countFrameOut(wsheader_type::CLOSE, 0);
                 mTransmitBuffer->addBuffer(closeFrame, sizeof(closeFrame));
             }
 		}
@@ -739,14 +2043,15 @@ namespace easywsclient
                 ret = mTransmitBuffer->getMaxBufferSize();
                 ret += mReceiveBuffer->getMaxBufferSize();
                 ret += mReceivedData->getMaxBufferSize();
+                ret += mConflatedBytes;
             }
 			return ret;
 		}
 
-		// Return the amount of memory being consumed by the pending transmit buffer
+		// Return the amount of memory being consumed by the pending transmit buffer, including queued prepared frames
 		virtual uint32_t getTransmitBufferSize(void) const override final
 		{
-            return mTransmitBuffer ? mTransmitBuffer->getSize() : 0;
+            return mTransmitBuffer ? mTransmitBuffer->getSize() + mQueuedFrameBytes : 0;
 		}
 
 		// Maximum size of the buffer
@@ -755,6 +2060,56 @@ namespace easywsclient
             return mTransmitBuffer ? mTransmitBuffer->getMaxBufferSize() : 0;
 		}
 
+		// Only reads counters and the buffers, which live as long as the connection, so it is safe on any thread
+		virtual void getStats(WebSocketStats &stats) const override final
+		{
+			stats.mReceiveCalls = mStats.mReceiveCalls;
+			stats.mReceiveWouldBlock = mStats.mReceiveWouldBlock;
+			stats.mReceiveBytes = mStats.mReceiveBytes;
+			stats.mReceiveAvailableCalls = mStats.mReceiveAvailableCalls;
+			stats.mSendCalls = mStats.mSendCalls;
+			stats.mSendWouldBlock = mStats.mSendWouldBlock;
+			stats.mSendBytes = mStats.mSendBytes;
+			stats.mSendPartial = mStats.mSendPartial;
+			stats.mConflatedMessages = mStats.mConflatedMessages;
+			stats.mSendThrottled = mStats.mSendThrottled;
+			stats.mReceiveThrottled = mStats.mReceiveThrottled;
+			stats.mPollBudgetExhausted = mStats.mPollBudgetExhausted;
+			stats.mTimeouts = mStats.mTimeouts;
+			for (uint32_t i = 0; i < STAT_FRAME_TYPES; i++)
+			{
+				stats.mFramesIn[i] = mStats.mFramesIn[i];
+				stats.mPayloadBytesIn[i] = mStats.mPayloadBytesIn[i];
+				stats.mFramesOut[i] = mStats.mFramesOut[i];
+				stats.mPayloadBytesOut[i] = mStats.mPayloadBytesOut[i];
+			}
+			stats.mBufferGrows = 0;
+			stats.mBufferCompactions = 0;
+			stats.mTransmitBufferPeak = 0;
+			stats.mReceiveBufferPeak = 0;
+			if (mTransmitBuffer)
+			{
+				const simplebuffer::SimpleBuffer *buffers[3] = { mTransmitBuffer, mReceiveBuffer, mReceivedData };
+				for (auto b : buffers)
+				{
+					stats.mBufferGrows += b->getGrowCount();
+					stats.mBufferCompactions += b->getCompactCount();
+				}
+				stats.mTransmitBufferPeak = mTransmitBuffer->getPeakSize();
+				stats.mReceiveBufferPeak = mReceiveBuffer->getPeakSize();
+			}
+			stats.mReadSize = mReadSize;
+			stats.mTls = mStats.mTls;
+			stats.mKernelTlsSend = mStats.mKernelTlsSend;
+			stats.mKernelTlsReceive = mStats.mKernelTlsReceive;
+			summarize(mDispatchTime, mLastDispatchTime, stats.mDispatch);
+		}
+
+		virtual bool getTransportInfo(wsocket::TransportInfo &info) const override final
+		{
+			return mSocket ? mSocket->getTransportInfo(info) : false;
+		}
+
         // Log all sends
         virtual bool setLogFile(const char *fileName) override final
         {
@@ -799,23 +2154,93 @@ namespace easywsclient
 			}
 		}
 
+		// Waits for a client socket to finish resolving and connecting.
+		// Returns true once connected; closes the connection if it failed or took too long.
+		bool completeConnect(void)
+		{
+			wsocket::ConnectStatus status = mSocket->pollConnect();
+			if (status == wsocket::ConnectStatus::CONNECTED)
+			{
+				mConnectionPhase = ConnectionPhase::HTTP_STATUS;
+				mConnectionTimer.reset();
+				return true;
+			}
+			if (status == wsocket::ConnectStatus::FAILED || mConnectionTimer.peekElapsedSeconds() >= CONNECTION_TIME_OUT)
+			{
+				mSocket->release();
+				mSocket = nullptr;
+				mReadyState = CLOSED;
+			}
+			return false;
+		}
+
+		// Gives up on a connection which never got as far as OPEN
+		void abortConnect(void)
+		{
+			cancelTimers();
+			if (mSocket)
+			{
+				mSocket->release();
+				mSocket = nullptr;
+			}
+			if (mHandshakeBuffer)
+			{
+				mHandshakeBuffer->release();
+				mHandshakeBuffer = nullptr;
+			}
+			mReadyState = CLOSED;
+		}
+
+		// Sends whatever is left of the client's upgrade request; returns true once it has all been sent
+		bool sendHandshake(void)
+		{
+			while (mHandshakeBuffer && mHandshakeBuffer->getSize())
+			{
+				uint32_t dataLen;
+				const uint8_t *buffer = mHandshakeBuffer->getData(dataLen);
+				int32_t ret = mSocket->send(buffer, dataLen);
+				if (ret <= 0)
+				{
+					if (ret < 0 && (mSocket->wouldBlock() || mSocket->inProgress()))
+					{
+						return false;
+					}
+					mSocket->release();
+					mSocket = nullptr;
+					mReadyState = CLOSED;
+					return false;
+				}
+				mHandshakeBuffer->consume(uint32_t(ret));
+			}
+			return true;
+		}
+
 		// Process connection state.
 		// If we are a client, then we send the initial request and wait for responses.
 		// If we are a server, we wait for the initial request and, once we get it, send responses.
 		// If we fail to get a timely response within the 'CONNECTION_TIME_OUT' period, we close
 		// the connection
-		void processConnection(void)
+		bool processConnection(void)
 		{
-			if (!mSocket) return;
+			if (!mSocket) return false;
 			double delay = mConnectionTimer.peekElapsedSeconds();
 			if (delay >= CONNECTION_TIME_OUT)
 			{
 				mSocket->release();
 				mSocket = nullptr;
 				mReadyState = CLOSED;
-				return;
+				return false;
 			}
 			int32_t v = mSocket->receive(&mConnectionBuffer[mConnectionIndex], 1);
+			mStats.mReceiveCalls++;
+			if (v == 0 || (v < 0 && !mSocket->wouldBlock() && !mSocket->inProgress()))
+			{
+				// The peer went away (or refused us) before the handshake completed
+				mSocket->release();
+				mSocket = nullptr;
+				mReadyState = CLOSED;
+				return false;
+			}
 			if (v > 0)
 			{
 				if (mConnectionBuffer[mConnectionIndex] == 0x0A)
@@ -833,6 +2258,8 @@ namespace easywsclient
 					bool ok = false;
 					switch (mConnectionPhase)
 					{
+						case ConnectionPhase::SOCKET_CONNECT:
+							break; // nothing is read until the socket connects
 						case ConnectionPhase::SERVER_CLIENT_STRINGS:
 							ok = true;
 							// Just a CR/LF
@@ -916,6 +2343,7 @@ namespace easywsclient
 					}
 				}
 			}
+			return v > 0;
 		}
 
 	private:
@@ -925,10 +2353,12 @@ namespace easywsclient
 #endif
 		simplebuffer::SimpleBuffer	*mReceiveBuffer{ nullptr };		// receive buffer
 		simplebuffer::SimpleBuffer	*mTransmitBuffer{ nullptr };	// transmit buffer
+		simplebuffer::SimpleBuffer	*mHandshakeBuffer{ nullptr };	// client upgrade request waiting for the socket to connect
 		simplebuffer::SimpleBuffer	*mReceivedData{ nullptr };		// received data
 		wsocket::Wsocket			*mSocket{ nullptr };
 		ReadyStateValues			mReadyState{ CLOSED };
 		bool						mUseMask{ true };
+		bool						mMessageBased{ false };		// The transport carries whole messages; no websocket framing
 		bool						mIsServerClient{ false }; // We are a server and this is a connection to a remote client
         uint32_t                    mSendCount{ 0 };
         uint32_t                    mReceiveCount{ 0 };
@@ -939,14 +2369,245 @@ namespace easywsclient
 		char						mConnectionBuffer[256];
 		timer::Timer				mConnectionTimer;
 		ConnectionPhase				mConnectionPhase{ ConnectionPhase::HTTP_STATUS };
+		relaxedatomic::RelaxedAtomic< uint32_t >	mReadSize{ DEFAULT_MAX_READ_SIZE };	// Space reserved for the next read; adapts to the traffic
+		ConnectionStats				mStats;
+		SendPolicy					mSendPolicy{ SendPolicy::ON_POLL };
+		uint32_t					mCoalesceBytes{ 0 };		// COALESCE sends once this many bytes are queued
+		uint32_t					mCoalesceMicroseconds{ 0 };	// ...or once the oldest queued frame is this old
+		timer::Timer				mCoalesceTimer;				// Started when a frame is queued behind an empty transmit buffer
+		bool						mCorked{ false };
+		QueuedFrameQueue			mFrameQueue;				// Prepared frames waiting to be sent, by reference
+		uint32_t					mFrameOffset{ 0 };			// Bytes of the front prepared frame already sent
+		uint32_t					mQueuedFrameBytes{ 0 };		// Unsent bytes of the prepared frames
+		uint32_t					mQueuedBufferBytes{ 0 };	// Bytes of the transmit buffer which go out between prepared frames
+		ConflatedMessageVector		mConflated;					// Latest unsent message per key, in the order the keys were queued
+		uint32_t					mConflatedCount{ 0 };		// Entries of mConflated in use
+		uint32_t					mConflatedBytes{ 0 };		// Payload bytes waiting in mConflated
+		ConflatedIndexMap			mConflatedIndex;			// Key to its entry in mConflated
+		RateLimiter					mRateLimit;					// This connection's own limits
+		RateLimitGroupImpl			*mRateGroup{ nullptr };		// Limits shared with other connections
+		bool						mSendLimited{ false };
+		bool						mReceiveLimited{ false };
+		bool						mCountFrames{ false };		// Messages per second are limited, so frame sizes are kept
+		std::deque< uint32_t >		mFrameLengths;				// Size of each queued frame, oldest first
+		uint32_t					mFrameLengthSent{ 0 };		// Bytes of the front frame already written
+		PollBudget					mPollBudget;				// Most work one poll may do
+		Timeouts					mTimeouts;
+		timerwheel::TimerWheel		*mTimerWheel{ nullptr };	// Null until timeouts are set
+		bool						mOwnTimerWheel{ false };	// The wheel is ours and is updated by poll
+		uint64_t					mTimers[TIMER_COUNT]{};		// Handle of each running timer; zero if stopped
+		uint64_t					mLastPongTime{ 0 };			// Wheel time the last pong arrived
+		uint64_t					mPongDeadlinePing{ 0 };		// Wheel time of the ping the pong timer is waiting on
+		uint64_t					mLastActivityTime{ 0 };		// Wheel time a message was last sent or received
+		uint64_t					mPingSentTime{ 0 };			// Wheel time of the last automatic ping
+		bool						mStalePeer{ false };		// Pongs stopped; the callback hears of it on the next poll
+		std::atomic< latencyhistogram::LatencyHistogram * >	mLatency{ nullptr };		// Round trip times of our pings, in microseconds
+		relaxedatomic::RelaxedAtomic< uint32_t >	mLastRtt;
+		std::atomic< latencyhistogram::LatencyHistogram * >	mDispatchTime{ nullptr };	// Time the callback spent on sampled messages, in nanoseconds
+		relaxedatomic::RelaxedAtomic< uint32_t >	mLastDispatchTime;
+		uint32_t					mDispatchSampleInterval{ 0 };	// Time one in this many dispatches; zero for none
+		uint32_t					mDispatchUntimed{ 0 };		// Dispatches since the last timed one
+		bool						mPendingWork{ false };		// The last poll stopped at its budget
+};
+
+class PreparedFrameImpl : public PreparedFrame
+{
+public:
+	PreparedFrameImpl(const void *data, uint32_t dataLen, bool isAscii, bool useMask) : mAscii(isAscii), mMasked(useMask)
+	{
+		uint8_t masking_key[4] = { 0, 0, 0, 0 };
+		if (useMask)
+		{
+			WebSocketImpl::getMaskingKey(masking_key);
+		}
+		uint8_t header[14];
+		uint32_t headerLen = WebSocketImpl::encodeHeader(header, isAscii ? WebSocketImpl::wsheader_type::TEXT_FRAME : WebSocketImpl::wsheader_type::BINARY_FRAME,
+			dataLen, useMask, masking_key);
+		mFrameLen = headerLen + dataLen;
+		mPayloadLen = dataLen;
+		// A masked frame also keeps the original payload, for transports which carry the payload itself.
+		// Each copy is followed by a terminating zero so a text payload can be handed on as a string.
+		mFrame = (uint8_t *)malloc(mFrameLen + 1 + (useMask ? dataLen + 1 : 0));
+		memcpy(mFrame, header, headerLen);
+		if (dataLen)
+		{
+			memcpy(mFrame + headerLen, data, dataLen);
+		}
+		mFrame[mFrameLen] = 0;
+		mPayload = mFrame + headerLen;
+		if (useMask)
+		{
+			mPayload = mFrame + mFrameLen + 1;
+			if (dataLen)
+			{
+				memcpy(mPayload, data, dataLen);
+			}
+			mPayload[dataLen] = 0;
+			fastxor::fastXOR(mFrame + headerLen, dataLen, masking_key);
+		}
+	}
+
+	virtual ~PreparedFrameImpl(void)
+	{
+		free(mFrame);
+	}
+
+	virtual void addRef(void) override final
+	{
+		mRefCount.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	virtual void release(void) override final
+	{
+		if (mRefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			delete this;
+		}
+	}
+
+	virtual const uint8_t *getFrame(uint32_t &frameLen) const override final
+	{
+		frameLen = mFrameLen;
+		return mFrame;
+	}
+
+	virtual const uint8_t *getPayload(uint32_t &payloadLen) const override final
+	{
+		payloadLen = mPayloadLen;
+		return mPayload;
+	}
+
+	virtual bool isAscii(void) const override final
+	{
+		return mAscii;
+	}
+
+	virtual bool isMasked(void) const override final
+	{
+		return mMasked;
+	}
+
+	std::atomic<uint32_t>	mRefCount{ 1 };
+	uint8_t					*mFrame{ nullptr };		// Header followed by the payload
+	uint32_t				mFrameLen{ 0 };
+	uint8_t					*mPayload{ nullptr };	// The payload before masking
+	uint32_t				mPayloadLen{ 0 };
+	bool					mAscii{ false };
+	bool					mMasked{ false };
+};
+
+struct ClosingConnection
+{
+	WebSocket	*mConnection{ nullptr };
+	std::chrono::steady_clock::time_point	mDeadline;
+};
+
+typedef std::vector< ClosingConnection > ClosingConnectionVector;
+
+class ClosingSetImpl : public ClosingSet
+{
+public:
+	ClosingSetImpl(uint32_t graceMilliseconds) : mGraceMilliseconds(graceMilliseconds)
+	{
+	}
+
+	virtual ~ClosingSetImpl(void)
+	{
+		mDroppedCount += mConnections.size();
+		for (auto &i : mConnections)
+		{
+			delete i.mConnection;
+		}
+	}
+
+	virtual void add(WebSocket *connection) override final
+	{
+		connection->close();
+		if (connection->getReadyState() == WebSocket::CLOSED)
+		{
+			delete connection;
+			return;
+		}
+		ClosingConnection c;
+		c.mConnection = connection;
+		c.mDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(mGraceMilliseconds);
+		mConnections.push_back(c);
+	}
+
+	virtual uint32_t poll(void) override final
+	{
+		if (mConnections.empty())
+		{
+			return 0;
+		}
+		auto now = std::chrono::steady_clock::now();
+		size_t keep = 0;
+		for (size_t i = 0; i < mConnections.size(); i++)
+		{
+			ClosingConnection &c = mConnections[i];
+			c.mConnection->poll(nullptr);
+			bool closed = c.mConnection->getReadyState() == WebSocket::CLOSED;
+			if (closed || now >= c.mDeadline)
+			{
+				if (!closed)
+				{
+					mDroppedCount++;
+				}
+				delete c.mConnection;
+			}
+			else
+			{
+				mConnections[keep++] = c;
+			}
+		}
+		mConnections.resize(keep);
+		return uint32_t(keep);
+	}
+
+	virtual uint32_t getCount(void) const override final
+	{
+		return uint32_t(mConnections.size());
+	}
+
+	virtual uint64_t getDroppedCount(void) const override final
+	{
+		return mDroppedCount;
+	}
+
+	virtual void release(void) override final
+	{
+		delete this;
+	}
+
+	uint32_t				mGraceMilliseconds{ 0 };
+	uint64_t				mDroppedCount{ 0 };
+	ClosingConnectionVector	mConnections;
 };
 
-WebSocket *WebSocket::create(const char *url, const char *origin,bool useMask)
+ClosingSet *ClosingSet::create(uint32_t graceMilliseconds)
+{
+	auto ret = new ClosingSetImpl(graceMilliseconds);
+	return static_cast<ClosingSet *>(ret);
+}
+
+RateLimitGroup *RateLimitGroup::create(const RateLimit &limit)
+{
+	auto ret = new RateLimitGroupImpl(limit);
+	return static_cast<RateLimitGroup *>(ret);
+}
+
+PreparedFrame *PreparedFrame::create(const void *data, uint32_t dataLen, bool isAscii, bool useMask)
+{
+	auto ret = new PreparedFrameImpl(data, dataLen, isAscii, useMask);
+	return static_cast<PreparedFrame *>(ret);
+}
+
+WebSocket *WebSocket::create(const char *url, const char *origin,bool useMask,const wsocket::SocketOptions *options)
 {
 #if USE_PROXY_SERVER
     url = "apiserver";
 #endif
-	auto ret = new WebSocketImpl(url, origin, useMask);
+	auto ret = new WebSocketImpl(url, origin, useMask, options);
 	if (!ret->isValid())
 	{
 		delete ret;
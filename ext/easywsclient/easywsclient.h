@@ -10,6 +10,13 @@
 namespace wsocket
 {
 	class Wsocket;
+	struct SocketOptions;
+	struct TransportInfo;
+}
+
+namespace timerwheel
+{
+	class TimerWheel;
 }
 
 namespace easywsclient 
@@ -20,6 +27,157 @@ class WebSocketCallback
 {
 public:
 	virtual void receiveMessage(const void *data, uint32_t dataLen, bool isAscii) = 0;
+
+	// No pong came back within Timeouts::mPongMilliseconds of a ping, so the connection has been dropped.
+	// Called from the next poll.
+	virtual void onStalePeer(void)
+	{
+	}
+};
+
+// A summary of timing samples. From getLatencyStats these are the round trip times of our pings, from
+// sending each to its pong being dispatched, in microseconds; unlike the kernel's TCP round trip time
+// they include both ends' queues and polling delays. WebSocketStats::mDispatch uses it for callback times.
+struct LatencyStats
+{
+	uint64_t	mSamples{ 0 };
+	uint32_t	mMin{ 0 };
+	uint32_t	mMean{ 0 };
+	uint32_t	mMax{ 0 };
+	uint32_t	mP50{ 0 };			// Percentiles are within about 6%
+	uint32_t	mP99{ 0 };
+	uint32_t	mP999{ 0 };
+	uint32_t	mLast{ 0 };			// The most recent sample
+};
+
+// The kinds of frame counted separately in WebSocketStats
+enum StatFrameType : uint32_t
+{
+	STAT_TEXT,
+	STAT_BINARY,
+	STAT_CONTINUATION,		// Later fragments of a fragmented message
+	STAT_CLOSE,
+	STAT_PING,
+	STAT_PONG,
+	STAT_FRAME_TYPES
+};
+
+// Counters describing the work done by one connection; see WebSocket::getStats
+struct WebSocketStats
+{
+	uint64_t	mReceiveCalls{ 0 };			// Calls made to the socket's receive
+	uint64_t	mReceiveWouldBlock{ 0 };	// Receive calls which found nothing waiting
+	uint64_t	mReceiveBytes{ 0 };			// Bytes read from the socket
+	uint64_t	mReceiveAvailableCalls{ 0 };	// Times the socket was asked how much data was waiting
+	uint64_t	mSendCalls{ 0 };			// Calls made to the socket's send
+	uint64_t	mSendWouldBlock{ 0 };		// Send calls which could not take any data
+	uint64_t	mSendBytes{ 0 };			// Bytes written to the socket
+	uint64_t	mSendPartial{ 0 };			// Sends which took some, but not all, of what they were given
+	uint64_t	mConflatedMessages{ 0 };	// Conflated messages replaced by a newer one before they were sent
+	uint64_t	mSendThrottled{ 0 };		// Times queued data was held back by a send rate limit
+	uint64_t	mReceiveThrottled{ 0 };		// Times reading or dispatching stopped at a receive rate limit
+	uint64_t	mPollBudgetExhausted{ 0 };	// Polls which stopped at their PollBudget with work left over
+	uint64_t	mTimeouts{ 0 };				// Times one of the Timeouts closed or dropped the connection
+	uint64_t	mFramesIn[STAT_FRAME_TYPES]{};		// Frames received, by StatFrameType
+	uint64_t	mPayloadBytesIn[STAT_FRAME_TYPES]{};	// Their payload bytes, without the frame headers
+	uint64_t	mFramesOut[STAT_FRAME_TYPES]{};		// Frames sent, by StatFrameType, counted as they are queued
+	uint64_t	mPayloadBytesOut[STAT_FRAME_TYPES]{};
+	uint64_t	mBufferGrows{ 0 };			// Times the transmit and receive buffers reallocated to make room
+	uint64_t	mBufferCompactions{ 0 };	// Times they moved their contents to the front to make room instead
+	uint32_t	mTransmitBufferPeak{ 0 };	// Most bytes the transmit buffer has held (prepared frames are not copied into it)
+	uint32_t	mReceiveBufferPeak{ 0 };	// Most bytes the receive buffer has held
+	uint32_t	mReadSize{ 0 };				// Space currently reserved for each read; grows while the connection is busy
+	bool		mTls{ false };				// The connection is encrypted
+	bool		mKernelTlsSend{ false };	// The kernel encrypts what we send (kTLS)
+	bool		mKernelTlsReceive{ false };	// The kernel decrypts what we receive (kTLS)
+	LatencyStats	mDispatch;				// Time the callback spent on sampled messages, in nanoseconds; see WebSocket::setDispatchTiming
+};
+
+// When queued frames are written to the socket; see WebSocket::setSendPolicy.
+// Only applies to byte stream transports; shared memory always sends each message right away.
+enum class SendPolicy : uint32_t
+{
+	ON_POLL,		// Frames queue until the next poll, which writes them all in one send (the default)
+	IMMEDIATE,		// Each frame is written as soon as it is sent; lowest latency, one send per frame
+	COALESCE,		// Frames queue until enough bytes are waiting or the oldest has waited long enough
+};
+
+// The most work a single call to WebSocket::poll may do; zero means unlimited.
+// With many connections on one thread, a budget stops one busy connection from holding up the rest:
+// poll stops at the budget, hasPendingWork reports it, and the caller comes back after polling the others.
+struct PollBudget
+{
+	uint32_t	mReadBytes{ 0 };		// Bytes read from the socket
+	uint32_t	mDispatchFrames{ 0 };	// Data frames handed to the callback
+	uint32_t	mWriteBytes{ 0 };		// Bytes written to the socket
+};
+
+// Deadlines kept for a connection on a TimerWheel (see TimerWheel.h); zero turns each one off.
+struct Timeouts
+{
+	uint32_t	mHandshakeMilliseconds{ 0 };	// Drop the connection if the handshake hasn't completed in this long
+	uint32_t	mPingIntervalMilliseconds{ 0 };	// Send a timestamped ping this often; each pong is a LatencyStats sample
+	uint32_t	mPongMilliseconds{ 0 };			// Drop the connection, and tell the callback, if a ping gets no pong in this long
+	uint32_t	mIdleMilliseconds{ 0 };			// Close when no message has been sent or received for this long
+	uint32_t	mCloseMilliseconds{ 0 };		// Drop the socket if a closing connection can't send its close frame in this long
+};
+
+// Token bucket limits on a connection's traffic; zero means unlimited.
+// Limits apply inside poll: sends beyond them stay queued and unread data stays in the socket, where
+// TCP flow control pushes back on the peer. Only byte stream transports are limited.
+struct RateLimit
+{
+	uint32_t	mSendBytesPerSecond{ 0 };
+	uint32_t	mSendMessagesPerSecond{ 0 };
+	uint32_t	mReceiveBytesPerSecond{ 0 };
+	uint32_t	mReceiveMessagesPerSecond{ 0 };
+	uint32_t	mBurstMilliseconds{ 1000 };		// Allowance an idle connection may save up
+};
+
+// Limits shared by a group of connections, such as every connection of one tenant or the subscribers
+// of one topic. Each connection in the group is held to both its own limits and the group's.
+// Thread safe, so the members may be polled from different threads.
+class RateLimitGroup
+{
+public:
+	static RateLimitGroup *create(const RateLimit &limit);
+
+	// Connections hold a reference while they are members
+	virtual void addRef(void) = 0;
+	virtual void release(void) = 0;
+
+protected:
+	virtual ~RateLimitGroup(void)
+	{
+	}
+};
+
+// A complete text or binary frame, encoded (and masked) once so the same bytes can be queued on any number
+// of connections with WebSocket::sendFrame. It is immutable and reference counted; each connection holds a
+// reference until the frame has been written, so release your own as soon as you have queued it.
+class PreparedFrame
+{
+public:
+	// Encodes this message; 'useMask' should match the connections it will be sent on
+	static PreparedFrame *create(const void *data, uint32_t dataLen, bool isAscii, bool useMask = false);
+
+	// Reference counting is thread safe, so a frame may be shared by connections polled from different threads
+	virtual void addRef(void) = 0;
+	virtual void release(void) = 0;
+
+	// The encoded frame; header followed by the payload
+	virtual const uint8_t *getFrame(uint32_t &frameLen) const = 0;
+
+	// The payload as it was given to 'create', before masking
+	virtual const uint8_t *getPayload(uint32_t &payloadLen) const = 0;
+
+	virtual bool isAscii(void) const = 0;
+	virtual bool isMasked(void) const = 0;
+
+protected:
+	virtual ~PreparedFrame(void)
+	{
+	}
 };
 
 class WebSocket 
@@ -35,9 +193,12 @@ public:
 
 	// Factor method to create an instance of the websockets client
 	// 'url' is the URL we are connecting to.
+	// 'ws+unix:///path/to/socket' connects to a Unix domain socket on the same host
+	// 'wss://' connects with TLS when built with OpenSSL
 	// 'origin' is the optional origin
 	// useMask should be true, it mildly XOR encrypts all messages
-	static WebSocket *create(const char *url, const char *origin="",bool useMask=true);
+	// 'options' optionally provides per connection socket settings (see wsocket.h)
+	static WebSocket *create(const char *url, const char *origin="",bool useMask=true,const wsocket::SocketOptions *options=nullptr);
 
 	// Create call for the server when a new client connection is established
 	static WebSocket *create(wsocket::Wsocket *clientSocket, bool useMask = true);
@@ -62,12 +223,62 @@ public:
 	// Send a binary message with explicit length provided.
 	virtual void sendBinary(const void *data,uint32_t dataLen) = 0;
 
-	// Ping the server
+	// Queues a frame prepared with PreparedFrame::create by reference, without copying it
+	virtual void sendFrame(PreparedFrame *frame) = 0;
+
+	// Sends a state update which is superseded by the next one with the same key. Conflated messages
+	// wait until everything queued before them has been written to the socket; until then a newer
+	// message replaces the unsent one for its key, keeping its place in line. A reader which keeps up
+	// gets every message, and a slow one gets the latest per key while memory stays bounded by the keys.
+	// Shared memory transports send every message.
+	virtual void sendConflated(uint64_t key, const void *data, uint32_t dataLen, bool isAscii) = 0;
+
+	// Ping the server. The payload carries the time sent, so the pong adds a LatencyStats sample.
 	virtual void sendPing() = 0;
 
-	// Close the connection
+	// Round trip times of this connection's pings; see Timeouts::mPingIntervalMilliseconds to send them automatically.
+	// Like getStats, getLatencyStats may be called from any thread; reset from the polling thread.
+	virtual void getLatencyStats(LatencyStats &stats) const = 0;
+	virtual void resetLatencyStats(void) = 0;
+
+	// Close the connection. One which is still CONNECTING is dropped at once and goes straight to CLOSED.
 	virtual void close() = 0;
 
+	// Chooses when queued frames are written to the socket.
+	// With COALESCE, frames are held until 'coalesceBytes' are waiting or the oldest has waited
+	// 'coalesceMicroseconds' (checked on each poll), so many tiny messages become a few large sends.
+	virtual void setSendPolicy(SendPolicy policy, uint32_t coalesceBytes = 0, uint32_t coalesceMicroseconds = 0) = 0;
+
+	// Arms the Timeouts on 'wheel', which is shared by the connections on one thread; the caller updates
+	// it once per pass of its polling loop and keeps it alive until the connections are deleted.
+	// With no wheel the connection keeps its own, updated on each poll.
+	virtual void setTimeouts(const Timeouts &timeouts, timerwheel::TimerWheel *wheel = nullptr) = 0;
+
+	// Limits the work done by each poll; see PollBudget
+	virtual void setPollBudget(const PollBudget &budget) = 0;
+
+	// Times one in every 'sampleInterval' messages handed to the callback, for WebSocketStats::mDispatch.
+	// Zero, the default, turns it off; each timed message costs two clock reads.
+	virtual void setDispatchTiming(uint32_t sampleInterval) = 0;
+
+	// True if the last poll stopped at its budget, so polling again soon will find more to do
+	virtual bool hasPendingWork(void) const = 0;
+
+	// Sets this connection's own rate limits; see RateLimit
+	virtual void setRateLimit(const RateLimit &limit) = 0;
+
+	// Makes the connection a member of this group, or of no group if null
+	virtual void setRateLimitGroup(RateLimitGroup *group) = 0;
+
+	// Writes every queued frame to the socket now, whatever the send policy (rate limits still apply)
+	virtual void flush(void) = 0;
+
+	// While corked nothing is written, whatever the send policy, and the socket is told to hold partial
+	// packets (TCP_CORK) so a burst of frames leaves in as few packets as possible. 'uncork' sends everything.
+	// Closing the connection uncorks it.
+	virtual void cork(void) = 0;
+	virtual void uncork(void) = 0;
+
 	// Retreive the current state of the connection
 	virtual ReadyStateValues getReadyState() const = 0;
 
@@ -80,12 +291,51 @@ public:
 	// Maximum size of the buffer
 	virtual uint32_t getTransmitBufferMaxSize(void) const = 0;
 
+	// Copies the connection's counters. Safe to call from any thread while another polls the connection;
+	// each counter is read on its own, so the copy isn't one consistent instant.
+	virtual void getStats(WebSocketStats &stats) const = 0;
+
+	// Samples the kernel's TCP statistics for the connection: round trip time, congestion window,
+	// retransmits, unacknowledged data and delivery rate. Returns false for transports without them.
+	virtual bool getTransportInfo(wsocket::TransportInfo &info) const = 0;
+
     // Log all sends and receives
     virtual bool setLogFile(const char *fileName) = 0;
 
 
 };
 
+// Connections which have been closed and let go of by their owner, finishing their close in the background.
+// Deleting a WebSocket never waits: it makes one attempt to write its close frame and anything queued before it.
+// A connection added here instead keeps being polled until that has all been written or its grace period ends.
+// Not thread safe; poll it from the thread which polled the connections.
+class ClosingSet
+{
+public:
+	static ClosingSet *create(uint32_t graceMilliseconds = 1000);
+
+	// Closes the connection and takes ownership of it
+	virtual void add(WebSocket *connection) = 0;
+
+	// Polls every closing connection and deletes the ones which are done or out of time.
+	// Returns the number still closing.
+	virtual uint32_t poll(void) = 0;
+
+	// Number of connections still closing
+	virtual uint32_t getCount(void) const = 0;
+
+	// Connections deleted before they had finished closing
+	virtual uint64_t getDroppedCount(void) const = 0;
+
+	// Deletes every connection left, finished or not
+	virtual void release(void) = 0;
+
+protected:
+	virtual ~ClosingSet(void)
+	{
+	}
+};
+
 // Initialize sockets one time for your app.
 void socketStartup(void);
 
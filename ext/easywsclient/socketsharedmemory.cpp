@@ -3,48 +3,103 @@
 #include "MemoryMap.h"
 #include "wplatform.h"
 #include "SPSC.h"
+#include "MPSC.h"
+#include "Timer.h"
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
 
 #ifdef _MSC_VER
 #pragma warning(disable:4100)
 #endif
 
-#define SHARED_BUFFER_SIZE (1024*16)
+// Each direction of the connection is a ring in its own memory mapped file
+#ifdef _MSC_VER
+#define SHARED_MEMORY_PATH "f:\\@%s.%d.cache"
+#else
+#define SHARED_MEMORY_PATH "/dev/shm/@%s.%d.cache"
+#define HUGE_PAGE_PATH "/dev/hugepages/@%s.%d.cache"	// hugetlbfs mount; every page here is a huge page
+#endif
+#define HUGE_PAGE_SIZE (1024*1024*2)
+
+#define ATTACH_TIME_OUT 5				// seconds a client waits for the server to accept it
+#define LIVENESS_CHECK_INTERVAL 0.25	// seconds between checks that the peer process is still running
+#define HEARTBEAT_INTERVAL 0.1			// seconds between updates of our heartbeat counter
 
 namespace wsocket
 {
 
-class WsocketSharedMemory : public Wsocket
+const uint32_t cControlVersion = 100;
+
+// Lives at the start of the server ring file and tracks who is attached to the connection.
+// The server and the client each only write their own half, which are on separate cache lines.
+// A 'generation' identifies one attached client; it changes every time the server resets the rings for a new one.
+struct ControlBlock
+{
+	std::atomic<uint32_t>	mVersionNumber;
+	std::atomic<uint32_t>	mGeneration;		// Set by the server to acknowledge an attach request, once the rings are reset
+	std::atomic<uint32_t>	mServerPid;			// Process id of the server; zero once it has shut down
+	std::atomic<uint32_t>	mServerHeartbeat;	// Incremented periodically while the server is polling
+	std::atomic<uint32_t>	mServerClosed;		// The last generation the server closed
+	alignas(64) std::atomic<uint32_t>	mAttachRequest;	// Incremented by a client asking to attach
+	std::atomic<uint32_t>	mClientPid;			// Process id of the attached client; zero if none
+	std::atomic<uint32_t>	mClientHeartbeat;	// Incremented periodically while the client is polling
+	std::atomic<uint32_t>	mClientClosed;		// The last generation the client closed
+};
+
+// The memory mapped files for one shared memory port.
+// Shared by the listening server socket and every connection made through it, and released with the last one.
+class SharedMemoryRings
 {
 public:
-	WsocketSharedMemory(const char *hostName,int32_t port)
+	SharedMemoryRings(bool isServer,int32_t port,const SocketOptions &options)
 	{
-		mIsServer = strcmp(hostName, SHARED_SERVER) == 0;
-		char scratch[512];
-		wplatform::stringFormat(scratch, 512, "f:\\@sharedserver.%d.cache", port);
-		uint64_t fsize = SHARED_BUFFER_SIZE;
-		mServerFile = memorymap::MemoryMap::createMemoryMap(scratch, fsize, mIsServer, false);
-		wplatform::stringFormat(scratch, 512, "f:\\@sharedclient.%d.cache", port);
-		fsize = SHARED_BUFFER_SIZE;
-		mClientFile = memorymap::MemoryMap::createMemoryMap(scratch, fsize, mIsServer, false);
-		if (mServerFile && mClientFile)
-		{
-			// If I'm the server, then I write to the server file and read from the client file
+		mIsServer = isServer;
+		mMultiProducer = options.mSharedMemoryMultiProducer;
+		uint32_t ringSize = options.mSharedMemoryRingSize;
+		bool hugePages = options.mSharedMemoryHugePages && ringSize >= HUGE_PAGE_SIZE;
+		if (hugePages)
+		{
+			// Round up the same way the memory map does, so both sides agree on the size
+			ringSize = (ringSize + HUGE_PAGE_SIZE - 1) & ~uint32_t(HUGE_PAGE_SIZE - 1);
+		}
+		mServerFile = openRing(SHARED_SERVER, port, ringSize, hugePages, mServerPath);
+		if (mServerFile)
+		{
+			mClientFile = openRing(SHARED_CLIENT, port, ringSize, hugePages, mClientPath);
+		}
+		if (mServerFile && mClientFile && mServerFile->getFileSize() > sizeof(ControlBlock))
+		{
+			uint8_t *serverBase = (uint8_t *)mServerFile->getBaseAddress();
+			mControl = (ControlBlock *)serverBase;
+			mServerRing = serverBase + sizeof(ControlBlock);
+			mServerRingSize = uint32_t(mServerFile->getFileSize()) - uint32_t(sizeof(ControlBlock));
+			mClientRing = mClientFile->getBaseAddress();
+			mClientRingSize = uint32_t(mClientFile->getFileSize());
 			if (mIsServer)
 			{
-				mWriter.init(mServerFile->getBaseAddress(), uint32_t(mServerFile->getFileSize()), true,true);
-				mReader.init(mClientFile->getBaseAddress(), uint32_t(mClientFile->getFileSize()), false,true);
+				mControl->mVersionNumber = cControlVersion;
+				mControl->mGeneration = 0;
+				mControl->mServerHeartbeat = 0;
+				mControl->mServerClosed = 0;
+				mControl->mAttachRequest = 0;
+				mControl->mClientPid = 0;
+				mControl->mClientHeartbeat = 0;
+				mControl->mClientClosed = 0;
+				resetRings();
+				mControl->mServerPid.store(wplatform::getProcessId(), std::memory_order_release);
 			}
-			else
+			else if (ringSize)
 			{
-				// If I am a client..then I write to the client file and read from the server file
-				mWriter.init(mClientFile->getBaseAddress(), uint32_t(mClientFile->getFileSize()), true,false);
-				mReader.init(mServerFile->getBaseAddress(), uint32_t(mServerFile->getFileSize()), false,false);
-				mWriter.incrementSequenceNumber();
+				// If the client asked for a specific size, the ring headers written by the server must match it.
+				// Otherwise we use whatever size the server created.
+				mServerRingSize = ringSize <= mServerRingSize + sizeof(ControlBlock) ? ringSize - uint32_t(sizeof(ControlBlock)) : 0;
+				mClientRingSize = ringSize <= mClientRingSize ? ringSize : 0;
 			}
 		}
 	}
 
-	virtual ~WsocketSharedMemory(void)
+	~SharedMemoryRings(void)
 	{
 		if (mClientFile)
 		{
@@ -56,52 +111,317 @@ public:
 		}
 	}
 
-	// If we are a server, we poll for new connections.
-	// If a new connection is found, then we return an instance of a Wsocket with that connection.
-	// It is the caller's responsibility to release it when finished
-	virtual Wsocket *pollServer(void) override final
+	// The server creates the ring file, clients open the existing one.
+	memorymap::MemoryMap *openRing(const char *name,int32_t port,uint32_t ringSize,bool hugePages,char *fileName)
 	{
-		Wsocket *ret = nullptr;
-
+		memorymap::MemoryMap *ret = nullptr;
+		char scratch[512];
+		uint64_t fsize = ringSize;
+		wplatform::stringFormat(scratch, 512, SHARED_MEMORY_PATH, name, port);
+#ifdef HUGE_PAGE_PATH
+		char hugeScratch[512];
+		wplatform::stringFormat(hugeScratch, 512, HUGE_PAGE_PATH, name, port);
 		if (mIsServer)
 		{
-			if (mReader.getSequenceNumber() != mSequenceNumber)
+			if (isOwnedByLiveServer(name, hugeScratch) || isOwnedByLiveServer(name, scratch))
 			{
-				if (mFirst)
+				return nullptr;
+			}
+			// Always start from a new file. Clients of a previous server keep their mapping of the old one,
+			// rather than seeing it truncated underneath them, and find out the server is gone.
+			remove(scratch);
+			remove(hugeScratch);
+			if (hugePages)
+			{
+				ret = memorymap::MemoryMap::createMemoryMap(hugeScratch, fsize, true, false, true);
+			}
+		}
+		else
+		{
+			ret = memorymap::MemoryMap::createMemoryMap(hugeScratch, fsize, false, false);
+		}
+		if (ret)
+		{
+			strncpy(fileName, hugeScratch, 512);
+			return ret;
+		}
+		fsize = ringSize;
+#else
+		if (mIsServer)
+		{
+			if (isOwnedByLiveServer(name, scratch))
+			{
+				return nullptr;
+			}
+			remove(scratch);
+		}
+#endif
+		ret = memorymap::MemoryMap::createMemoryMap(scratch, fsize, mIsServer, false, hugePages);
+		strncpy(fileName, scratch, 512);
+		return ret;
+	}
+
+	// Returns true if 'fileName' is the server ring of a server which is still running.
+	// Like binding a port which is in use, a second server on the same port has to fail rather than take it over.
+	bool isOwnedByLiveServer(const char *name,const char *fileName)
+	{
+		bool ret = false;
+
+		if (strcmp(name, SHARED_SERVER) == 0)
+		{
+			uint64_t fsize = 0;
+			memorymap::MemoryMap *m = memorymap::MemoryMap::createMemoryMap(fileName, fsize, false, true);
+			if (m)
+			{
+				if (m->getFileSize() >= sizeof(ControlBlock))
 				{
-					mSequenceNumber = mReader.getSequenceNumber();
-					mFirst = false;
-					ret = this;
+					const ControlBlock *control = (const ControlBlock *)m->getBaseAddress();
+					uint32_t serverPid = control->mServerPid.load(std::memory_order_acquire);
+					if (control->mVersionNumber.load(std::memory_order_acquire) == cControlVersion && wplatform::isProcessAlive(serverPid))
+					{
+						fprintf(stderr, "ERROR: shared memory port is already in use by process %d\n", serverPid);
+						ret = true;
+					}
 				}
+				m->release();
 			}
 		}
 
 		return ret;
 	}
 
+	// Puts both ring headers back into their initial, empty, state
+	void resetRings(void)
+	{
+		spsc::SPSC serverRing;
+		serverRing.init(mServerRing, mServerRingSize, true, true);
+		if (mMultiProducer)
+		{
+			mpsc::MPSC clientRing;
+			clientRing.init(mClientRing, mClientRingSize, false, true);
+		}
+		else
+		{
+			spsc::SPSC clientRing;
+			clientRing.init(mClientRing, mClientRingSize, false, true);
+		}
+	}
+
+	// Asks the server to reset the rings for us; the connection polls for it to do so.
+	// Returns the generation the connection will have once accepted, or zero if we could not ask.
+	uint32_t requestAttach(void)
+	{
+		if (mControl->mVersionNumber != cControlVersion || !wplatform::isProcessAlive(mControl->mServerPid))
+		{
+			fprintf(stderr, "ERROR: shared memory server is not running\n");
+			return 0;
+		}
+		// Claim the client side of the connection. A client which died without releasing it doesn't count.
+		uint32_t myPid = wplatform::getProcessId();
+		uint32_t currentPid = mControl->mClientPid.load(std::memory_order_acquire);
+		if (currentPid && currentPid != myPid && wplatform::isProcessAlive(currentPid))
+		{
+			fprintf(stderr, "ERROR: shared memory server already has a client attached\n");
+			return 0;
+		}
+		if (!mControl->mClientPid.compare_exchange_strong(currentPid, myPid))
+		{
+			return 0;
+		}
+		return mControl->mAttachRequest.fetch_add(1) + 1;
+	}
+
+	// Removes the ring files; anyone who still has them mapped keeps their mapping
+	void removeFiles(void)
+	{
+		remove(mServerPath);
+		remove(mClientPath);
+	}
+
+	bool isValid(void) const
+	{
+		return mControl != nullptr;
+	}
+
+	void addRef(void)
+	{
+		mRefCount++;
+	}
+
+	void release(void)
+	{
+		if (--mRefCount == 0)
+		{
+			delete this;
+		}
+	}
+
+	bool					mIsServer{ false };
+	bool					mMultiProducer{ false };	// The client to server ring accepts writes from many threads/processes
+	std::atomic<uint32_t>	mRefCount{ 1 };
+	ControlBlock			*mControl{ nullptr };
+	void					*mServerRing{ nullptr };	// Server to client ring, after the control block
+	uint32_t				mServerRingSize{ 0 };
+	void					*mClientRing{ nullptr };	// Client to server ring
+	uint32_t				mClientRingSize{ 0 };
+	memorymap::MemoryMap	*mServerFile{ nullptr };
+	memorymap::MemoryMap	*mClientFile{ nullptr };
+	char					mServerPath[512]{};
+	char					mClientPath[512]{};
+};
+
+// One end of a shared memory connection; either the client or the server's connection to it.
+class WsocketSharedMemory : public Wsocket
+{
+public:
+	WsocketSharedMemory(SharedMemoryRings *rings,bool isServer,uint32_t generation,const SocketOptions &options)
+	{
+		mRings = rings;
+		mRings->addRef();
+		mControl = rings->mControl;
+		mIsServer = isServer;
+		mGeneration = generation;
+		mMultiProducer = rings->mMultiProducer;
+		mHeartbeatTimeout = options.mSharedMemoryHeartbeatTimeout;
+		if (mIsServer)
+		{
+			initRings();
+		}
+		else
+		{
+			// The rings are ours once the server has reset them for this generation; see 'pollConnect'
+			mAttaching = true;
+		}
+	}
+
+	// Binds the ring readers and writers to the rings; the client waits until it has been accepted
+	void initRings(void)
+	{
+		SharedMemoryRings *rings = mRings;
+		// If I'm the server, then I write to the server ring and read from the client ring
+		if (mIsServer)
+		{
+			mRingsValid = mWriter.init(rings->mServerRing, rings->mServerRingSize, true, false);
+			if (mMultiProducer)
+			{
+				mRingsValid = mRingsValid && mMultiReader.init(rings->mClientRing, rings->mClientRingSize, false, false);
+			}
+			else
+			{
+				mRingsValid = mRingsValid && mReader.init(rings->mClientRing, rings->mClientRingSize, false, false);
+			}
+		}
+		else
+		{
+			// If I am a client..then I write to the client ring and read from the server ring
+			if (mMultiProducer)
+			{
+				mRingsValid = mMultiWriter.init(rings->mClientRing, rings->mClientRingSize, true, false);
+			}
+			else
+			{
+				mRingsValid = mWriter.init(rings->mClientRing, rings->mClientRingSize, true, false);
+			}
+			mRingsValid = mRingsValid && mReader.init(rings->mServerRing, rings->mServerRingSize, false, false);
+			if (!mRingsValid)
+			{
+				fprintf(stderr, "ERROR: shared memory ring size does not match the server\n");
+			}
+		}
+	}
+
+	virtual ~WsocketSharedMemory(void)
+	{
+		close();
+		if (!mIsServer && (mAttaching || mControl->mGeneration.load(std::memory_order_acquire) == mGeneration))
+		{
+			// Let the next client attach
+			uint32_t myPid = wplatform::getProcessId();
+			mControl->mClientPid.compare_exchange_strong(myPid, 0);
+		}
+		mRings->release();
+	}
+
+	// Only the listening socket accepts connections
+	virtual Wsocket *pollServer(void) override final
+	{
+		return nullptr;
+	}
+
+	// A client is IN_PROGRESS until the server resets the rings for it, which happens the next time
+	// the server polls. It fails if the server exits or doesn't get to it in time.
+	virtual ConnectStatus pollConnect(void) override final
+	{
+		if (mAttaching)
+		{
+			if (mControl->mGeneration.load(std::memory_order_acquire) == mGeneration)
+			{
+				mAttaching = false;
+				initRings();
+				if (!mRingsValid)
+				{
+					close();
+				}
+			}
+			else if (mAttachTimer.peekElapsedSeconds() >= ATTACH_TIME_OUT || !wplatform::isProcessAlive(mControl->mServerPid))
+			{
+				fprintf(stderr, "ERROR: shared memory server did not accept the connection\n");
+				mAttaching = false;
+				mClosed = true;
+				uint32_t myPid = wplatform::getProcessId();
+				mControl->mClientPid.compare_exchange_strong(myPid, 0);
+			}
+			else
+			{
+				heartbeat();
+				return ConnectStatus::IN_PROGRESS;
+			}
+		}
+		return mRingsValid ? ConnectStatus::CONNECTED : ConnectStatus::FAILED;
+	}
+
 	// performs the select operation on this socket
 	virtual void select(int32_t timeOut, size_t txBufSize) override final
 	{
 		// nothing to do here...
 	}
 
-	// Performs a general select on no specific socket 
+	// Performs a general select on no specific socket
 	virtual void nullSelect(int32_t timeOut) override final
 	{
 		// nothing to do here
 	}
 
-	// Receive data from the socket connection.  
+	// Receive data from the socket connection.
 	// A return code of -1 means no data received.
 	// A return code >0 is number of bytes received.
+	// The rings are message based; this byte stream view is only used for the connection handshake
 	virtual int32_t receive(void *dest, uint32_t maxLen) override final
 	{
 		int32_t ret = -1;
 
-		uint32_t rcount = mReader.read(dest, maxLen);
-		if (rcount > 0)
+		heartbeat();
+		uint32_t len;
+		uint32_t type;
+		const uint8_t *data = isCurrent() ? readerPeek(len, type) : nullptr;
+		if (data)
 		{
-			ret = int32_t(rcount);
+			uint32_t rcount = len - mReadOffset;
+			if (rcount > maxLen)
+			{
+				rcount = maxLen;
+			}
+			memcpy(dest, data + mReadOffset, rcount);
+			mReadOffset += rcount;
+			if (mReadOffset == len)
+			{
+				readerRelease();
+				mReadOffset = 0;
+			}
+			if (rcount > 0)
+			{
+				ret = int32_t(rcount);
+			}
 		}
 
 		return ret;
@@ -112,35 +432,104 @@ public:
 	{
 		int32_t ret = -1;
 
-		uint32_t scount = mWriter.write(data, dataLen);
-		if (scount > 0)
+		if (!mAttaching && isPeerAlive())
 		{
-			ret = int32_t(scount);
+			uint32_t maxSize = writerMaxMessageSize();
+			if (dataLen > maxSize)
+			{
+				dataLen = maxSize;
+			}
+			if (writerWrite(data, dataLen, 0))
+			{
+				ret = int32_t(dataLen);
+			}
 		}
 
 		return ret;
 	}
 
-	// Close the socket
+	virtual bool isMessageBased(void) const override final
+	{
+		return true;
+	}
+
+	virtual bool sendMessage(const void *data, uint32_t dataLen, uint32_t messageType) override final
+	{
+		if (!isCurrent())
+		{
+			return false;
+		}
+		if (dataLen > writerMaxMessageSize())
+		{
+			// This can never fit in the ring, so drop it rather than stall the connection forever
+			fprintf(stderr, "ERROR: message of %d bytes exceeds the shared memory ring size\n", dataLen);
+			return true;
+		}
+		return writerWrite(data, dataLen, messageType);
+	}
+
+	virtual const void *peekMessage(uint32_t &dataLen, uint32_t &messageType) override final
+	{
+		heartbeat();
+		return isCurrent() ? readerPeek(dataLen, messageType) : nullptr;
+	}
+
+	virtual void releaseMessage(void) override final
+	{
+		readerRelease();
+	}
+
+	// The client to server ring is either single producer or, if requested, multiple producer.
+	// These hide which one is in use.
+	inline const uint8_t *readerPeek(uint32_t &len, uint32_t &type)
+	{
+		return (mMultiProducer && mIsServer) ? mMultiReader.peek(len, type) : mReader.peek(len, type);
+	}
+
+	inline void readerRelease(void)
+	{
+		if (mMultiProducer && mIsServer)
+		{
+			mMultiReader.release();
+		}
+		else
+		{
+			mReader.release();
+		}
+	}
+
+	inline bool writerWrite(const void *data, uint32_t len, uint32_t type)
+	{
+		return (mMultiProducer && !mIsServer) ? mMultiWriter.writeMessage(data, len, type) : mWriter.writeMessage(data, len, type);
+	}
+
+	inline uint32_t writerMaxMessageSize(void) const
+	{
+		return (mMultiProducer && !mIsServer) ? mMultiWriter.getMaxMessageSize() : mWriter.getMaxMessageSize();
+	}
+
+	// Close the socket; the peer sees the connection as closed
 	virtual void	close(void) override final
 	{
-		// don't do anything in particular yet...
+		if (isCurrent())
+		{
+			(mIsServer ? mControl->mServerClosed : mControl->mClientClosed).store(mGeneration, std::memory_order_release);
+		}
+		mClosed = true;
 	}
 
 	// Returns true if the socket send 'would block'
+	// Once the peer has closed, crashed, or been replaced by a new client this returns false,
+	// which tells the caller the connection is gone.
 	virtual bool	wouldBlock(void) override final
 	{
-		bool ret = true;
-
-		return ret;
+		return mAttaching || isPeerAlive();
 	}
 
-	// Returns true if a socket send is currently 'in progress'
+	// Returns true if a socket send is currently 'in progress'; a client is until the server accepts it
 	virtual bool	inProgress(void) override final
 	{
-		bool ret = false;
-
-		return ret;
+		return mAttaching;
 	}
 
 	// Not sure what this is, but it's in the original code so making it available now.
@@ -157,32 +546,242 @@ public:
 
 	bool isValid(void) const
 	{
-		bool ret = false;
-		if (mServerFile && mClientFile)
+		return mRingsValid;
+	}
+
+	// Returns true if the rings still belong to this connection
+	inline bool isCurrent(void) const
+	{
+		return !mClosed && mControl->mGeneration.load(std::memory_order_acquire) == mGeneration;
+	}
+
+	// Let the peer know we are still running
+	inline void heartbeat(void)
+	{
+		if (mHeartbeatTimer.peekElapsedSeconds() >= HEARTBEAT_INTERVAL)
 		{
-			ret = true;
+			mHeartbeatTimer.reset();
+			(mIsServer ? mControl->mServerHeartbeat : mControl->mClientHeartbeat).fetch_add(1, std::memory_order_relaxed);
 		}
-		return ret;
 	}
 
-	bool					mFirst{ true };
-	uint32_t				mSequenceNumber{ 0 };
+	// Returns false once the peer has closed the connection, its process has exited,
+	// it has stopped updating its heartbeat, or the server has reset the rings for a new client.
+	bool isPeerAlive(void)
+	{
+		if (mPeerClosed)
+		{
+			return false;
+		}
+		if (!isCurrent())
+		{
+			mPeerClosed = true;
+		}
+		else if ((mIsServer ? mControl->mClientClosed : mControl->mServerClosed).load(std::memory_order_acquire) == mGeneration)
+		{
+			mPeerClosed = true;
+		}
+		else if (mLivenessTimer.peekElapsedSeconds() >= LIVENESS_CHECK_INTERVAL)
+		{
+			mLivenessTimer.reset();
+			uint32_t peerPid = (mIsServer ? mControl->mClientPid : mControl->mServerPid).load(std::memory_order_acquire);
+			if (!wplatform::isProcessAlive(peerPid))
+			{
+				mPeerClosed = true;
+			}
+			else if (mHeartbeatTimeout)
+			{
+				uint32_t peerHeartbeat = (mIsServer ? mControl->mClientHeartbeat : mControl->mServerHeartbeat).load(std::memory_order_relaxed);
+				if (peerHeartbeat != mPeerHeartbeat)
+				{
+					mPeerHeartbeat = peerHeartbeat;
+					mPeerHeartbeatTimer.reset();
+				}
+				else if (mPeerHeartbeatTimer.peekElapsedSeconds() * 1000 >= mHeartbeatTimeout)
+				{
+					mPeerClosed = true;
+				}
+			}
+		}
+		return !mPeerClosed;
+	}
+
+	uint32_t				mReadOffset{ 0 };		// How much of the current message has been consumed by 'receive'
 	bool					mIsServer{ false };
+	bool					mRingsValid{ false };	// Both ring headers matched what the server created
+	bool					mMultiProducer{ false };	// The client to server ring accepts writes from many threads/processes
+	bool					mClosed{ false };		// We closed the connection
+	bool					mPeerClosed{ false };	// The peer is gone; sticky once set
+	bool					mAttaching{ false };	// A client waiting for the server to accept it
+	uint32_t				mGeneration{ 0 };		// Identifies this connection in the control block
+	uint32_t				mHeartbeatTimeout{ 0 };	// Milliseconds without a peer heartbeat before we give up on it
+	uint32_t				mPeerHeartbeat{ 0 };	// Last peer heartbeat value we saw
+	timer::Timer			mHeartbeatTimer;		// Time since we last updated our own heartbeat
+	timer::Timer			mPeerHeartbeatTimer;	// Time since the peer heartbeat last changed
+	timer::Timer			mLivenessTimer;			// Time since we last checked the peer process
+	timer::Timer			mAttachTimer;			// Time since the client asked to attach
 	spsc::SPSC				mReader;
 	spsc::SPSC				mWriter;
-	bool					mOwnClientServerFiles{ true };
-	memorymap::MemoryMap	*mServerFile{ nullptr };
-	memorymap::MemoryMap	*mClientFile{ nullptr };
+	mpsc::MPSC				mMultiReader;				// Server side of a multiple producer client ring
+	mpsc::MPSC				mMultiWriter;				// Client side of a multiple producer client ring
+	ControlBlock			*mControl{ nullptr };
+	SharedMemoryRings		*mRings{ nullptr };
+};
+
+// The listening side of a shared memory port.
+// Each time a client attaches, the rings are reset and a new connection is returned from 'pollServer'.
+class WsocketSharedMemoryServer : public Wsocket
+{
+public:
+	WsocketSharedMemoryServer(int32_t port,const SocketOptions &options) : mOptions(options)
+	{
+		mRings = new SharedMemoryRings(true, port, options);
+		if (!mRings->isValid())
+		{
+			mRings->release();
+			mRings = nullptr;
+		}
+	}
+
+	virtual ~WsocketSharedMemoryServer(void)
+	{
+		if (mRings)
+		{
+			mRings->mControl->mServerPid.store(0, std::memory_order_release);
+			mRings->removeFiles();
+			mRings->release();
+		}
+	}
+
+	// If a client has asked to attach, reset the rings and return a new connection for it.
+	// A client which restarts simply attaches again; the previous connection sees itself as closed.
+	// It is the caller's responsibility to release it when finished
+	virtual Wsocket *pollServer(void) override final
+	{
+		Wsocket *ret = nullptr;
+
+		if (mRings)
+		{
+			ControlBlock *control = mRings->mControl;
+			if (mHeartbeatTimer.peekElapsedSeconds() >= HEARTBEAT_INTERVAL)
+			{
+				mHeartbeatTimer.reset();
+				control->mServerHeartbeat.fetch_add(1, std::memory_order_relaxed);
+			}
+			uint32_t request = control->mAttachRequest.load(std::memory_order_acquire);
+			if (request != control->mGeneration.load(std::memory_order_relaxed))
+			{
+				mRings->resetRings();
+				auto w = new WsocketSharedMemory(mRings, true, request, mOptions);
+				control->mGeneration.store(request, std::memory_order_release);
+				if (w->isValid())
+				{
+					ret = static_cast<Wsocket *>(w);
+				}
+				else
+				{
+					w->release();
+				}
+			}
+		}
+
+		return ret;
+	}
+
+	virtual void select(int32_t timeOut, size_t txBufSize) override final
+	{
+	}
+
+	virtual void nullSelect(int32_t timeOut) override final
+	{
+	}
+
+	virtual int32_t receive(void *dest, uint32_t maxLen) override final
+	{
+		return -1;
+	}
+
+	virtual int32_t send(const void *data, uint32_t dataLen) override final
+	{
+		return -1;
+	}
+
+	virtual void	close(void) override final
+	{
+	}
+
+	virtual bool	wouldBlock(void) override final
+	{
+		return true;
+	}
+
+	virtual bool	inProgress(void) override final
+	{
+		return false;
+	}
+
+	virtual void disableNaglesAlgorithm(void) override final
+	{
+	}
+
+	virtual bool isMessageBased(void) const override final
+	{
+		return true;
+	}
+
+	virtual bool sendMessage(const void *data, uint32_t dataLen, uint32_t messageType) override final
+	{
+		return false;
+	}
+
+	virtual const void *peekMessage(uint32_t &dataLen, uint32_t &messageType) override final
+	{
+		return nullptr;
+	}
+
+	virtual void releaseMessage(void) override final
+	{
+	}
+
+	virtual void release(void) override final
+	{
+		delete this;
+	}
+
+	bool isValid(void) const
+	{
+		return mRings != nullptr;
+	}
+
+	SocketOptions			mOptions;
+	timer::Timer			mHeartbeatTimer;		// Time since we last updated our heartbeat
+	SharedMemoryRings		*mRings{ nullptr };
 };
 
-Wsocket *createSocketSharedMemory(const char *hostName,int32_t port)
+Wsocket *createSocketSharedMemory(const char *hostName,int32_t port,const SocketOptions &options)
 {
-	auto ret = new WsocketSharedMemory(hostName, port);
-	if (!ret->isValid())
+	if (strcmp(hostName, SHARED_SERVER) == 0)
 	{
-		delete ret;
-		ret = nullptr;
+		auto ret = new WsocketSharedMemoryServer(port, options);
+		if (!ret->isValid())
+		{
+			delete ret;
+			ret = nullptr;
+		}
+		return static_cast<Wsocket *>(ret);
+	}
+	// A client has to be accepted by a running server before it can use the rings; see 'pollConnect'
+	auto rings = new SharedMemoryRings(false, port, options);
+	WsocketSharedMemory *ret = nullptr;
+	if (rings->isValid())
+	{
+		uint32_t generation = rings->requestAttach();
+		if (generation)
+		{
+			ret = new WsocketSharedMemory(rings, false, generation, options);
+		}
 	}
+	rings->release();
 	return static_cast<Wsocket *>(ret);
 }
 
@@ -6,7 +6,8 @@ namespace wsocket
 {
 
 class Wsocket;
+struct SocketOptions;
 
-Wsocket *createSocketSharedMemory(const char *hostName, int32_t port);
+Wsocket *createSocketSharedMemory(const char *hostName, int32_t port, const SocketOptions &options);
 
 }
@@ -18,4 +18,10 @@ namespace wplatform
 
 	void sleepNano(uint64_t nanoSeconds);
 
+	// Returns the id of the current process
+	uint32_t getProcessId(void);
+
+	// Returns true if a process with this id is still running
+	bool isProcessAlive(uint32_t processId);
+
 }
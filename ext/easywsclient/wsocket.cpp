@@ -1,7 +1,24 @@
 #include "wsocket.h"
 #include "wplatform.h"
 #include "socketsharedmemory.h"
+#include "DnsResolver.h"
+#include "Timer.h"
 #include <assert.h>
+#include <vector>
+#include <mutex>
+
+#ifndef USE_OPENSSL
+#define USE_OPENSSL 0
+#endif
+
+#if USE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#ifndef _WIN32
+#include <signal.h>
+#endif
+#endif
 
 #ifdef _MSC_VER
 #pragma warning(disable:4996)
@@ -45,16 +62,22 @@ typedef unsigned __int64 uint64_t;
 #define socketerrno WSAGetLastError()
 #define SOCKET_EAGAIN_EINPROGRESS WSAEINPROGRESS
 #define SOCKET_EWOULDBLOCK WSAEWOULDBLOCK
+#define SOCKET_CONNECT_PENDING WSAEWOULDBLOCK
+#define socketpoll WSAPoll
 #else
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdint.h>
 #ifndef _SOCKET_T_DEFINED
@@ -72,39 +95,203 @@ typedef int socket_t;
 #define socketerrno errno
 #define SOCKET_EAGAIN_EINPROGRESS EAGAIN
 #define SOCKET_EWOULDBLOCK EWOULDBLOCK
+#define SOCKET_CONNECT_PENDING EINPROGRESS
+#define socketpoll ::poll
 #endif
 
 #ifdef _MSC_VER
 #pragma warning(disable:4100)
 #endif
 
+// Writing to a connection the peer has closed must fail with an error rather than raise SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+#define MAX_CONNECT_ATTEMPTS 16	// Most connects to one host in flight at the same time
+#define MAX_SEND_BUFFERS 64		// Most buffers gathered into one sendv
+
 //#define SAVE_RECEIVE "f:\\SocketReceive.bin"
 //#define SAVE_SEND "f:\\SocketSend.bin"
 
-#define SHARED_SERVER "sharedserver"
-#define SHARED_CLIENT "sharedclient"
-
 namespace wsocket
 {
 
+#if defined(TCP_INFO) && defined(__linux__)
+// The kernel's tcp_info has grown well past the copy in <netinet/tcp.h>; this adds the fields we read
+// from newer kernels. <linux/tcp.h> can't be included next to <netinet/tcp.h>, so they are spelled out here.
+struct LinuxTcpInfo
+{
+	struct tcp_info	mInfo;
+	uint64_t	mPacingRate;
+	uint64_t	mMaxPacingRate;
+	uint64_t	mBytesAcked;
+	uint64_t	mBytesReceived;
+	uint32_t	mSegsOut;
+	uint32_t	mSegsIn;
+	uint32_t	mNotSentBytes;
+	uint32_t	mMinRtt;
+	uint32_t	mDataSegsIn;
+	uint32_t	mDataSegsOut;
+	uint64_t	mDeliveryRate;
+};
+#endif
+
+#if USE_OPENSSL
+// Prints the reason for the most recent OpenSSL failure
+static void printTlsError(const char *what)
+{
+	char reason[256];
+	unsigned long e = ERR_get_error();
+	ERR_error_string_n(e, reason, sizeof(reason));
+	fprintf(stderr, "ERROR: %s: %s\n", what, e ? reason : "unknown error");
+	ERR_clear_error();
+}
+
+// Creates the context shared by the TLS connections of one client configuration or one server
+static SSL_CTX *createTlsContext(const SocketOptions &options, bool isServer)
+{
+	SSL_CTX *ctx = SSL_CTX_new(isServer ? TLS_server_method() : TLS_client_method());
+	if (!ctx)
+	{
+		printTlsError("SSL_CTX_new");
+		return nullptr;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	bool ok = true;
+	if (isServer)
+	{
+		if (!options.mTlsCertificateFile || !options.mTlsPrivateKeyFile)
+		{
+			fprintf(stderr, "ERROR: a TLS server needs mTlsCertificateFile and mTlsPrivateKeyFile\n");
+			ok = false;
+		}
+		else if (SSL_CTX_use_certificate_chain_file(ctx, options.mTlsCertificateFile) != 1 ||
+			SSL_CTX_use_PrivateKey_file(ctx, options.mTlsPrivateKeyFile, SSL_FILETYPE_PEM) != 1)
+		{
+			printTlsError(options.mTlsCertificateFile);
+			ok = false;
+		}
+	}
+	else if (options.mTlsCaFile)
+	{
+		if (SSL_CTX_load_verify_locations(ctx, options.mTlsCaFile, nullptr) != 1)
+		{
+			printTlsError(options.mTlsCaFile);
+			ok = false;
+		}
+	}
+	else
+	{
+		SSL_CTX_set_default_verify_paths(ctx);
+	}
+	if (!ok)
+	{
+		SSL_CTX_free(ctx);
+		ctx = nullptr;
+	}
+	return ctx;
+}
+
+// Clients which trust the system's CA certificates all share one context, since creating one is slow
+static SSL_CTX *getDefaultClientContext(void)
+{
+	static std::mutex gMutex;
+	static SSL_CTX *gContext = nullptr;
+	std::lock_guard<std::mutex> lock(gMutex);
+	if (!gContext)
+	{
+		SocketOptions options;
+		gContext = createTlsContext(options, false);
+	}
+	if (gContext)
+	{
+		SSL_CTX_up_ref(gContext);
+	}
+	return gContext;
+}
+#endif
+
 class WsocketImpl : public Wsocket
 {
 public:
-	WsocketImpl(socket_t socket)
+	WsocketImpl(socket_t socket,bool isUnix,const SocketOptions &options) : mOptions(options)
 	{
 		mSocket = socket;
+		mIsUnix = isUnix;
+		applyOptions(mSocket);
 	}
 
-	WsocketImpl(const char *hostName, int32_t port)
+#if USE_OPENSSL
+	// A connection accepted by a TLS server; it is IN_PROGRESS until the TLS handshake completes
+	WsocketImpl(socket_t socket,const SocketOptions &options,SSL_CTX *serverContext) : mOptions(options)
+	{
+		mSocket = socket;
+		applyOptions(mSocket);
+		SSL_CTX_up_ref(serverContext);
+		mTlsContext = serverContext;
+		mConnectStatus = ConnectStatus::IN_PROGRESS;
+		startTls(false);
+	}
+#endif
+
+	WsocketImpl(const char *hostName, int32_t port, const SocketOptions &options) : mOptions(options)
 	{
-		if (strcmp(hostName, "server") == 0)
+		if (strcmp(hostName, SOCKET_SERVER) == 0)
 		{
-			mSocket = server_connect(port);
+			mSocket = server_connect(port, options.mReusePort);
 			mIsServer = true;
 		}
+		else if (strcmp(hostName, TLS_SERVER) == 0)
+		{
+			mIsServer = true;
+#if USE_OPENSSL
+			mTlsContext = createTlsContext(options, true);
+			if (mTlsContext)
+			{
+				mSocket = server_connect(port, options.mReusePort);
+			}
+#else
+			fprintf(stderr, "ERROR: TLS is not supported by this build\n");
+#endif
+		}
+		else if (strncmp(hostName, TLS_SOCKET_PREFIX, strlen(TLS_SOCKET_PREFIX)) == 0)
+		{
+#if USE_OPENSSL
+			hostName += strlen(TLS_SOCKET_PREFIX);
+			wplatform::stringFormat(mTlsHostName, sizeof(mTlsHostName), "%s", hostName);
+			mTlsContext = options.mTlsCaFile ? createTlsContext(options, false) : getDefaultClientContext();
+			if (mTlsContext)
+			{
+				mConnectAttemptDelay = options.mConnectAttemptDelay;
+				hostname_connect(hostName, port, options.mDnsCacheTime);
+			}
+			else
+			{
+				mConnectStatus = ConnectStatus::FAILED;
+			}
+#else
+			fprintf(stderr, "ERROR: TLS is not supported by this build\n");
+			mConnectStatus = ConnectStatus::FAILED;
+#endif
+		}
+		else if (strncmp(hostName, UNIX_SERVER_PREFIX, strlen(UNIX_SERVER_PREFIX)) == 0)
+		{
+			mIsUnix = true;
+			mIsServer = true;
+			mSocket = unix_server_connect(hostName + strlen(UNIX_SERVER_PREFIX));
+		}
+		else if (strncmp(hostName, UNIX_SOCKET_PREFIX, strlen(UNIX_SOCKET_PREFIX)) == 0)
+		{
+			mIsUnix = true;
+			mSocket = unix_connect(hostName + strlen(UNIX_SOCKET_PREFIX));
+		}
 		else
 		{
-			mSocket = hostname_connect(hostName, port);
+			mConnectAttemptDelay = options.mConnectAttemptDelay;
+			hostname_connect(hostName, port, options.mDnsCacheTime);
 		}
 #ifdef SAVE_RECEIVE
         mReceiveFile = fopen(SAVE_RECEIVE, "wb");
@@ -117,6 +304,23 @@ public:
 	virtual ~WsocketImpl(void)
 	{
 		close();
+		closeAttempts();
+		if (mLookup)
+		{
+			mLookup->release();
+		}
+#if USE_OPENSSL
+		if (mTlsContext)
+		{
+			SSL_CTX_free(mTlsContext);
+		}
+#endif
+#ifndef _WIN32
+		if (mIsServer && mIsUnix && mUnixPath[0])
+		{
+			unlink(mUnixPath); // the socket file stays behind otherwise
+		}
+#endif
 #ifdef SAVE_RECEIVE
         if (mReceiveFile)
         {
@@ -155,7 +359,18 @@ public:
 	virtual int32_t receive(void *dest, uint32_t maxLen) override final
 	{
 		int32_t ret = -1;
-		if (mSocket)
+#if USE_OPENSSL
+		if (mSsl)
+		{
+			ret = SSL_read(mSsl, dest, int(maxLen));
+			if (ret <= 0)
+			{
+				ret = tlsResult(ret);
+			}
+		}
+		else
+#endif
+		if (mSocket != INVALID_SOCKET)
 		{
 			ret = ::recv(mSocket, (char *)dest, int(maxLen), 0);
 		}
@@ -171,9 +386,64 @@ public:
 		return ret;
 	}
 
+	virtual uint32_t getReceiveAvailable(void) override final
+	{
+		uint32_t ret = 0;
+#if USE_OPENSSL
+		if (mSsl)
+		{
+			ret = uint32_t(SSL_pending(mSsl)); // already decrypted; the socket's count below is still encrypted
+		}
+#endif
+		if (mSocket != INVALID_SOCKET)
+		{
+#ifdef _WIN32
+			u_long available = 0;
+			if (ioctlsocket(mSocket, FIONREAD, &available) == 0)
+			{
+				ret += uint32_t(available);
+			}
+#else
+			int available = 0;
+			if (ioctl(mSocket, FIONREAD, &available) == 0 && available > 0)
+			{
+				ret += uint32_t(available);
+			}
+#endif
+		}
+		return ret;
+	}
+
 	virtual int32_t send(const void *data, uint32_t dataLen) override final
 	{
-		int32_t ret = ::send(mSocket, (const char *)data, int(dataLen), 0);
+		int32_t ret;
+#if USE_OPENSSL
+		if (mSsl)
+		{
+			// After SSL_ERROR_WANT_WRITE OpenSSL rejects a retry with fewer bytes than it was first given.
+			// Rate limits or a poll budget can offer less than last time, so wait until all of it can go again.
+			if (dataLen < mTlsPendingWrite)
+			{
+				mTlsWouldBlock = true;
+				return -1;
+			}
+			ret = SSL_write(mSsl, data, int(dataLen));
+			if (ret <= 0)
+			{
+				ret = tlsResult(ret);
+				if (mTlsWouldBlock && mTlsPendingWrite == 0)
+				{
+					mTlsPendingWrite = dataLen;
+				}
+			}
+			else
+			{
+				mTlsPendingWrite = 0;
+			}
+		}
+		else
+#endif
+		ret = ::send(mSocket, (const char *)data, int(dataLen), SEND_FLAGS);
 #ifdef SAVE_SEND
 		if (mSendFile && ret > 0)
 		{
@@ -184,11 +454,62 @@ public:
 		return ret;
 	}
 
+	virtual int32_t sendv(const void * const *buffers, const uint32_t *lengths, uint32_t count) override final
+	{
+#if USE_OPENSSL
+		if (mSsl)
+		{
+			return Wsocket::sendv(buffers, lengths, count); // each write is its own TLS record anyway
+		}
+#endif
+#ifdef SAVE_SEND
+		return Wsocket::sendv(buffers, lengths, count);
+#else
+		if (count == 1)
+		{
+			return send(buffers[0], lengths[0]);
+		}
+		if (count > MAX_SEND_BUFFERS)
+		{
+			count = MAX_SEND_BUFFERS;
+		}
+#ifdef _WIN32
+		WSABUF wsaBuffers[MAX_SEND_BUFFERS];
+		for (uint32_t i = 0; i < count; i++)
+		{
+			wsaBuffers[i].buf = (CHAR *)buffers[i];
+			wsaBuffers[i].len = ULONG(lengths[i]);
+		}
+		DWORD sent = 0;
+		if (WSASend(mSocket, wsaBuffers, DWORD(count), &sent, 0, nullptr, nullptr) != 0)
+		{
+			return -1;
+		}
+		return int32_t(sent);
+#else
+		iovec iov[MAX_SEND_BUFFERS];
+		for (uint32_t i = 0; i < count; i++)
+		{
+			iov[i].iov_base = (void *)buffers[i];
+			iov[i].iov_len = lengths[i];
+		}
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		return int32_t(::sendmsg(mSocket, &msg, SEND_FLAGS));
+#endif
+#endif
+	}
+
 	// Not sure what this is, but it's in the original code so making it available now.
 	virtual void disableNaglesAlgorithm(void) override final
 	{
-		int flag = 1;
-		setsockopt(mSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag)); // Disable Nagle's algorithm
+		if (!mIsUnix && mOptions.mNoDelay)
+		{
+			int flag = 1;
+			setsockopt(mSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag)); // Disable Nagle's algorithm
+		}
 #ifdef _WIN32
 		u_long on = 1;
 		ioctlsocket(mSocket, FIONBIO, &on);
@@ -197,6 +518,107 @@ public:
 #endif
 	}
 
+	virtual bool isDrainedByShortReceive(void) const override final
+	{
+#if USE_OPENSSL
+		if (mSsl)
+		{
+			return false;
+		}
+#endif
+		return true;
+	}
+
+	virtual bool isTls(bool &kernelSend, bool &kernelReceive) const override final
+	{
+		kernelSend = false;
+		kernelReceive = false;
+#if USE_OPENSSL
+		if (mSsl)
+		{
+			kernelSend = BIO_get_ktls_send(SSL_get_wbio(mSsl)) ? true : false;
+			kernelReceive = BIO_get_ktls_recv(SSL_get_rbio(mSsl)) ? true : false;
+			return true;
+		}
+#endif
+		return false;
+	}
+
+	virtual bool getTransportInfo(TransportInfo &info) override final
+	{
+#if defined(TCP_INFO) && defined(__linux__)
+		if (mIsUnix || mIsServer || mSocket == INVALID_SOCKET || mConnectStatus != ConnectStatus::CONNECTED)
+		{
+			return false;
+		}
+		double age = mTransportInfoTimer.peekElapsedSeconds();
+		if (!mTransportInfoValid || age * 1000 >= mOptions.mTransportInfoInterval)
+		{
+			LinuxTcpInfo ti;
+			memset(&ti, 0, sizeof(ti));
+			socklen_t len = sizeof(ti);
+			if (getsockopt(mSocket, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0)
+			{
+				return false;
+			}
+			// Older kernels return a shorter structure; whatever they leave out stays zero
+			mTransportInfo.mRtt = ti.mInfo.tcpi_rtt;
+			mTransportInfo.mRttVariance = ti.mInfo.tcpi_rttvar;
+			mTransportInfo.mMinRtt = ti.mMinRtt;
+			mTransportInfo.mCongestionWindow = ti.mInfo.tcpi_snd_cwnd;
+			mTransportInfo.mSendMss = ti.mInfo.tcpi_snd_mss;
+			mTransportInfo.mUnacked = ti.mInfo.tcpi_unacked;
+			mTransportInfo.mNotSentBytes = ti.mNotSentBytes;
+			mTransportInfo.mRetransmits = ti.mInfo.tcpi_retransmits;
+			mTransportInfo.mTotalRetransmits = ti.mInfo.tcpi_total_retrans;
+			mTransportInfo.mDeliveryRate = ti.mDeliveryRate;
+			mTransportInfo.mBytesAcked = ti.mBytesAcked;
+			mTransportInfo.mBytesReceived = ti.mBytesReceived;
+			mTransportInfoValid = true;
+			mTransportInfoTimer.reset();
+			age = 0;
+		}
+		info = mTransportInfo;
+		info.mAge = uint32_t(age * 1000);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	virtual void setCork(bool corked) override final
+	{
+		if (mIsUnix)
+		{
+			return;
+		}
+#if defined(TCP_CORK)
+		setOption(mSocket, IPPROTO_TCP, TCP_CORK, corked ? 1 : 0);
+#elif defined(TCP_NOPUSH)
+		setOption(mSocket, IPPROTO_TCP, TCP_NOPUSH, corked ? 1 : 0);
+#endif
+	}
+
+	// Sockets are a byte stream, so messages are always framed by the websocket protocol
+	virtual bool isMessageBased(void) const override final
+	{
+		return false;
+	}
+
+	virtual bool sendMessage(const void *data, uint32_t dataLen, uint32_t messageType) override final
+	{
+		return false;
+	}
+
+	virtual const void *peekMessage(uint32_t &dataLen, uint32_t &messageType) override final
+	{
+		return nullptr;
+	}
+
+	virtual void releaseMessage(void) override final
+	{
+	}
+
 	virtual void release(void) override final
 	{
 		delete this;
@@ -204,34 +626,149 @@ public:
 
 	bool isValid(void) const
 	{
-		return mSocket != INVALID_SOCKET;
+		return mConnectStatus == ConnectStatus::IN_PROGRESS || (mConnectStatus == ConnectStatus::CONNECTED && mSocket != INVALID_SOCKET);
 	}
 
 	virtual void close(void) override final
 	{
-		if (mSocket)
+#if USE_OPENSSL
+		if (mSsl)
+		{
+			if (mConnectStatus == ConnectStatus::CONNECTED)
+			{
+				SSL_shutdown(mSsl); // best effort close_notify; we don't wait for the peer's
+			}
+			SSL_free(mSsl);
+			mSsl = nullptr;
+			ERR_clear_error();
+		}
+#endif
+		if (mSocket != INVALID_SOCKET)
 		{
 			closesocket(mSocket);
 		}
-		mSocket = 0;
+		mSocket = INVALID_SOCKET;
+		mTransportInfoValid = false; // a closed socket has no transport info, cached or otherwise
 	}
 
 	virtual bool	wouldBlock(void) override final
 	{
+#if USE_OPENSSL
+		if (mTlsContext)
+		{
+			return mTlsWouldBlock; // socketerrno may be left over from an earlier call
+		}
+#endif
 		return socketerrno == SOCKET_EWOULDBLOCK;
 	}
 
 	virtual bool	inProgress(void) override final
 	{
+#if USE_OPENSSL
+		if (mTlsContext)
+		{
+			return false;
+		}
+#endif
 		return socketerrno == SOCKET_EAGAIN_EINPROGRESS;
 	}
 
-	socket_t server_connect(int port)
+#if USE_OPENSSL
+	// Starts the TLS handshake on our connected socket
+	void startTls(bool isClient)
+	{
+		mSsl = SSL_new(mTlsContext);
+		if (!mSsl || SSL_set_fd(mSsl, int(mSocket)) != 1)
+		{
+			printTlsError("SSL_new");
+			mConnectStatus = ConnectStatus::FAILED;
+			return;
+		}
+		// The transmit buffer grows between retries, and sends may be partial like a plain socket's
+		SSL_set_mode(mSsl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		if (mOptions.mKernelTls)
+		{
+			SSL_set_options(mSsl, SSL_OP_ENABLE_KTLS);
+		}
+		if (isClient)
+		{
+			SSL_set_tlsext_host_name(mSsl, mTlsHostName);
+			if (mOptions.mTlsVerifyPeer)
+			{
+				SSL_set_verify(mSsl, SSL_VERIFY_PEER, nullptr);
+				SSL_set1_host(mSsl, mTlsHostName);
+			}
+			SSL_set_connect_state(mSsl);
+		}
+		else
+		{
+			SSL_set_accept_state(mSsl);
+		}
+		continueTls();
+	}
+
+	// Advances the TLS handshake as far as the socket allows
+	void continueTls(void)
+	{
+		int ret = SSL_do_handshake(mSsl);
+		if (ret == 1)
+		{
+			mConnectStatus = ConnectStatus::CONNECTED;
+			return;
+		}
+		int err = SSL_get_error(mSsl, ret);
+		if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+		{
+			long verify = SSL_get_verify_result(mSsl);
+			if (verify != X509_V_OK)
+			{
+				fprintf(stderr, "ERROR: TLS certificate rejected: %s\n", X509_verify_cert_error_string(verify));
+				ERR_clear_error();
+			}
+			else
+			{
+				printTlsError("TLS handshake failed");
+			}
+			mConnectStatus = ConnectStatus::FAILED;
+		}
+	}
+
+	// Converts a failed SSL_read or SSL_write into the socket style result: zero once the peer
+	// has closed, otherwise -1, with 'wouldBlock' reporting whether to simply try again later
+	int32_t tlsResult(int ret)
+	{
+		int err = SSL_get_error(mSsl, ret);
+		mTlsWouldBlock = err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+		if (err == SSL_ERROR_ZERO_RETURN)
+		{
+			return 0;
+		}
+		if (!mTlsWouldBlock)
+		{
+			ERR_clear_error();
+		}
+		return -1;
+	}
+#endif
+
+	socket_t server_connect(int port,bool reusePort)
 	{
 		socket_t listenSocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
 		if (listenSocket == INVALID_SOCKET)
 			return INVALID_SOCKET;
 
+		if (reusePort)
+		{
+#ifdef SO_REUSEPORT
+			int flag = 1;
+			setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, (char*)&flag, sizeof(flag));
+#else
+			fprintf(stderr, "WARNING: SO_REUSEPORT is not supported on this platform\n");
+#endif
+		}
+
+		applyOptions(listenSocket);
+
 		sockaddr_in addr = { 0 };
 		addr.sin_family = AF_INET;
 		addr.sin_port = htons(u_short(port));
@@ -258,45 +795,295 @@ public:
 		return listenSocket;
 	}
 
-	socket_t hostname_connect(const char *hostname, int port)
+#ifndef _WIN32
+	// Fills in the address of a Unix domain socket; false if the path doesn't fit
+	bool unix_address(const char *path, sockaddr_un &addr)
 	{
-		addrinfo hints;
-		addrinfo *result;
-		addrinfo *p;
-		int ret;
-		socket_t sockfd = INVALID_SOCKET;
-		char sport[16];
-		memset(&hints, 0, sizeof(hints));
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		size_t len = strlen(path);
+		if (len == 0 || len >= sizeof(addr.sun_path))
+		{
+			fprintf(stderr, "ERROR: invalid unix socket path: %s\n", path);
+			return false;
+		}
+		memcpy(addr.sun_path, path, len);
+		return true;
+	}
+#endif
 
-		hints.ai_family = AF_UNSPEC;
-		hints.ai_socktype = SOCK_STREAM;
-		wplatform::stringFormat(sport, 16, "%d", port);
+	// Listens on a Unix domain socket at this path, replacing any stale socket file left there
+	socket_t unix_server_connect(const char *path)
+	{
+#ifdef _WIN32
+		fprintf(stderr, "ERROR: unix domain sockets are not supported on this platform\n");
+		return INVALID_SOCKET;
+#else
+		sockaddr_un addr;
+		if (!unix_address(path, addr))
+		{
+			return INVALID_SOCKET;
+		}
+		socket_t listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listenSocket == INVALID_SOCKET)
+			return INVALID_SOCKET;
+		applyOptions(listenSocket);
 
-		if ((ret = getaddrinfo(hostname, sport, &hints, &result)) != 0)
+		// A socket file left by a server which exited refuses connections and can be replaced. One which
+		// accepts belongs to a running server; like binding a TCP port which is in use, that has to fail.
+		socket_t probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (probe != INVALID_SOCKET)
 		{
-#ifdef _MSC_VER
-            fprintf(stderr, "getaddrinfo: %s\n", gai_strerrorA(ret));
+			setBlockingInternal(probe, false); // a live server with a full backlog reports EAGAIN rather than blocking us
+			int probeResult = connect(probe, (sockaddr*)&addr, sizeof(addr));
+			int probeError = errno;
+			closesocket(probe);
+			if (probeResult == 0 || probeError == EAGAIN)
+			{
+				fprintf(stderr, "ERROR: unix socket %s is already in use\n", path);
+				closesocket(listenSocket);
+				return INVALID_SOCKET;
+			}
+			if (probeError == ECONNREFUSED)
+			{
+				unlink(path);
+			}
+		}
+		bool ok = false;
+		if (bind(listenSocket, (sockaddr*)&addr, sizeof(addr)) == 0)
+		{
+			wplatform::stringFormat(mUnixPath, sizeof(mUnixPath), "%s", path);
+			if (::listen(listenSocket, SOMAXCONN) == 0)
+			{
+				ok = true;
+			}
+		}
+		if (ok)
+		{
+			setBlockingInternal(listenSocket, false);
+		}
+		else
+		{
+			closesocket(listenSocket);
+			listenSocket = INVALID_SOCKET;
+		}
+		return listenSocket;
+#endif
+	}
+
+	socket_t unix_connect(const char *path)
+	{
+#ifdef _WIN32
+		fprintf(stderr, "ERROR: unix domain sockets are not supported on this platform\n");
+		return INVALID_SOCKET;
+#else
+		sockaddr_un addr;
+		if (!unix_address(path, addr))
+		{
+			return INVALID_SOCKET;
+		}
+		socket_t sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sockfd != INVALID_SOCKET)
+		{
+			applyOptions(sockfd);
+		}
+		if (sockfd != INVALID_SOCKET && connect(sockfd, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR)
+		{
+			closesocket(sockfd);
+			sockfd = INVALID_SOCKET;
+		}
+		if (sockfd != INVALID_SOCKET)
+		{
+			// A local connect completes immediately; from here on it behaves like any other client socket
+			setBlockingInternal(sockfd, false);
+		}
+		return sockfd;
+#endif
+	}
+
+	// Starts resolving the host name without blocking; 'pollConnect' makes the connection once it resolves
+	void hostname_connect(const char *hostname, int port, uint32_t dnsCacheTime)
+	{
+		mLookup = dnsresolver::Lookup::create(hostname, port, dnsCacheTime);
+		mConnectStatus = ConnectStatus::IN_PROGRESS;
+		pollConnect(); // numeric and cached addresses can start connecting right away
+	}
+
+	// Races connects to the resolved addresses (RFC 8305 'happy eyeballs').
+	// A new attempt starts every mConnectAttemptDelay milliseconds, or as soon as one fails,
+	// and the first to complete wins; so an unreachable address only costs the delay, not a TCP timeout.
+	virtual ConnectStatus pollConnect(void) override final
+	{
+		if (mConnectStatus != ConnectStatus::IN_PROGRESS)
+		{
+			return mConnectStatus;
+		}
+#if USE_OPENSSL
+		if (mSsl)
+		{
+			continueTls();
+			return mConnectStatus;
+		}
+#endif
+		if (mAddressOrder.empty())
+		{
+			dnsresolver::Status status = mLookup->getStatus();
+			if (status == dnsresolver::Status::FAILED)
+			{
+				fprintf(stderr, "%s\n", mLookup->getError());
+				mConnectStatus = ConnectStatus::FAILED;
+			}
+			else if (status == dnsresolver::Status::RESOLVED)
+			{
+				orderAddresses();
+				startAttempt();
+			}
+			return mConnectStatus;
+		}
+		bool failed = pollAttempts();
+		if (mConnectStatus == ConnectStatus::IN_PROGRESS && !isTlsHandshaking())
+		{
+			// A failure starts the next address right away rather than waiting out the delay (RFC 8305 section 5)
+			if (mAttempts.empty() || (mAttempts.size() < MAX_CONNECT_ATTEMPTS && (failed || mAttemptTimer.peekElapsedSeconds() * 1000 >= mConnectAttemptDelay)))
+			{
+				startAttempt();
+			}
+			if (mAttempts.empty() && mConnectStatus == ConnectStatus::IN_PROGRESS)
+			{
+				fprintf(stderr, "ERROR: unable to connect to any resolved address\n");
+				mConnectStatus = ConnectStatus::FAILED;
+			}
+		}
+		return mConnectStatus;
+	}
+
+	// True once a connect has won and its TLS handshake is under way
+	bool isTlsHandshaking(void) const
+	{
+#if USE_OPENSSL
+		return mSsl != nullptr;
 #else
-			fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+		return false;
 #endif
-			return 1;
+	}
+
+	// Alternates address families, starting with the family getaddrinfo preferred, so a
+	// broken IPv6 (or IPv4) path is never tried several times in a row
+	void orderAddresses(void)
+	{
+		std::vector< uint32_t > preferred;
+		std::vector< uint32_t > other;
+		uint32_t count = mLookup->getAddressCount();
+		int32_t firstFamily = count ? mLookup->getAddress(0)->mFamily : 0;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			(mLookup->getAddress(i)->mFamily == firstFamily ? preferred : other).push_back(i);
+		}
+		for (size_t i = 0; i < preferred.size() || i < other.size(); i++)
+		{
+			if (i < preferred.size())
+			{
+				mAddressOrder.push_back(preferred[i]);
+			}
+			if (i < other.size())
+			{
+				mAddressOrder.push_back(other[i]);
+			}
 		}
-		for (p = result; p != NULL; p = p->ai_next)
+	}
+
+	// Starts a non-blocking connect to the next address, skipping any which fail immediately
+	void startAttempt(void)
+	{
+		while (mNextAddress < mAddressOrder.size())
 		{
-			sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+			const dnsresolver::Address *a = mLookup->getAddress(mAddressOrder[mNextAddress++]);
+			socket_t sockfd = socket(a->mFamily, a->mSocketType, a->mProtocol);
 			if (sockfd == INVALID_SOCKET)
 			{
 				continue;
 			}
-			if (connect(sockfd, p->ai_addr, int(p->ai_addrlen)) != SOCKET_ERROR)
+			setBlockingInternal(sockfd, false);
+			applyOptions(sockfd); // before connecting, so the buffer sizes shape the window the handshake negotiates
+			if (connect(sockfd, (const sockaddr *)a->mAddress, int(a->mAddressLength)) != SOCKET_ERROR)
 			{
-				break;
+				connected(sockfd);
+				return;
+			}
+			if (socketerrno == SOCKET_CONNECT_PENDING)
+			{
+				mAttempts.push_back(sockfd);
+				mAttemptTimer.reset();
+				return;
 			}
 			closesocket(sockfd);
-			sockfd = INVALID_SOCKET;
 		}
-		freeaddrinfo(result);
-		return sockfd;
+	}
+
+	// Checks every connect in flight; a socket is writable once its connect has finished either way.
+	// Returns true if any of them failed.
+	bool pollAttempts(void)
+	{
+		bool ret = false;
+		if (mAttempts.empty())
+		{
+			return ret;
+		}
+		pollfd pfds[MAX_CONNECT_ATTEMPTS];
+		uint32_t count = uint32_t(mAttempts.size()) < MAX_CONNECT_ATTEMPTS ? uint32_t(mAttempts.size()) : MAX_CONNECT_ATTEMPTS;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			pfds[i].fd = mAttempts[i];
+			pfds[i].events = POLLOUT;
+			pfds[i].revents = 0;
+		}
+		if (socketpoll(pfds, count, 0) <= 0)
+		{
+			return ret;
+		}
+		for (uint32_t i = count; i-- > 0; )
+		{
+			if (pfds[i].revents == 0)
+			{
+				continue;
+			}
+			socket_t sockfd = mAttempts[i];
+			mAttempts.erase(mAttempts.begin() + i);
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, (char *)&err, &len) == 0 && err == 0)
+			{
+				connected(sockfd);
+				return false;
+			}
+			closesocket(sockfd);
+			ret = true;
+		}
+		return ret;
+	}
+
+	// This attempt won the race; the others are abandoned
+	void connected(socket_t sockfd)
+	{
+		closeAttempts();
+		mSocket = sockfd;
+#if USE_OPENSSL
+		if (mTlsContext)
+		{
+			startTls(true);
+			return;
+		}
+#endif
+		mConnectStatus = ConnectStatus::CONNECTED;
+	}
+
+	void closeAttempts(void)
+	{
+		for (auto &i : mAttempts)
+		{
+			closesocket(i);
+		}
+		mAttempts.clear();
 	}
 
 	// If we are a server, we poll for new connections.
@@ -306,17 +1093,157 @@ public:
 	{
 		Wsocket *ret = nullptr;
 
+		socket_t clientSocket = acceptSocket();
+		if (clientSocket != INVALID_SOCKET)
+		{
+			ret = createAccepted(clientSocket);
+		}
+
+		return ret;
+	}
+
+	// Drains the listen backlog, up to 'maxClients', in a single call
+	virtual uint32_t pollServerBatch(Wsocket **clients, uint32_t maxClients) override final
+	{
+		uint32_t ret = 0;
+
+		while (ret < maxClients)
+		{
+			socket_t clientSocket = acceptSocket();
+			if (clientSocket == INVALID_SOCKET)
+			{
+				break;
+			}
+			clients[ret++] = createAccepted(clientSocket);
+		}
+
+		return ret;
+	}
+
+	virtual uint32_t rejectPending(uint32_t maxClients) override final
+	{
+		uint32_t ret = 0;
+
+		while (ret < maxClients)
+		{
+			socket_t clientSocket = acceptSocket();
+			if (clientSocket == INVALID_SOCKET)
+			{
+				break;
+			}
+			closesocket(clientSocket);
+			ret++;
+		}
+
+		return ret;
+	}
+
+	Wsocket *createAccepted(socket_t clientSocket)
+	{
+#if USE_OPENSSL
+		if (mTlsContext)
+		{
+			return static_cast<Wsocket *>(new WsocketImpl(clientSocket, mOptions, mTlsContext));
+		}
+#endif
+		return static_cast<Wsocket *>(new WsocketImpl(clientSocket, mIsUnix, mOptions));
+	}
+
+	// Accepts one waiting connection as a non-blocking socket, so a slow client can never stall the server.
+	// On Linux accept4 does this in one system call and also keeps the socket out of child processes.
+	socket_t acceptSocket(void)
+	{
+		socket_t clientSocket = INVALID_SOCKET;
+
 		if (mIsServer && mSocket != INVALID_SOCKET)
 		{
-			socket_t clientSocket = ::accept(mSocket, 0, 0);
+#ifdef __linux__
+			clientSocket = ::accept4(mSocket, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+			clientSocket = ::accept(mSocket, 0, 0);
 			if (clientSocket != INVALID_SOCKET)
 			{
-				WsocketImpl *w = new WsocketImpl(clientSocket);
-				ret = static_cast<Wsocket *>(w);
+				setBlockingInternal(clientSocket, false);
 			}
+#endif
 		}
 
-		return ret;
+		return clientSocket;
+	}
+
+	// Applies the tuning options which were set; options left at zero cost no system calls
+	void applyOptions(socket_t socket)
+	{
+		if (socket == INVALID_SOCKET)
+		{
+			return;
+		}
+		if (mOptions.mSendBufferSize)
+		{
+			setOption(socket, SOL_SOCKET, SO_SNDBUF, int(mOptions.mSendBufferSize));
+		}
+		if (mOptions.mReceiveBufferSize)
+		{
+			setOption(socket, SOL_SOCKET, SO_RCVBUF, int(mOptions.mReceiveBufferSize));
+		}
+#ifdef SO_BUSY_POLL
+		if (mOptions.mBusyPoll)
+		{
+			setOption(socket, SOL_SOCKET, SO_BUSY_POLL, int(mOptions.mBusyPoll));
+		}
+#endif
+		if (mIsUnix)
+		{
+			return;
+		}
+#ifdef TCP_QUICKACK
+		if (mOptions.mQuickAck)
+		{
+			setOption(socket, IPPROTO_TCP, TCP_QUICKACK, 1);
+		}
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+		if (mOptions.mNotSentLowWater)
+		{
+			setOption(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, int(mOptions.mNotSentLowWater));
+		}
+#endif
+#ifdef TCP_USER_TIMEOUT
+		if (mOptions.mUserTimeout)
+		{
+			setOption(socket, IPPROTO_TCP, TCP_USER_TIMEOUT, int(mOptions.mUserTimeout));
+		}
+#endif
+		if (mOptions.mKeepAlive)
+		{
+			setOption(socket, SOL_SOCKET, SO_KEEPALIVE, 1);
+#ifdef TCP_KEEPIDLE
+			if (mOptions.mKeepAliveIdle)
+			{
+				setOption(socket, IPPROTO_TCP, TCP_KEEPIDLE, int(mOptions.mKeepAliveIdle));
+			}
+#endif
+#ifdef TCP_KEEPINTVL
+			if (mOptions.mKeepAliveInterval)
+			{
+				setOption(socket, IPPROTO_TCP, TCP_KEEPINTVL, int(mOptions.mKeepAliveInterval));
+			}
+#endif
+#ifdef TCP_KEEPCNT
+			if (mOptions.mKeepAliveCount)
+			{
+				setOption(socket, IPPROTO_TCP, TCP_KEEPCNT, int(mOptions.mKeepAliveCount));
+			}
+#endif
+		}
+	}
+
+	void setOption(socket_t socket, int level, int option, int value)
+	{
+		if (setsockopt(socket, level, option, (const char *)&value, sizeof(value)) != 0)
+		{
+			fprintf(stderr, "WARNING: unable to set socket option %d to %d\n", option, value);
+		}
 	}
 
 	void setBlockingInternal(socket_t socket, bool blocking)
@@ -335,7 +1262,27 @@ public:
 	}
 
 	bool		mIsServer{ false };
+	bool		mIsUnix{ false };		// A Unix domain socket rather than TCP
 	socket_t	mSocket{ INVALID_SOCKET };
+	char		mUnixPath[128]{};		// Socket file created by a Unix domain server; removed when it closes
+	ConnectStatus	mConnectStatus{ ConnectStatus::CONNECTED };
+	dnsresolver::Lookup	*mLookup{ nullptr };	// Addresses of the host a client is connecting to
+	std::vector< uint32_t >	mAddressOrder;	// Resolved addresses in the order they will be tried
+	uint32_t	mNextAddress{ 0 };		// Next entry in mAddressOrder to try
+	std::vector< socket_t >	mAttempts;	// Connects still in flight
+	timer::Timer	mAttemptTimer;		// Time since the last attempt was started
+	uint32_t	mConnectAttemptDelay{ 250 };	// Milliseconds to wait on an attempt before starting the next
+	SocketOptions	mOptions;			// Tuning applied to our socket, and to every socket a server accepts
+	TransportInfo	mTransportInfo;		// The last TCP_INFO sample
+	bool		mTransportInfoValid{ false };
+	timer::Timer	mTransportInfoTimer;	// Time since mTransportInfo was sampled
+#if USE_OPENSSL
+	SSL_CTX		*mTlsContext{ nullptr };	// Set for TLS clients, TLS servers and the connections they accept
+	SSL			*mSsl{ nullptr };			// The TLS session once connected
+	bool		mTlsWouldBlock{ false };	// The last TLS read or write needs the socket to become ready
+	uint32_t	mTlsPendingWrite{ 0 };		// Length of a TLS write which has to be retried; retries may not be shorter
+	char		mTlsHostName[128]{};		// Server name a client sends and verifies
+#endif
 #ifdef SAVE_RECEIVE
     FILE        *mReceiveFile{ nullptr };
 #endif
@@ -433,6 +1380,25 @@ public:
 
     }
 
+    virtual bool isMessageBased(void) const override final
+    {
+        return false;
+    }
+
+    virtual bool sendMessage(const void *data, uint32_t dataLen, uint32_t messageType) override final
+    {
+        return true;
+    }
+
+    virtual const void *peekMessage(uint32_t &dataLen, uint32_t &messageType) override final
+    {
+        return nullptr;
+    }
+
+    virtual void releaseMessage(void) override final
+    {
+    }
+
     // Close the socket and release this class
     virtual void release(void) override final
     {
@@ -456,14 +1422,19 @@ public:
     FILE    *mPlaybackFile{ nullptr };
 };
 
-Wsocket *Wsocket::create(const char *hostName, int32_t port)
+Wsocket *Wsocket::create(const char *hostName, int32_t port, const SocketOptions *options)
 {
+	SocketOptions defaultOptions;
+	if (options == nullptr)
+	{
+		options = &defaultOptions;
+	}
 	if (strcmp(hostName, SHARED_SERVER) == 0 ||
 		strcmp(hostName, SHARED_CLIENT) == 0)
 	{
-		return createSocketSharedMemory(hostName, port);
+		return createSocketSharedMemory(hostName, port, *options);
 	}
-	auto ret = new WsocketImpl(hostName, port);
+	auto ret = new WsocketImpl(hostName, port, *options);
 	if (!ret->isValid())
 	{
 		delete ret;
@@ -491,6 +1462,11 @@ void Wsocket::startupSockets(void)
 
 	rc = WSAStartup(MAKEWORD(2, 2), &wsaData);
 #endif
+#if USE_OPENSSL && !defined(_WIN32)
+	// OpenSSL writes to the socket itself and can't pass MSG_NOSIGNAL, so writing to a
+	// connection the peer has closed would otherwise kill the process
+	signal(SIGPIPE, SIG_IGN);
+#endif
 
 }
 
@@ -10,15 +10,129 @@
 #define SHARED_CLIENT "sharedclient"	// Open a client connection using shared memory
 #define SOCKET_SERVER "server"			// Open a socket connection as a server
 
+// For same host connections a Unix domain socket avoids the TCP loopback stack; the port is ignored
+#define UNIX_SOCKET_PREFIX "unix:"			// 'unix:/path/to/socket' connects to a Unix domain socket
+#define UNIX_SERVER_PREFIX "unixserver:"	// 'unixserver:/path/to/socket' listens on a Unix domain socket
+
+// Encrypted connections (wss://) need a build with OpenSSL (USE_OPENSSL)
+#define TLS_SOCKET_PREFIX "tls:"		// 'tls:hostname' connects to this host with TLS
+#define TLS_SERVER "tlsserver"			// Open a TLS socket connection as a server; see mTlsCertificateFile
+
+#define DEFAULT_SHARED_RING_SIZE (1024*16)	// Default size of each shared memory ring (one per direction)
+
 namespace wsocket
 {
 
+// Optional per connection settings passed to 'create'
+struct SocketOptions
+{
+	// Size of each shared memory ring in bytes, including the ring header.
+	// For a shared memory client zero means use whatever size the server created; otherwise it must match.
+	uint32_t	mSharedMemoryRingSize{ DEFAULT_SHARED_RING_SIZE };
+	// Rings of 2mb or larger are backed by huge pages to reduce TLB misses
+	bool		mSharedMemoryHugePages{ true };
+	// The client to server ring accepts messages from many threads at once without locking: the client Wsocket's
+	// sendMessage is then thread safe. Those threads all share the one client Wsocket, so they are in one process;
+	// a connection has a single client process, and another one can't attach while it is alive.
+	// A WebSocket wrapping the connection is still single threaded (sendText, sendBinary and the rest share its
+	// buffers and counters), so threads which send at once must call sendMessage on the Wsocket itself.
+	// Both the server and the client must set this.
+	bool		mSharedMemoryMultiProducer{ false };
+	// Milliseconds a shared memory peer may go without polling before the connection is treated as dead.
+	// A peer whose process exits is detected regardless; zero disables the heartbeat check (e.g. when debugging).
+	uint32_t	mSharedMemoryHeartbeatTimeout{ 10000 };
+	// TCP servers bind with SO_REUSEPORT so several listeners (i.e. one per thread) can share a port,
+	// letting the kernel spread new connections across them. Binding fails where this isn't supported.
+	bool		mReusePort{ false };
+	// Servers accept at most this many waiting connections per poll
+	uint32_t	mAcceptBatchSize{ 64 };
+	// Servers refuse new connections while this many accepted connections are still in their handshake,
+	// shedding load early rather than letting every handshake time out. Zero means no limit.
+	uint32_t	mMaxPendingHandshakes{ 0 };
+	// Seconds a resolved host name is reused by later connections; zero resolves every time
+	uint32_t	mDnsCacheTime{ 60 };
+	// When a host has several addresses, clients start a connect to the next one (alternating IPv6 and IPv4)
+	// if the current one hasn't completed within this many milliseconds, and keep whichever connects first.
+	uint32_t	mConnectAttemptDelay{ 250 };
+
+	// Socket tuning, applied when a socket is created or accepted. Zero (or false) leaves the system default,
+	// costing nothing. Options the platform doesn't support are ignored; TCP options are ignored for Unix sockets.
+	// Latency sensitive connections typically want mQuickAck, a small mNotSentLowWater and perhaps mBusyPoll;
+	// bulk transfers want large buffers.
+	// Kernel send and receive buffer sizes in bytes (SO_SNDBUF / SO_RCVBUF). Servers also set these on
+	// the listener, since the receive window is negotiated before a connection is accepted.
+	uint32_t	mSendBufferSize{ 0 };
+	uint32_t	mReceiveBufferSize{ 0 };
+	// Microseconds a receive may busy poll the device queue instead of sleeping (SO_BUSY_POLL; Linux only)
+	uint32_t	mBusyPoll{ 0 };
+	// Send small writes immediately rather than waiting to combine them (TCP_NODELAY), once the handshake is done
+	bool		mNoDelay{ true };
+	// Acknowledge received data immediately instead of delaying ACKs (TCP_QUICKACK; Linux only).
+	// The kernel may fall back to delayed ACKs later in the connection's life.
+	bool		mQuickAck{ false };
+	// Most unsent bytes the kernel will queue before the socket stops accepting writes (TCP_NOTSENT_LOWAT).
+	// Data then waits in our own transmit buffer, where newer messages can still be coalesced.
+	uint32_t	mNotSentLowWater{ 0 };
+	// Milliseconds sent data may stay unacknowledged before the connection is dropped (TCP_USER_TIMEOUT; Linux only)
+	uint32_t	mUserTimeout{ 0 };
+	// Send keepalive probes on an idle connection (SO_KEEPALIVE). Probes start after mKeepAliveIdle seconds
+	// of silence and repeat every mKeepAliveInterval seconds; the connection is dropped after mKeepAliveCount
+	// unanswered probes.
+	bool		mKeepAlive{ false };
+	uint32_t	mKeepAliveIdle{ 0 };
+	uint32_t	mKeepAliveInterval{ 0 };
+	uint32_t	mKeepAliveCount{ 0 };
+
+	// TLS. After the handshake the session keys are handed to the kernel (kTLS) where it supports the
+	// cipher, so records are encrypted and decrypted without another copy through user space.
+	// Otherwise OpenSSL encrypts in user space as usual.
+	bool		mKernelTls{ true };
+	// Clients verify the server's certificate chain and host name; only turn this off for testing
+	bool		mTlsVerifyPeer{ true };
+	// PEM file of the CA certificates a client trusts; null uses the system's
+	const char	*mTlsCaFile{ nullptr };
+	// PEM files holding the certificate chain and private key a TLS server presents; read when the server is created
+	const char	*mTlsCertificateFile{ nullptr };
+	const char	*mTlsPrivateKeyFile{ nullptr };
+	// Milliseconds a TCP_INFO sample is reused before the kernel is asked again; see Wsocket::getTransportInfo
+	uint32_t	mTransportInfoInterval{ 100 };
+};
+
+// The kernel's view of a TCP connection, sampled from TCP_INFO. Fields the kernel doesn't report stay zero.
+struct TransportInfo
+{
+	uint32_t	mRtt{ 0 };					// Smoothed round trip time in microseconds
+	uint32_t	mRttVariance{ 0 };			// Variation of the round trip time in microseconds
+	uint32_t	mMinRtt{ 0 };				// Lowest round trip time seen in microseconds
+	uint32_t	mCongestionWindow{ 0 };		// Segments which may be in flight
+	uint32_t	mSendMss{ 0 };				// Bytes per segment
+	uint32_t	mUnacked{ 0 };				// Segments sent but not yet acknowledged
+	uint32_t	mNotSentBytes{ 0 };			// Bytes queued in the kernel which haven't been sent
+	uint32_t	mRetransmits{ 0 };			// Timeouts on the oldest unacknowledged segment; non-zero means a stall
+	uint32_t	mTotalRetransmits{ 0 };		// Segments retransmitted over the life of the connection
+	uint64_t	mDeliveryRate{ 0 };			// Most recent estimate of bytes delivered per second
+	uint64_t	mBytesAcked{ 0 };			// Bytes the peer has acknowledged
+	uint64_t	mBytesReceived{ 0 };		// Bytes received from the peer
+	uint32_t	mAge{ 0 };					// Milliseconds since this sample was taken
+};
+
+// Progress of a client connection; see 'pollConnect'
+enum class ConnectStatus : uint32_t
+{
+	CONNECTED,		// Ready to send and receive
+	IN_PROGRESS,	// Still resolving the host name or waiting for the connect to complete
+	FAILED,			// Every address failed; the socket is unusable
+};
+
 class Wsocket
 {
 public:
 	// Create's a socket for this hostname and port; returns null if it failed
 	// Use 'server' as the hostName to create a server connection
-	static Wsocket *create(const char *hostName,int32_t port);
+	// Use 'unix:/path' or 'unixserver:/path' for a Unix domain socket client or server
+	// Use 'tls:hostname' or 'tlsserver' for a TLS client or server
+	// 'options' is optional; if null the defaults are used
+	static Wsocket *create(const char *hostName,int32_t port,const SocketOptions *options=nullptr);
     static Wsocket *create(const char *playbackFile);
 
 	// On some platforms the sockets interface has to be manually initialized once on startup and then shutdown
@@ -32,6 +146,41 @@ public:
 	// It is the caller's responsibility to release it when finished
 	virtual Wsocket *pollServer(void) = 0;
 
+	// Accepts up to 'maxClients' waiting connections at once, storing them in 'clients'.
+	// Returns the number accepted; the caller releases each of them when finished.
+	virtual uint32_t pollServerBatch(Wsocket **clients, uint32_t maxClients)
+	{
+		uint32_t ret = 0;
+		while (ret < maxClients)
+		{
+			Wsocket *w = pollServer();
+			if (!w)
+			{
+				break;
+			}
+			clients[ret++] = w;
+		}
+		return ret;
+	}
+
+	// Accepts and immediately closes up to 'maxClients' waiting connections; used to shed load.
+	// Returns the number refused.
+	virtual uint32_t rejectPending(uint32_t maxClients)
+	{
+		uint32_t ret = 0;
+		while (ret < maxClients)
+		{
+			Wsocket *w = pollServer();
+			if (!w)
+			{
+				break;
+			}
+			w->release();
+			ret++;
+		}
+		return ret;
+	}
+
 	// performs the select operation on this socket
 	virtual void select(int32_t timeOut,size_t txBufSize) = 0;
 
@@ -43,9 +192,75 @@ public:
 	// A return code >0 is number of bytes received.
 	virtual int32_t receive(void *dest, uint32_t maxLen) = 0;
 
+	// Returns how many bytes can be received right now without blocking (FIONREAD).
+	// Zero means nothing is waiting, or the transport can't tell.
+	virtual uint32_t getReceiveAvailable(void)
+	{
+		return 0;
+	}
+
 	// Send this much data to the socket
 	virtual int32_t send(const void *data, uint32_t dataLen) = 0;
 
+	// Sends 'count' buffers in order, gathered into one call where the transport allows it.
+	// Returns the total bytes sent, which may stop part way through a buffer, or the result of a failed 'send'.
+	virtual int32_t sendv(const void * const *buffers, const uint32_t *lengths, uint32_t count)
+	{
+		int32_t ret = 0;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			int32_t sent = send(buffers[i], lengths[i]);
+			if (sent <= 0)
+			{
+				return ret ? ret : sent;
+			}
+			ret += sent;
+			if (uint32_t(sent) < lengths[i])
+			{
+				break;
+			}
+		}
+		return ret;
+	}
+
+	// Client connections are made without blocking; the host name is resolved in the background and
+	// the connect completes later. Call this until it returns CONNECTED before sending or receiving.
+	// Connections accepted by a TLS server also start IN_PROGRESS until their TLS handshake completes.
+	virtual ConnectStatus pollConnect(void)
+	{
+		return ConnectStatus::CONNECTED;
+	}
+
+	// Returns true if a receive which comes back short means nothing more is waiting, as with a plain
+	// stream socket. TLS hands over a record at a time, so those readers keep going until it would block.
+	virtual bool isDrainedByShortReceive(void) const
+	{
+		return true;
+	}
+
+	// Returns true if the connection is encrypted with TLS. 'kernelSend' and 'kernelReceive' report
+	// whether the kernel took over the encryption (kTLS) in each direction.
+	virtual bool isTls(bool &kernelSend, bool &kernelReceive) const
+	{
+		kernelSend = false;
+		kernelReceive = false;
+		return false;
+	}
+
+	// Fills in the kernel's TCP statistics for this connection; returns false if the transport has none
+	// (Unix domain sockets, shared memory, playback, or a platform without TCP_INFO).
+	// Samples are cached for SocketOptions::mTransportInfoInterval, so this is cheap to call every poll.
+	virtual bool getTransportInfo(TransportInfo &info)
+	{
+		return false;
+	}
+
+	// Asks the transport to hold back partial packets until uncorked (TCP_CORK), so several
+	// writes go out as full packets. Does nothing where it isn't supported.
+	virtual void setCork(bool corked)
+	{
+	}
+
 	// Close the socket
 	virtual void	close(void) = 0;
 
@@ -55,9 +270,25 @@ public:
 	// Returns true if a socket send is currently 'in progress'
 	virtual bool	inProgress(void) = 0;
 
-	// Not sure what this is, but it's in the original code so making it available now.
+	// Called once the websocket handshake completes: switches the socket to non-blocking and,
+	// unless SocketOptions::mNoDelay was cleared, disables Nagle's algorithm.
 	virtual void disableNaglesAlgorithm(void) = 0;
 
+	// Returns true if this transport preserves message boundaries (i.e. shared memory).
+	// Message based transports carry whole messages, so no websocket framing or masking is needed once connected.
+	virtual bool isMessageBased(void) const = 0;
+
+	// Send one whole message of this type (the websocket opcode).
+	// Returns false if there is no room to send it right now.
+	virtual bool sendMessage(const void *data, uint32_t dataLen, uint32_t messageType) = 0;
+
+	// Returns a pointer to the next received message, in place, or null if none is available.
+	// The message stays valid until 'releaseMessage' is called.
+	virtual const void *peekMessage(uint32_t &dataLen, uint32_t &messageType) = 0;
+
+	// Releases the message returned by 'peekMessage'
+	virtual void releaseMessage(void) = 0;
+
 	// Close the socket and release this class
 	virtual void release(void) = 0;
 protected: